@@ -29,6 +29,36 @@
 #define HAS_JETSON_NANO
 #endif
 
+#define MAX_VIDEO_LAYERS 3
+
+// the branches of create_instance() that get their own CPU set and scheduling class.
+enum {
+    SCHED_CAPTURE,
+    SCHED_ENCODE,
+    SCHED_ANALYTICS, // motioncells, facedetect, edgedetect and cvtracker.
+    SCHED_HLS,
+    SCHED_RECORD, // splitfile, udp and the record pipelines.
+    SCHED_WEBRTC,
+    SCHED_HTTP, // the main loop, the threads it starts follow it.
+    SCHED_BRANCHES
+};
+
+#define MOTION_MAX_ZONES 8
+
+struct _motion_zone { // in percents of the frame.
+    int32_t x;
+    int32_t y;
+    int32_t width;
+    int32_t height;
+};
+
+struct _sched_branch {
+    gchar *cpus;      // "0-3,6", empty for the affinity of the process.
+    gboolean fifo;    // SCHED_FIFO at priority, otherwise SCHED_OTHER at a non zero nice, or the ones of the process.
+    int32_t priority;
+    int32_t nice;
+};
+
 struct _webrtc {
     gboolean enable;
     struct _turnserver {
@@ -39,10 +69,41 @@ struct _webrtc {
     } turn;
     const gchar *stun;
     struct _udpsink {
+        gboolean enable; // RTP out for the external consumers, always on without app_sink.
         gboolean multicast;
         int32_t port;
         gchar *addr;
     } udpsink;
+    struct _abr {
+        gboolean enable;
+        int32_t min_kbps;
+        int32_t max_kbps; // 0 is the nominal bitrate of the capture size.
+        int32_t max_rtt;  // milliseconds, back off above it.
+        int32_t interval; // milliseconds of get-stats polling.
+    } abr;
+    struct _simulcast {
+        gboolean enable;
+        int32_t count;
+        int32_t layers[MAX_VIDEO_LAYERS - 1]; // downscale factors of the extra layers, i.e: 2 and 4.
+    } simulcast;
+    int32_t temporal_layers; // 2 for L1T2, 3 for L1T3 of vp8enc/vp9enc, otherwise disabled.
+    gboolean single_pipeline; // the peers are webrtcbins of the main pipeline.
+    int32_t thread_budget;    // streaming threads of the peer send pipelines, the next peers join the main pipeline. 0 is unlimited.
+    struct _client_queue {
+        int32_t max_ms; // video backlog of a peer before dropping to its next keyframe, 0 for none.
+    } client_queue;
+    struct _dtls {
+        gboolean shared;     // one ECDSA P-256 certificate of ~/.config/gwc for all the webrtcbin.
+        int32_t rotate_days; // a new one is generated after it.
+    } dtls;
+    struct _pool {
+        int32_t size;         // app_sink send pipelines kept in READY, 0 builds them on connection.
+        int32_t refill_delay; // milliseconds after a claim before its replacement is built.
+    } pool;
+    struct _gop_cache {
+        gboolean enable;
+        int32_t max_kb; // a longer GOP is not cached, the new consumers ask for a keyframe instead.
+    } gop_cache;
 };
 
 struct _http_data {
@@ -68,6 +129,15 @@ struct _GstConfigData {
     _v4l2src_data v4l2src_data;
     int32_t clients;             // How many clients can be allowed to connect to the server.
     gchar *videnc;           // i.e; h264,h265,vp9
+    struct _encoder {
+        gboolean probe; // benchmark the available encoders at startup, instead of the priority list.
+        struct _software {
+            gchar *name;             // x264enc or openh264enc, skip the hardware encoders.
+            int32_t threads;         // 0 is the cores left after capture and analytics.
+            gboolean sliced_threads; // sub-frame latency, the slices are encoded in parallel.
+            int32_t vbv_ms;          // x264enc vbv-buf-capacity.
+        } software;
+    } encoder;
     gchar *root_dir;         // streams output root path;
     gchar *webroot;
     gboolean showdot; // generate gstreamer pipeline graphs;
@@ -76,7 +146,7 @@ struct _GstConfigData {
         int32_t max_files;
         int64_t max_size_time; // seconds of video split.
     } splitfile_sink;        // splitmuxsink save multipart file.
-    gboolean app_sink;       // appsink for filesink save.
+    gboolean app_sink;       // in-process appsink fan-out to the webrtc and record pipelines, default on.
     struct _hls_onoff {
         gboolean av_hlssink;         // audio and video hls output.
         gboolean motion_hlssink;     // motioncells video hls output.
@@ -96,15 +166,38 @@ struct _GstConfigData {
         int32_t duration;
         gboolean showtext; // show some custom text overlay video;
     } hls;
+    struct _analytics_data { // the one downscaled branch feeding every OpenCV detector.
+        int32_t width;
+        int32_t height;
+        gchar *format;     // raw format of the analytics tee, i.e. RGB or GRAY8.
+        int32_t framerate; // frames per second the detectors get.
+    } analytics;
+    struct _motion_data { // the built-in motion detector on the analytics frames.
+        int32_t sensitivity; // 1-100, the higher the smaller the difference counted as motion.
+        int32_t block;       // block size of the differencing in pixels, a multiple of 8.
+        int32_t min_blocks;  // blocks in motion that start an event.
+        int32_t hold_ms;     // quiet time that ends the event.
+        int32_t debounce_ms; // motion shorter than this does not start a record.
+        int32_t postroll_s;  // the record goes on this long after the motion ends, i.e. after hold_ms of quiet.
+        guint n_zones;       // no zone is the whole frame.
+        struct _motion_zone zones[MOTION_MAX_ZONES];
+    } motion;
     struct _audio_data {
         gboolean enable;
         int32_t path;
         int32_t buf_time;
         gchar *device; // for alsasrc  and puslesrc
     } audio;
-    int32_t rec_len; // motion detect record duration, seconds.
+    int32_t rec_len; // longest motion record clip, seconds, a longer motion goes on in the next clip.
+    int32_t rec_sessions; // concurrent record sessions of one owner, 0 is unlimited.
     gboolean motion_rec;
+    struct _preroll {
+        int32_t seconds; // pre-event buffer of the records, 0 is disabled.
+        int32_t max_kb;  // memory cap of the buffer.
+    } preroll;
     gboolean sysinfo; // show system info brief
+    gboolean park_idle; // pause the capture when no client and no storage sink is left.
+    struct _sched_branch sched[SCHED_BRANCHES];
     struct _webrtc webrtc;
 };
 
@@ -170,6 +263,7 @@ static AppData gs_app = {
     .audio.path = 0,
     .audio.buf_time = 50000,
     .rec_len = 60,
+    .rec_sessions = 2,
     .motion_rec = FALSE,
     .sysinfo = TRUE,
     .webrtc.enable = TRUE,
@@ -0,0 +1,137 @@
+/* gst-webrtc-camera
+ * Copyright (C) 2023 chunyang liu <yjdwbj@gmail.com>
+ *
+ *
+ * dtls_cert.c:  one DTLS certificate for all the webrtcbin
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+#include "dtls_cert.h"
+#include <glib/gstdio.h>
+#include <time.h>
+
+#define ROTATE_CHECK_SECONDS 3600
+
+static GMutex pem_lock;
+static gchar *shared_pem = NULL; // certificate followed by its key, the format of the dtlsdec "pem".
+static gint rotate_after = 0;    // days.
+
+static gchar *get_pem_path(const gchar *name) {
+    gchar *dir = g_build_filename(g_get_user_config_dir(), "gwc", NULL);
+    gchar *path;
+    g_mkdir_with_parents(dir, 0700);
+    path = g_build_filename(dir, name, NULL);
+    g_free(dir);
+    return path;
+}
+
+static gboolean is_expired(const gchar *path) {
+    GStatBuf st;
+    if (g_stat(path, &st))
+        return TRUE;
+    return (gint64)time(NULL) - (gint64)st.st_mtime > (gint64)rotate_after * 24 * 3600;
+}
+
+static gboolean generate_pem(const gchar *cert_path, const gchar *key_path) {
+    // valid for twice the rotation, the peers of the previous one keep working.
+    gchar *days = g_strdup_printf("%d", rotate_after * 2);
+    const gchar *argv[] = {"openssl", "req", "-x509", "-newkey", "ec",
+                           "-pkeyopt", "ec_paramgen_curve:prime256v1", "-nodes",
+                           "-keyout", key_path, "-out", cert_path,
+                           "-days", days, "-subj", "/CN=gwc", NULL};
+    gint64 start = g_get_monotonic_time();
+    gint status = 0;
+    GError *error = NULL;
+    gboolean ok;
+
+    ok = g_spawn_sync(NULL, (gchar **)argv, NULL,
+                      G_SPAWN_SEARCH_PATH | G_SPAWN_STDOUT_TO_DEV_NULL | G_SPAWN_STDERR_TO_DEV_NULL,
+                      NULL, NULL, NULL, NULL, &status, &error);
+    g_free(days);
+#if GLIB_CHECK_VERSION(2, 70, 0)
+    ok = ok && g_spawn_check_wait_status(status, NULL);
+#else
+    ok = ok && g_spawn_check_exit_status(status, NULL);
+#endif
+    if (!ok) {
+        g_printerr("unable to generate the DTLS certificate: %s\n", error ? error->message : "openssl failed");
+        g_clear_error(&error);
+        return FALSE;
+    }
+    g_chmod(key_path, 0600);
+    g_print("generated the DTLS certificate in %.1f ms.\n", (g_get_monotonic_time() - start) / 1000.0);
+    return TRUE;
+}
+
+static gboolean load_pem() {
+    gchar *cert_path = get_pem_path("dtls-cert.pem");
+    gchar *key_path = get_pem_path("dtls-key.pem");
+    gchar *cert = NULL, *key = NULL;
+    gboolean ok = FALSE;
+
+    if (is_expired(cert_path) || !g_file_test(key_path, G_FILE_TEST_EXISTS)) {
+        if (!generate_pem(cert_path, key_path))
+            goto out;
+    }
+    if (g_file_get_contents(cert_path, &cert, NULL, NULL) && g_file_get_contents(key_path, &key, NULL, NULL)) {
+        g_mutex_lock(&pem_lock);
+        g_free(shared_pem);
+        shared_pem = g_strconcat(cert, key, NULL);
+        g_mutex_unlock(&pem_lock);
+        ok = TRUE;
+    }
+
+out:
+    g_free(cert);
+    g_free(key);
+    g_free(cert_path);
+    g_free(key_path);
+    return ok;
+}
+
+static gboolean rotate_pem(gpointer user_data) {
+    load_pem();
+    return G_SOURCE_CONTINUE;
+}
+
+gboolean dtls_cert_start(gint rotate_days) {
+    rotate_after = MAX(rotate_days, 1);
+    if (!load_pem())
+        return FALSE;
+    g_timeout_add_seconds(ROTATE_CHECK_SECONDS, rotate_pem, NULL);
+    return TRUE;
+}
+
+/**
+ * @brief The same as the "certificate" of GstWebRTCDTLSTransport, that sets the "pem" of its dtlssrtpdec,
+ * dtlssrtpenc takes the certificate from the dtlssrtpdec of the same connection id.
+ */
+static void on_deep_element_added(GstBin *bin, GstBin *sub_bin, GstElement *element, gpointer user_data) {
+    GstElementFactory *factory = gst_element_get_factory(element);
+
+    if (!factory || g_strcmp0(GST_OBJECT_NAME(factory), "dtlssrtpdec"))
+        return;
+    g_mutex_lock(&pem_lock);
+    if (shared_pem)
+        g_object_set(element, "pem", shared_pem, NULL);
+    g_mutex_unlock(&pem_lock);
+}
+
+void dtls_cert_attach(GstElement *bin) {
+    if (!shared_pem)
+        return;
+    g_signal_connect(bin, "deep-element-added", G_CALLBACK(on_deep_element_added), NULL);
+}
@@ -0,0 +1,37 @@
+/* gst-webrtc-camera
+ * Copyright (C) 2023 chunyang liu <yjdwbj@gmail.com>
+ *
+ *
+ * dtls_cert.h:  one DTLS certificate for all the webrtcbin
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+#ifndef _DTLS_CERT_H
+#define _DTLS_CERT_H
+#include <glib.h>
+#include <gst/gst.h>
+
+/**
+ * @brief Load the ECDSA P-256 certificate of ~/.config/gwc/dtls-cert.pem, or generate it with the openssl
+ * command if it is missing or older than rotate_days. It is checked again every hour, a rotation only
+ * applies to the next connections.
+ */
+gboolean dtls_cert_start(gint rotate_days);
+
+// give the shared certificate to the DTLS elements the webrtcbin of this bin will create.
+void dtls_cert_attach(GstElement *bin);
+
+#endif // _DTLS_CERT_H
@@ -0,0 +1,325 @@
+/* gst-webrtc-camera
+ * Copyright (C) 2023 chunyang liu <yjdwbj@gmail.com>
+ *
+ *
+ * enc_probe.c:  benchmark the available video encoders
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+#include "enc_probe.h"
+#include <json-glib/json-glib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/utsname.h>
+
+#define PROBE_SECONDS 2
+#define PROBE_TIMEOUT 10 // seconds, a broken encoder may never reach EOS.
+#define PROBE_WARMUP 5   // frames, the first outputs carry the encoder initialization.
+
+typedef struct {
+    gint64 *in_time; // monotonic time of each frame entering the encoder.
+    guint frames;
+    gint framerate;
+    guint encoded;
+    gint64 latency_sum;
+    guint latency_count;
+} ProbeStats;
+
+static guint get_frame_index(ProbeStats *stats, GstBuffer *buffer) {
+    GstClockTime pts = GST_BUFFER_PTS(buffer);
+    if (!GST_CLOCK_TIME_IS_VALID(pts))
+        return G_MAXUINT;
+    return gst_util_uint64_scale_round(pts, stats->framerate, GST_SECOND);
+}
+
+static GstPadProbeReturn enc_in_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    ProbeStats *stats = (ProbeStats *)user_data;
+    guint idx = get_frame_index(stats, GST_PAD_PROBE_INFO_BUFFER(info));
+    if (idx < stats->frames)
+        stats->in_time[idx] = g_get_monotonic_time();
+    return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn enc_out_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    ProbeStats *stats = (ProbeStats *)user_data;
+    guint idx = get_frame_index(stats, GST_PAD_PROBE_INFO_BUFFER(info));
+    stats->encoded++;
+    // frames with b-frames come out of order, so match them by the PTS.
+    if (idx >= PROBE_WARMUP && idx < stats->frames && stats->in_time[idx]) {
+        stats->latency_sum += g_get_monotonic_time() - stats->in_time[idx];
+        stats->latency_count++;
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+static gint64 get_cpu_time() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (gint64)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * G_USEC_PER_SEC +
+           usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+gboolean probe_encoder(const gchar *encname, make_encoder_func make,
+                       int width, int height, int framerate, EncoderScore *score) {
+    GstElement *pipe, *src, *filter, *convert, *encoder, *sink;
+    ProbeStats stats = {0};
+    GstCaps *caps;
+    GstPad *pad;
+    GstBus *bus;
+    GstMessage *msg;
+    gint64 start, cpu_start, elapsed;
+    gboolean ok = FALSE;
+
+    encoder = make ? make(encname) : gst_element_factory_make(encname, NULL);
+    if (!encoder)
+        return FALSE;
+
+    pipe = gst_pipeline_new("encoder-probe");
+    src = gst_element_factory_make("videotestsrc", NULL);
+    filter = gst_element_factory_make("capsfilter", NULL);
+    convert = gst_element_factory_make("videoconvert", NULL);
+    sink = gst_element_factory_make("fakesink", NULL);
+    if (!src || !filter || !convert || !sink) {
+        g_printerr("encoder probe elements could not be created.\n");
+        gst_object_unref(encoder);
+        gst_object_unref(pipe);
+        return FALSE;
+    }
+
+    stats.framerate = framerate;
+    stats.frames = framerate * PROBE_SECONDS;
+    stats.in_time = g_new0(gint64, stats.frames);
+
+    // a moving pattern, a static frame is encoded for almost nothing.
+    g_object_set(src, "num-buffers", stats.frames, NULL);
+    gst_util_set_object_arg(G_OBJECT(src), "horizontal-speed", "8");
+    caps = gst_caps_new_simple("video/x-raw",
+                               "width", G_TYPE_INT, width,
+                               "height", G_TYPE_INT, height,
+                               "framerate", GST_TYPE_FRACTION, framerate, 1, NULL);
+    g_object_set(filter, "caps", caps, NULL);
+    gst_caps_unref(caps);
+    g_object_set(sink, "sync", FALSE, NULL);
+
+    gst_bin_add_many(GST_BIN(pipe), src, filter, convert, encoder, sink, NULL);
+    if (!gst_element_link_many(src, filter, convert, encoder, sink, NULL)) {
+        g_printerr("encoder probe: %s failed to link.\n", encname);
+        goto out;
+    }
+
+    pad = gst_element_get_static_pad(encoder, "sink");
+    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, enc_in_probe, &stats, NULL);
+    gst_object_unref(pad);
+    pad = gst_element_get_static_pad(encoder, "src");
+    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, enc_out_probe, &stats, NULL);
+    gst_object_unref(pad);
+
+    cpu_start = get_cpu_time();
+    start = g_get_monotonic_time();
+    if (gst_element_set_state(pipe, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE) {
+        g_printerr("encoder probe: %s failed to start.\n", encname);
+        goto out;
+    }
+
+    bus = gst_element_get_bus(pipe);
+    msg = gst_bus_timed_pop_filtered(bus, PROBE_TIMEOUT * GST_SECOND, GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+    elapsed = g_get_monotonic_time() - start;
+    if (msg && GST_MESSAGE_TYPE(msg) == GST_MESSAGE_EOS && stats.encoded > PROBE_WARMUP) {
+        score->fps = stats.encoded * (gdouble)G_USEC_PER_SEC / elapsed;
+        score->latency = stats.latency_count ? stats.latency_sum / 1000.0 / stats.latency_count : 0;
+        score->cpu = (get_cpu_time() - cpu_start) * 100.0 / elapsed;
+        ok = TRUE;
+    } else {
+        g_printerr("encoder probe: %s did not finish.\n", encname);
+    }
+    if (msg)
+        gst_message_unref(msg);
+    gst_object_unref(bus);
+
+out:
+    gst_element_set_state(pipe, GST_STATE_NULL);
+    gst_object_unref(pipe);
+    g_free(stats.in_time);
+    return ok;
+}
+
+static gint compare_plugin_name(gconstpointer a, gconstpointer b) {
+    return g_strcmp0(gst_plugin_get_name(GST_PLUGIN(a)), gst_plugin_get_name(GST_PLUGIN(b)));
+}
+
+/**
+ * @brief A hash of the installed plugins, an upgrade or a new driver plugin invalidates the cache.
+ */
+static gchar *get_registry_hash() {
+    GChecksum *sum = g_checksum_new(G_CHECKSUM_SHA1);
+    GList *plugins, *item;
+    gchar *hash, *version = gst_version_string();
+
+    g_checksum_update(sum, (const guchar *)version, -1);
+    g_free(version);
+    plugins = g_list_sort(gst_registry_get_plugin_list(gst_registry_get()), compare_plugin_name);
+    for (item = plugins; item; item = item->next) {
+        GstPlugin *plugin = item->data;
+        const gchar *filename = gst_plugin_get_filename(plugin);
+        g_checksum_update(sum, (const guchar *)gst_plugin_get_name(plugin), -1);
+        g_checksum_update(sum, (const guchar *)gst_plugin_get_version(plugin), -1);
+        if (filename)
+            g_checksum_update(sum, (const guchar *)filename, -1);
+    }
+    gst_plugin_list_free(plugins);
+    hash = g_strdup(g_checksum_get_string(sum));
+    g_checksum_free(sum);
+    return hash;
+}
+
+static gchar *get_cpu_model() {
+    static const gchar *keys[] = {"model name", "Hardware", "Model", "cpu model"};
+    gchar *contents = NULL, *model = NULL;
+    gchar **lines;
+    struct utsname uts;
+
+    if (g_file_get_contents("/proc/cpuinfo", &contents, NULL, NULL)) {
+        lines = g_strsplit(contents, "\n", -1);
+        for (int k = 0; k < G_N_ELEMENTS(keys) && !model; k++) {
+            for (gchar **line = lines; *line; line++) {
+                gchar *sep = strchr(*line, ':');
+                if (sep && g_str_has_prefix(*line, keys[k])) {
+                    model = g_strstrip(g_strdup(sep + 1));
+                    break;
+                }
+            }
+        }
+        g_strfreev(lines);
+        g_free(contents);
+    }
+    if (!model && uname(&uts) == 0)
+        model = g_strdup(uts.machine);
+    return model ? model : g_strdup("unknown");
+}
+
+static gchar *get_cache_path() {
+    gchar *dir = g_build_filename(g_get_user_config_dir(), "gwc", NULL);
+    gchar *path;
+    g_mkdir_with_parents(dir, 0755);
+    path = g_build_filename(dir, "encoder_probe.json", NULL);
+    g_free(dir);
+    return path;
+}
+
+static JsonObject *load_cache(const gchar *path, JsonParser *parser) {
+    JsonNode *root;
+    if (!g_file_test(path, G_FILE_TEST_EXISTS) || !json_parser_load_from_file(parser, path, NULL))
+        return json_object_new();
+    root = json_parser_get_root(parser);
+    if (!root || !JSON_NODE_HOLDS_OBJECT(root))
+        return json_object_new();
+    return json_object_ref(json_node_get_object(root));
+}
+
+static void save_cache(const gchar *path, JsonObject *cache) {
+    JsonGenerator *generator = json_generator_new();
+    JsonNode *root = json_node_new(JSON_NODE_OBJECT);
+    GError *error = NULL;
+
+    json_node_set_object(root, cache);
+    json_generator_set_root(generator, root);
+    json_generator_set_pretty(generator, TRUE);
+    if (!json_generator_to_file(generator, path, &error)) {
+        g_printerr("Failed to save %s: %s\n", path, error->message);
+        g_error_free(error);
+    }
+    json_node_free(root);
+    g_object_unref(generator);
+}
+
+/**
+ * @brief A realtime candidate with the lowest latency wins, within a millisecond the lower CPU wins.
+ * If none of them keeps up with the framerate, the fastest one wins.
+ */
+static gboolean is_better_score(const EncoderScore *a, const EncoderScore *b, int framerate) {
+    gboolean a_rt = a->fps >= framerate, b_rt = b->fps >= framerate;
+    if (a_rt != b_rt)
+        return a_rt;
+    if (!a_rt)
+        return a->fps > b->fps;
+    if (ABS(a->latency - b->latency) > 1.0)
+        return a->latency < b->latency;
+    return a->cpu < b->cpu;
+}
+
+gchar *probe_best_encoder(const gchar *codec, const gchar *const *candidates, make_encoder_func make,
+                          int width, int height, int framerate) {
+    JsonParser *parser = json_parser_new();
+    JsonObject *cache, *entry;
+    EncoderScore best = {0};
+    gchar *path, *reg_hash, *cpu, *key, *winner = NULL;
+
+    path = get_cache_path();
+    reg_hash = get_registry_hash();
+    cpu = get_cpu_model();
+    key = g_strdup_printf("%s/%s/%s/%dx%d@%d", reg_hash, cpu, codec, width, height, framerate);
+    cache = load_cache(path, parser);
+
+    if (json_object_has_member(cache, key)) {
+        entry = json_object_get_object_member(cache, key);
+        const gchar *name = json_object_get_string_member_with_default(entry, "encoder", NULL);
+        GstElementFactory *factory = name ? gst_element_factory_find(name) : NULL;
+        if (factory) {
+            gst_object_unref(factory);
+            winner = g_strdup(name);
+            g_print("video encoder probe (cached): %s\n", winner);
+            goto out;
+        }
+    }
+
+    for (const gchar *const *name = candidates; *name; name++) {
+        EncoderScore score = {0};
+        GstElementFactory *factory = gst_element_factory_find(*name);
+        if (!factory)
+            continue;
+        gst_object_unref(factory);
+        if (!probe_encoder(*name, make, width, height, framerate, &score))
+            continue;
+
+        g_print("video encoder probe: %s, %.1f fps, %.1f ms, cpu %.0f%%\n",
+                *name, score.fps, score.latency, score.cpu);
+        if (!winner || is_better_score(&score, &best, framerate)) {
+            g_free(winner);
+            winner = g_strdup(*name);
+            best = score;
+        }
+    }
+
+    if (winner) {
+        entry = json_object_new();
+        json_object_set_string_member(entry, "encoder", winner);
+        json_object_set_double_member(entry, "fps", best.fps);
+        json_object_set_double_member(entry, "latency", best.latency);
+        json_object_set_double_member(entry, "cpu", best.cpu);
+        json_object_set_object_member(cache, key, entry);
+        save_cache(path, cache);
+        g_print("video encoder probe winner: %s\n", winner);
+    }
+
+out:
+    json_object_unref(cache);
+    g_object_unref(parser);
+    g_free(key);
+    g_free(cpu);
+    g_free(reg_hash);
+    g_free(path);
+    return winner;
+}
@@ -0,0 +1,47 @@
+/* gst-webrtc-camera
+ * Copyright (C) 2023 chunyang liu <yjdwbj@gmail.com>
+ *
+ *
+ * enc_probe.h:  benchmark the available video encoders
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+#ifndef _ENC_PROBE_H
+#define _ENC_PROBE_H
+#include <glib.h>
+#include <gst/gst.h>
+
+// create and configure the encoder of the factory name, NULL for a plain gst_element_factory_make.
+typedef GstElement *(*make_encoder_func)(const gchar *encname);
+
+typedef struct {
+    gdouble fps;     // encoded frames per second, as fast as it goes.
+    gdouble latency; // milliseconds from the encoder sink to its src.
+    gdouble cpu;     // percent of one core.
+} EncoderScore;
+
+/**
+ * @brief Run every candidate on a videotestsrc stream at the given size, the winner is cached in
+ * ~/.config/gwc/encoder_probe.json, keyed by the GStreamer registry and the CPU model.
+ * Returns the factory name of the winner, or NULL if none of them worked.
+ */
+gchar *probe_best_encoder(const gchar *codec, const gchar *const *candidates, make_encoder_func make,
+                          int width, int height, int framerate);
+
+gboolean probe_encoder(const gchar *encname, make_encoder_func make,
+                       int width, int height, int framerate, EncoderScore *score);
+
+#endif // _ENC_PROBE_H
@@ -25,11 +25,17 @@
 #include "soup.h"
 #include <gst/app/gstappsink.h>
 #include <gst/app/gstappsrc.h>
+#include <gst/rtp/gstrtpbuffer.h>
+#include <gst/video/video.h>
 #include <limits.h>
-#include <sys/inotify.h>
 #include <sys/types.h>
 
 #include "v4l2ctl.h"
+#include "enc_probe.h"
+#include "osd.h"
+#include "motion.h"
+#include "dtls_cert.h"
+#include "thread_sched.h"
 #include <linux/version.h>
 
 static GstElement *pipeline;
@@ -38,24 +44,27 @@ static gboolean is_initial = FALSE;
 static const gchar *vid_encoder_tee = "vid_encoder_tee";
 static const gchar *aid_encoder_tee = "aid_encoder_tee";
 
-static volatile int threads_running = 0;
-static volatile int cmd_recording = 0;
 static int record_time = 7;
-static volatile gboolean reading_inotify = TRUE;
-
-static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t cmd_mtx = PTHREAD_MUTEX_INITIALIZER;
 
 static GThreadPool *play_thread_pool = NULL;
 static GMutex _play_pool_lock;
 
+typedef struct _AppsrcAvPair AppSrcAVPair;
+
+/**
+ * @brief The appsrc subscribers of the app_sink fan-out, an immutable array that is replaced as a whole.
+ * The streaming threads only read it inside fanout_enter()/fanout_leave(), without a lock, and a join or
+ * a leave waits until no reader can see the array it replaced before freeing it.
+ */
 typedef struct {
-    GstElement *video_src;
-    GstElement *audio_src;
-} AppSrcAVPair;
+    guint len;
+    AppSrcAVPair *pairs[];
+} AppsrcSet;
 
-static GMutex G_appsrc_lock;
-static GList *G_AppsrcList;
+static GMutex G_appsrc_lock; // serializes the joins and leaves, the fan-out never takes it.
+static AppsrcSet *G_AppsrcSet = NULL;
+static gint fanout_epoch = 0;
+static gint fanout_readers[2] = {0, 0};
 
 GstConfigData config_data;
 GHashTable *capture_htable = NULL;
@@ -86,8 +95,6 @@ GHashTable *capture_htable = NULL;
 
 static void
 _initial_device();
-static int start_udpsrc_rec();
-static void start_appsrc_record();
 
 #if 0
 static GstCaps *_getVideoCaps(gchar *type, gchar *format, int framerate, int width, int height) {
@@ -262,48 +269,6 @@ static const gchar *get_link_error(GstPadLinkReturn ret) {
     return types[type];
 }
 
-static gchar *get_best_code_name(const gchar *name) {
-    gchar *tmp = NULL;
-    // "msdk%senc", may occur follow errror.
-    // msdkenc gstmsdkenc.c:673:gst_msdkenc_init_encoder:<msdkvp9enc0> Video Encode Query failed (undeveloped feature)
-    static gchar *hw_enc[] = {
-        "va%slpenc", // VA-API H.265 Low Power Encoder in Intel(R) Gen Graphics
-        "va%senc",
-        "vaapi%senc",
-        "qsv%senc",
-        "nvv4l2%senc",
-        "v4l2%enc",
-        "omx%senc"};
-
-    static gchar *sf_enc[] = {
-        "%senc",
-        "avenc_%s_omx",
-        "open%senc"};
-
-    for (int i = 0; i < sizeof(hw_enc) / sizeof(gchar *); i++) {
-        tmp = g_strdup_printf(hw_enc[i], name);
-        if (gst_element_factory_find(tmp)) {
-            return tmp;
-        }
-    }
-
-    if (g_str_has_prefix(name, "h26")) {
-        tmp = g_strdup_printf("%senc", name);
-        tmp[0] = 'x';
-        if (gst_element_factory_find(tmp)) {
-            return tmp;
-        }
-    }
-
-    for (int i = 0; i < sizeof(sf_enc) / sizeof(gchar *); i++) {
-        tmp = g_strdup_printf(sf_enc[i], name);
-        if (gst_element_factory_find(tmp)) {
-            return tmp;
-        }
-    }
-    return tmp;
-}
-
 static gchar *get_video_driver_name(const gchar *device) {
     gchar *drvname = NULL;
     int fd, ret;
@@ -371,7 +336,9 @@ static GstElement *get_nvbin() {
 #endif
 
 static guint get_exact_bitrate() {
-    guint bitrate = 8000;
+    // about 0.035 bits per pixel for the other sizes, i.e: 640x480@30 is 330kbps.
+    guint bitrate = (guint64)config_data.v4l2src_data.width * config_data.v4l2src_data.height *
+                    config_data.v4l2src_data.framerate / 28;
     if (config_data.v4l2src_data.height == 1080) {
         if (config_data.v4l2src_data.framerate >= 60)
             bitrate = 4000000;
@@ -386,13 +353,147 @@ static guint get_exact_bitrate() {
     return bitrate;
 }
 
+/**
+ * @brief L1T2/L1T3 temporal layers of libvpx, the frames above TL0 only reference the lower layers,
+ * so they can be dropped for a constrained peer without re-encoding.
+ * https://chromium.googlesource.com/webm/libvpx/+/refs/heads/main/examples/vpx_temporal_svc_encoder.c
+ */
+static gboolean temporal_layers_enabled = FALSE;
+
+static void set_vpx_temporal_bitrate(GstElement *encoder, guint kbps) {
+    gchar *rates;
+    // the cumulative bitrates of TL0, TL0+TL1 and TL0+TL1+TL2, in bps.
+    if (config_data.webrtc.temporal_layers == 3)
+        rates = g_strdup_printf("<%u,%u,%u>", kbps * 400, kbps * 600, kbps * 1000);
+    else
+        rates = g_strdup_printf("<%u,%u>", kbps * 600, kbps * 1000);
+    gst_util_set_object_arg(G_OBJECT(encoder), "temporal-scalability-target-bitrate", rates);
+    g_free(rates);
+}
+
+static gboolean set_vpx_temporal_layers(GstElement *encoder, guint kbps) {
+    GObject *obj = G_OBJECT(encoder);
+    // without the per frame reference flags (GStreamer 1.20), libvpx may reference the upper layers.
+    if (!g_object_class_find_property(G_OBJECT_GET_CLASS(encoder), "temporal-scalability-layer-flags")) {
+        g_printerr("%s has no temporal-scalability-layer-flags, temporal layers disabled.\n",
+                   GST_OBJECT_NAME(gst_element_get_factory(encoder)));
+        return FALSE;
+    }
+
+    if (config_data.webrtc.temporal_layers == 3) {
+        g_object_set(obj, "temporal-scalability-number-layers", 3,
+                     "temporal-scalability-periodicity", 4, NULL);
+        gst_util_set_object_arg(obj, "temporal-scalability-rate-decimator", "<4,2,1>");
+        gst_util_set_object_arg(obj, "temporal-scalability-layer-id", "<0,2,1,2>");
+        gst_util_set_object_arg(obj, "temporal-scalability-layer-flags",
+                                "<no-ref-golden+no-ref-alt+no-upd-golden+no-upd-alt,"
+                                "no-ref-golden+no-ref-alt+no-upd-last+no-upd-golden+no-upd-alt+no-upd-entropy,"
+                                "no-ref-golden+no-ref-alt+no-upd-last+no-upd-alt,"
+                                "no-ref-alt+no-upd-last+no-upd-golden+no-upd-alt+no-upd-entropy>");
+        gst_util_set_object_arg(obj, "temporal-scalability-layer-sync-flags", "<false,true,true,false>");
+    } else {
+        g_object_set(obj, "temporal-scalability-number-layers", 2,
+                     "temporal-scalability-periodicity", 2, NULL);
+        gst_util_set_object_arg(obj, "temporal-scalability-rate-decimator", "<2,1>");
+        gst_util_set_object_arg(obj, "temporal-scalability-layer-id", "<0,1>");
+        gst_util_set_object_arg(obj, "temporal-scalability-layer-flags",
+                                "<no-ref-golden+no-ref-alt+no-upd-golden+no-upd-alt,"
+                                "no-ref-golden+no-ref-alt+no-upd-last+no-upd-golden+no-upd-alt+no-upd-entropy>");
+        gst_util_set_object_arg(obj, "temporal-scalability-layer-sync-flags", "<false,true>");
+    }
+    gst_util_set_object_arg(obj, "error-resilient", "default");
+    g_object_set(obj, "target-bitrate", kbps * 1000, NULL);
+    set_vpx_temporal_bitrate(encoder, kbps);
+    g_print("temporal layers: L1T%d\n", config_data.webrtc.temporal_layers);
+    return TRUE;
+}
+
+/**
+ * @brief The encoder of the codec, probed once with the settings of make, then cached per codec
+ * for the next renditions.
+ */
+static gchar *get_best_code_name(const gchar *name, make_encoder_func make) {
+    static GHashTable *best_encoders = NULL;
+    gchar *tmp = NULL;
+    GPtrArray *candidates;
+
+    if (!best_encoders)
+        best_encoders = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    if (g_hash_table_contains(best_encoders, name))
+        return g_strdup(g_hash_table_lookup(best_encoders, name));
+    // "msdk%senc", may occur follow errror.
+    // msdkenc gstmsdkenc.c:673:gst_msdkenc_init_encoder:<msdkvp9enc0> Video Encode Query failed (undeveloped feature)
+    static gchar *hw_enc[] = {
+        "va%slpenc", // VA-API H.265 Low Power Encoder in Intel(R) Gen Graphics
+        "va%senc",
+        "vaapi%senc",
+        "qsv%senc",
+        "nvv4l2%senc",
+        "v4l2%senc",
+        "omx%senc"};
+
+    static gchar *sf_enc[] = {
+        "%senc",
+        "avenc_%s_omx",
+        "open%senc"};
+
+    // in the order of priority, the first one wins without the probe.
+    candidates = g_ptr_array_new_with_free_func(g_free);
+    for (int i = 0; i < sizeof(hw_enc) / sizeof(gchar *); i++) {
+        g_ptr_array_add(candidates, g_strdup_printf(hw_enc[i], name));
+    }
+
+    if (g_str_has_prefix(name, "h26")) {
+        tmp = g_strdup_printf("%senc", name);
+        tmp[0] = 'x';
+        g_ptr_array_add(candidates, tmp);
+    }
+
+    for (int i = 0; i < sizeof(sf_enc) / sizeof(gchar *); i++) {
+        g_ptr_array_add(candidates, g_strdup_printf(sf_enc[i], name));
+    }
+    g_ptr_array_add(candidates, NULL);
+
+    tmp = NULL;
+    if (config_data.encoder.probe) {
+        tmp = probe_best_encoder(name, (const gchar *const *)candidates->pdata, make,
+                                 config_data.v4l2src_data.width, config_data.v4l2src_data.height,
+                                 config_data.v4l2src_data.framerate);
+    }
+    for (int i = 0; !tmp && g_ptr_array_index(candidates, i); i++) {
+        if (gst_element_factory_find(g_ptr_array_index(candidates, i)))
+            tmp = g_strdup(g_ptr_array_index(candidates, i));
+    }
+    g_ptr_array_free(candidates, TRUE);
+    g_hash_table_insert(best_encoders, g_strdup(name), g_strdup(tmp));
+    return tmp;
+}
+
+static GstElement *make_vp89_encoder(const gchar *encname) {
+    GstElement *encoder = gst_element_factory_make(encname, NULL);
+    guint bitrate = get_exact_bitrate();
+    if (!encoder)
+        return NULL;
+
+    if (g_str_has_prefix(encname, "qsv")) {
+        g_object_set(G_OBJECT(encoder), "bitrate", bitrate / 1000, "low-latency", TRUE, NULL);
+    } else if (g_str_has_prefix(encname, "vaapi")) {
+        g_object_set(G_OBJECT(encoder), "bitrate", bitrate / 1000, "rate-control", 4,
+                     "quality-level", 1, "trellis", TRUE, "tune", 3, NULL);
+    } else if (config_data.webrtc.temporal_layers > 1 &&
+               (!g_strcmp0(encname, "vp8enc") || !g_strcmp0(encname, "vp9enc"))) {
+        set_vpx_temporal_layers(encoder, bitrate / 1000);
+    }
+    return encoder;
+}
+
 static GstElement *get_hardware_vp89_encoder(const gchar *name) {
     // https://developers.google.com/media/vp9/bitrate-modes/
     GstElement *encoder;
-    guint bitrate = get_exact_bitrate();
+    gint layers = 1;
 
     // https://www.intel.com/content/www/us/en/developer/articles/technical/gstreamer-vaapi-media-sdk-command-line-examples.html
-    gchar *encname = get_best_code_name(name);
+    gchar *encname = get_best_code_name(name, make_vp89_encoder);
 
     if (encname == NULL)
         return NULL;
@@ -401,35 +502,42 @@ static GstElement *get_hardware_vp89_encoder(const gchar *name) {
     // After testing qsvvp9enc is great with 1080p encoder.
 
     g_print("video encoder: %s\n", encname);
-    encoder = gst_element_factory_make(encname, NULL);
-    if (g_str_has_prefix(encname, "qsv")) {
-        g_object_set(G_OBJECT(encoder), "bitrate", bitrate / 1000, "low-latency", TRUE, NULL);
-    } else if (g_str_has_prefix(encname, "vaapi")) {
-        g_object_set(G_OBJECT(encoder), "bitrate", bitrate / 1000, "rate-control", 4,
-                     "quality-level", 1, "trellis", TRUE, "tune", 3, NULL);
+    encoder = make_vp89_encoder(encname);
+    // rtpvp9pay does not write the layer indices, only VP8 can be thinned per peer.
+    if (!g_strcmp0(encname, "vp8enc")) {
+        g_object_get(G_OBJECT(encoder), "temporal-scalability-number-layers", &layers, NULL);
+        temporal_layers_enabled = layers > 1;
     }
     g_free(encname);
     gst_bin_add(GST_BIN(pipeline), encoder);
     return encoder;
 }
 
+static GstElement *make_h265_encoder(const gchar *encname) {
+    GstElement *encoder = gst_element_factory_make(encname, NULL);
+    guint bitrate = get_exact_bitrate();
+    if (!encoder)
+        return NULL;
+
+    if (g_str_has_prefix(encname, "nvv4l2")) {
+        g_object_set(G_OBJECT(encoder), "control-rate", 1, "maxperf-enable", TRUE, "bitrate", bitrate, NULL);
+    } else {
+        g_object_set(G_OBJECT(encoder), "bitrate", bitrate / 1000, NULL);
+    }
+    return encoder;
+}
+
 static GstElement *get_hardware_h265_encoder() {
     // https://www.avaccess.com/blogs/guides/h264-vs-h265-difference/
     // https://x265.readthedocs.io/en/master/presets.html
     GstElement *encoder;
-    guint bitrate = get_exact_bitrate();
     // https://www.intel.com/content/www/us/en/developer/articles/technical/gstreamer-vaapi-media-sdk-command-line-examples.html
 
-    gchar *encname = get_best_code_name("h265");
+    gchar *encname = get_best_code_name("h265", make_h265_encoder);
     if (encname == NULL)
         return NULL;
-    encoder = gst_element_factory_make(encname, NULL);
+    encoder = make_h265_encoder(encname);
     g_print("video encoder: %s\n", encname);
-    if (g_str_has_prefix(encname, "nvv4l2")) {
-        g_object_set(G_OBJECT(encoder), "control-rate", 1, "maxperf-enable", TRUE, "bitrate", bitrate, NULL);
-    } else {
-        g_object_set(G_OBJECT(encoder), "bitrate", bitrate / 1000, NULL);
-    }
     g_free(encname);
 
     gst_bin_add(GST_BIN(pipeline), encoder);
@@ -454,32 +562,72 @@ static int child_proc(void) {
 }
 #endif
 
-static GstElement *get_hardware_h264_encoder() {
-    GstElement *encoder;
-    // child_proc();
+// in the order of priority, the first one wins without the probe.
+static const gchar *h264_encoders[] = {
+    "vah264lpenc",   // VA-API H.264 Low Power Encoder in Intel(R) Gen Graphics
+    "vaapih264enc",  // VA-API H264 encoder
+    "nvh264enc",     // NVENC H.264 Video Encoder
+    "nvcudah264enc", // NVENC H.264 Video Encoder CUDA Mode
+    "nvv4l2h264enc",
+    "v4l2h264enc",
+    "x264enc",
+    NULL};
+
+/**
+ * @brief The encoder threads get the cores left after the capture, the WebRTC fan-out and every enabled analytics branch.
+ */
+static guint get_software_threads() {
+    guint reserved = 1;
+    if (config_data.encoder.software.threads > 0)
+        return config_data.encoder.software.threads;
+
+    reserved += config_data.hls_onoff.motion_hlssink + config_data.hls_onoff.facedetect_hlssink +
+                config_data.hls_onoff.edge_hlssink + config_data.hls_onoff.cvtracker_hlssink;
+    return MAX((gint)g_get_num_processors() - (gint)reserved, 1);
+}
+
+static void set_software_profile(GstElement *encoder, const gchar *encname, guint bitrate) {
+    guint threads = get_software_threads();
+    if (!g_strcmp0(encname, "x264enc")) {
+        // no lookahead and no frame threads delay, the VBV bounds the burst of a frame.
+        gst_util_set_object_arg(G_OBJECT(encoder), "tune", "fastdecode+zerolatency");
+        g_object_set(G_OBJECT(encoder), "speed-preset", 4,
+                     "bitrate", bitrate / 1000,
+                     "threads", threads,
+                     "sliced-threads", config_data.encoder.software.sliced_threads,
+                     "rc-lookahead", 0,
+                     "vbv-buf-capacity", config_data.encoder.software.vbv_ms, NULL);
+    } else if (!g_strcmp0(encname, "openh264enc")) {
+        // openh264enc has no VBV setting, its rate control skips frames instead.
+        g_object_set(G_OBJECT(encoder), "bitrate", bitrate,
+                     "multi-thread", threads, NULL);
+        gst_util_set_object_arg(G_OBJECT(encoder), "usage-type", "camera");
+        gst_util_set_object_arg(G_OBJECT(encoder), "rate-control", "bitrate");
+        gst_util_set_object_arg(G_OBJECT(encoder), "complexity", "low");
+        if (config_data.encoder.software.sliced_threads) {
+            gst_util_set_object_arg(G_OBJECT(encoder), "slice-mode", "n-slices");
+            g_object_set(G_OBJECT(encoder), "num-slices", threads, NULL);
+        }
+    }
+}
+
+static GstElement *make_h264_encoder(const gchar *encname) {
+    GstElement *encoder = gst_element_factory_make(encname, NULL);
     guint bitrate = get_exact_bitrate();
+    if (!encoder)
+        return NULL;
+
     // https://www.intel.com/content/www/us/en/developer/articles/technical/gstreamer-vaapi-media-sdk-command-line-examples.html
-    if (gst_element_factory_find("vah264lpenc")) {
-        // VA-API H.264 Low Power Encoder in Intel(R) Gen Graphics
-        encoder = gst_element_factory_make("vah264lpenc", NULL);
+    if (!g_strcmp0(encname, "vah264lpenc")) {
         g_object_set(G_OBJECT(encoder), "bitrate", bitrate / 1000,
                      "rate-control", 16, "qpb", 14, "key-int-max", 30, "ref-frames", 1, "b-frames", 2, NULL);
-    } else if (gst_element_factory_find("vaapih264enc")) {
-        // VA-API H264 encoder
-        encoder = gst_element_factory_make("vaapih264enc", NULL);
+    } else if (!g_strcmp0(encname, "vaapih264enc")) {
         g_object_set(G_OBJECT(encoder), "bitrate", bitrate / 1000, NULL);
-    } else if (gst_element_factory_find("nvh264enc")) {
-        // NVENC H.264 Video Encoder
-        encoder = gst_element_factory_make("nvh264enc", NULL);
-    } else if (gst_element_factory_find("nvcudah264enc")) {
-        // NVENC H.264 Video Encoder CUDA Mode
-        encoder = gst_element_factory_make("nvcudah264enc", NULL);
-    } else if (gst_element_factory_find("nvv4l2h264enc")) {
+    } else if (!g_strcmp0(encname, "nvv4l2h264enc")) {
         // https://docs.nvidia.com/jetson/archives/r34.1/DeveloperGuide/text/SD/Multimedia/AcceleratedGstreamer.html#supported-h-264-h-265-vp9-av1-encoder-features-with-gstreamer-1-0
         gchar *drvname = get_video_driver_name(config_data.v4l2src_data.device);
         guint64 nvbitrate = g_strcmp0(drvname, "uvcvideo") ? 12000000 : 800000;
 
-        encoder = gst_element_factory_make("nvv4l2h264enc", NULL);
         g_object_set(G_OBJECT(encoder), "control-rate", 0,
                      "maxperf-enable", TRUE,
                      "preset-level", 4,
@@ -487,16 +635,61 @@ static GstElement *get_hardware_h264_encoder() {
                      "vbv-size", 100,
                      "qp-range", "1,51:1,51:1,51",
                      "bitrate", nvbitrate, NULL);
-    } else if (gst_element_factory_find("v4l2h264enc")) {
-        encoder = gst_element_factory_make("v4l2h264enc", NULL);
-    } else if (gst_element_factory_find("x264enc")) {
-        encoder = gst_element_factory_make("x264enc", NULL);
+    } else if (!g_strcmp0(encname, "x264enc") || !g_strcmp0(encname, "openh264enc")) {
         // g_object_set(G_OBJECT(encoder), "key-int-max", 2, NULL);
-        g_object_set(G_OBJECT(encoder), "speed-preset", 4, "tune", 2, NULL);
-    } else {
+        set_software_profile(encoder, encname, bitrate);
+    }
+    return encoder;
+}
+
+static void report_software_encoder(const gchar *encname) {
+    static gboolean reported = FALSE;
+    EncoderScore score = {0};
+
+    if (reported || (g_strcmp0(encname, "x264enc") && g_strcmp0(encname, "openh264enc")))
+        return;
+    reported = TRUE;
+    // the probe already printed the measures of every candidate.
+    if (config_data.encoder.probe)
+        return;
+    if (probe_encoder(encname, make_h264_encoder, config_data.v4l2src_data.width,
+                      config_data.v4l2src_data.height, config_data.v4l2src_data.framerate, &score)) {
+        g_print("software encoder: %s, threads: %u%s, vbv: %d ms, %.1f fps at %dx%d, cpu %.0f%%\n",
+                encname, get_software_threads(),
+                config_data.encoder.software.sliced_threads ? " sliced" : "",
+                config_data.encoder.software.vbv_ms, score.fps,
+                config_data.v4l2src_data.width, config_data.v4l2src_data.height, score.cpu);
+        if (score.fps < config_data.v4l2src_data.framerate)
+            g_printerr("software encoder can not keep up with %d fps.\n", config_data.v4l2src_data.framerate);
+    }
+}
+
+static GstElement *get_hardware_h264_encoder() {
+    static gchar *encname = NULL;
+    GstElement *encoder;
+    // child_proc();
+    if (encname == NULL && config_data.encoder.software.name) {
+        if (gst_element_factory_find(config_data.encoder.software.name))
+            encname = g_strdup(config_data.encoder.software.name);
+        else
+            g_printerr("software encoder %s not found.\n", config_data.encoder.software.name);
+    }
+    if (encname == NULL && config_data.encoder.probe) {
+        encname = probe_best_encoder("h264", h264_encoders, make_h264_encoder,
+                                     config_data.v4l2src_data.width, config_data.v4l2src_data.height,
+                                     config_data.v4l2src_data.framerate);
+    }
+    for (int i = 0; encname == NULL && h264_encoders[i]; i++) {
+        if (gst_element_factory_find(h264_encoders[i]))
+            encname = g_strdup(h264_encoders[i]);
+    }
+
+    if (encname == NULL || (encoder = make_h264_encoder(encname)) == NULL) {
         g_printerr("Failed to create h264 encoder\n");
         return NULL;
     }
+    g_print("video encoder: %s\n", encname);
+    report_software_encoder(encname);
 
     gst_bin_add(GST_BIN(pipeline), encoder);
     return encoder;
@@ -514,6 +707,23 @@ static GstElement *get_video_encoder_by_name(gchar *name) {
     }
 }
 
+static void set_encoder_bitrate(GstElement *encoder, guint kbps) {
+    const gchar *encname = GST_OBJECT_NAME(gst_element_get_factory(encoder));
+    if (g_str_has_prefix(encname, "nvv4l2") || g_str_has_prefix(encname, "openh264")) {
+        g_object_set(G_OBJECT(encoder), "bitrate", kbps * 1000, NULL);
+    } else if (!g_strcmp0(encname, "vp8enc") || !g_strcmp0(encname, "vp9enc")) {
+        gint layers = 1;
+        g_object_set(G_OBJECT(encoder), "target-bitrate", kbps * 1000, NULL);
+        g_object_get(G_OBJECT(encoder), "temporal-scalability-number-layers", &layers, NULL);
+        if (layers > 1)
+            set_vpx_temporal_bitrate(encoder, kbps);
+    } else if (g_object_class_find_property(G_OBJECT_GET_CLASS(encoder), "bitrate")) {
+        g_object_set(G_OBJECT(encoder), "bitrate", kbps, NULL);
+    } else {
+        g_printerr("%s can not change the bitrate.\n", encname);
+    }
+}
+
 static GstElement *get_video_src() {
     GstCaps *srcCaps;
     GstElement *teesrc, *capsfilter;
@@ -862,162 +1072,1048 @@ static GstElement *get_h264_caps() {
 }
 #endif
 
-static GstElement *get_encoder_src() {
-    GstElement *encoder, *teesrc;
-    encoder = get_video_encoder_by_name(config_data.videnc);
-    if (!encoder) {
-        g_printerr("encoder source all elements could not be created.\n");
-        // g_printerr("encoder %x ; clock %x.\n", encoder, clock);
-        return NULL;
-    }
-    teesrc = gst_element_factory_make("tee", vid_encoder_tee);
+typedef struct {
+    GstElement *encoder;
+    GstElement *capsfilter; // raw caps ahead of the encoder, NULL if not scaled.
+    GstElement *tee;
+    gboolean persistent; // a storage or analytics sink is on it, it never idles.
+    gboolean active;     // frames went through at the last buffer.
+} EncoderEntry;
+
+/**
+ * @brief The encoder registry, keyed by "input/codec/WxH@fps/profile".
+ * Every sink asking for the same rendition gets a request pad on one encoder tee,
+ * so N sinks cost one encode.
+ */
+static GHashTable *encoder_htable = NULL;
+static GstElement *overlay_tee = NULL;
 
-#if defined(HAS_JETSON_NANO)
-    GstElement *clockbin;
+static gchar *get_encoder_key(GstElement *input, const gchar *codec, int width, int height, const gchar *profile) {
+    return g_strdup_printf("%s/%s/%dx%d@%d/%s", GST_ELEMENT_NAME(input), codec,
+                           width, height, config_data.v4l2src_data.framerate, profile);
+}
+
+/**
+ * @brief The raw video with the clock and sysinfo overlay, shared by all of the encoders.
+ */
+static GstElement *get_overlay_tee() {
+    if (overlay_tee)
+        return overlay_tee;
 
+    GstElement *teesrc = gst_element_factory_make("tee", "overlay_tee");
     if (!teesrc) {
         g_printerr("tee source elements could not be created.\n");
-        // g_printerr("encoder %x ; clock %x.\n", encoder, clock);
         return NULL;
     }
+#if defined(HAS_JETSON_NANO)
+    GstElement *clockbin;
 
     clockbin = create_textbins();
     gst_element_sync_state_with_parent(clockbin);
 
     gst_bin_add_many(GST_BIN(pipeline), clockbin, teesrc, NULL);
-    if (!gst_element_link_many(clockbin, encoder, teesrc, NULL)) {
-        g_print("Failed to link  elements encoder source \n");
+    if (!gst_element_link_many(clockbin, teesrc, NULL)) {
+        g_print("Failed to link  elements overlay source \n");
         return NULL;
     }
     link_request_src_pad(video_source, clockbin);
 #else
-    GstElement *clock, *videoconvert;
+    GstElement *videoconvert = NULL, *capsfilter;
+    GstCaps *caps;
+    gchar *sysinfo = NULL;
 
-    videoconvert = gst_element_factory_make("videoconvert", NULL);
-    clock = gst_element_factory_make("clockoverlay", NULL);
-    g_object_set(clock, "time-format", "%D %H:%M:%S", NULL);
-    gst_bin_add_many(GST_BIN(pipeline), clock, teesrc, videoconvert, NULL);
-    if (config_data.sysinfo) {
-        GstElement *textoverlay;
-        textoverlay = gst_element_factory_make("textoverlay", NULL);
-        g_assert_nonnull(textoverlay);
-        gst_bin_add(GST_BIN(pipeline), textoverlay);
-        // jetson nano don't have clockoverylay , owner by libgstpango.so
-        gchar *sysinfo = get_basic_sysinfo();
-        g_object_set(G_OBJECT(textoverlay), "text", sysinfo, "valignment", 1, "line-alignment", 0, "halignment", 0, "font-desc", "Sans, 10", NULL);
-        g_free(sysinfo);
-        if (g_str_has_prefix(config_data.videnc, "h264")) {
-            if (!gst_element_link_many(videoconvert, textoverlay, clock, encoder, get_h264_caps(), teesrc, NULL)) {
-                g_print("Failed to link elements encoder  source\n");
-                return NULL;
-            }
-        } else {
-            if (!gst_element_link_many(videoconvert, textoverlay, clock, encoder, teesrc, NULL)) {
-                g_print("Failed to link elements encoder  source\n");
-                return NULL;
-            }
-        }
-    } else {
-        if (g_str_has_prefix(config_data.videnc, "h264")) {
-            if (!gst_element_link_many(videoconvert, clock, encoder, get_h264_caps(), teesrc, NULL)) {
-                g_print("Failed to link elements encoder source \n");
-                return NULL;
-            }
-        } else {
-            if (!gst_element_link_many(videoconvert, clock, encoder, teesrc, NULL)) {
-                g_print("Failed to link elements encoder source \n");
-                return NULL;
-            }
+    capsfilter = gst_element_factory_make("capsfilter", NULL);
+    caps = gst_caps_from_string(OSD_VIDEO_CAPS);
+    g_object_set(G_OBJECT(capsfilter), "caps", caps, NULL);
+    gst_caps_unref(caps);
+    gst_bin_add_many(GST_BIN(pipeline), capsfilter, teesrc, NULL);
+    if (!gst_element_link(capsfilter, teesrc)) {
+        g_print("Failed to link elements overlay source \n");
+        return NULL;
+    }
+
+    // the overlay blends into NV12/I420 in place, no conversion if the camera already gives it.
+    if (!g_str_has_prefix(config_data.v4l2src_data.type, "video/x-raw") ||
+        (g_strcmp0(config_data.v4l2src_data.format, "NV12") && g_strcmp0(config_data.v4l2src_data.format, "I420"))) {
+        videoconvert = gst_element_factory_make("videoconvert", NULL);
+        gst_bin_add(GST_BIN(pipeline), videoconvert);
+        if (!gst_element_link(videoconvert, capsfilter)) {
+            g_print("Failed to link elements overlay source \n");
+            return NULL;
         }
     }
-    link_request_src_pad(video_source, videoconvert);
+
+    if (config_data.sysinfo)
+        sysinfo = get_basic_sysinfo();
+    osd_attach(capsfilter, sysinfo);
+    g_free(sysinfo);
+    link_request_src_pad(video_source, videoconvert ? videoconvert : capsfilter);
 #endif
-    return teesrc;
+    overlay_tee = teesrc;
+    return overlay_tee;
 }
 
-static void *_inotify_thread(void *filename) {
-    static int inotifyFd, wd;
-    int ret;
-    ssize_t rsize;
-    static char buf[4096];
-    struct inotify_event *event;
+/**
+ * @brief Streaming threads per kind of pipeline, from the STREAM_STATUS messages that each task posts
+ * from its own thread when it enters and leaves, counted by on_bus_sync_message().
+ */
+enum {
+    THREADS_MAIN,
+    THREADS_SEND,
+    THREADS_RECV,
+    THREADS_RECORD,
+    THREADS_SINGLE, // the single pipeline peers, also counted in THREADS_MAIN.
+    THREADS_KINDS
+};
+static gint stream_threads[THREADS_KINDS];
+
+/**
+ * @brief The elements of the main pipeline carry the branch of create_instance() that added them,
+ * a streaming thread entering one of them is named and pinned after it.
+ */
+#define SCHED_BRANCH_KEY "sched-branch"
+static gint building_branch = SCHED_CAPTURE;
 
-    inotifyFd = inotify_init1(IN_NONBLOCK);
+static void set_sched_branch(GstElement *element, gint branch) {
+    g_object_set_data(G_OBJECT(element), SCHED_BRANCH_KEY, GINT_TO_POINTER(branch + 1));
+}
 
-    if (inotifyFd == -1) {
-        gst_printerr("inotify init failed %d.\n", errno);
-        exit(EXIT_FAILURE);
-    }
-    // gst_println("inotify monitor for file: %s .\n", (char *)filename);
-    if (!g_file_test((char *)filename, G_FILE_TEST_EXISTS | G_FILE_TEST_IS_REGULAR)) {
-        gst_print(" inotify monitor exists: %s ?\n", (char *)filename);
-        FILE *file;
-        file = fopen((char *)filename, "w");
-        fclose(file);
-    }
-    wd = inotify_add_watch(inotifyFd, (char *)filename, IN_ALL_EVENTS);
-    if (wd == -1) {
-        gst_printerr("inotify_add_watch failed, errno: %d.\n", errno);
-        exit(EXIT_FAILURE);
+static void on_branch_element_added(GstBin *bin, GstBin *sub_bin, GstElement *element, gpointer user_data) {
+    if (!g_object_get_data(G_OBJECT(element), SCHED_BRANCH_KEY))
+        set_sched_branch(element, building_branch);
+}
+
+// the elements inside a bin that was built before being added only have the tag on the bin.
+static gint get_sched_branch(GstElement *element) {
+    GstObject *object = gst_object_ref(GST_OBJECT(element));
+    gint branch = 0;
+
+    while (object && !(branch = GPOINTER_TO_INT(g_object_get_data(G_OBJECT(object), SCHED_BRANCH_KEY)))) {
+        GstObject *parent = gst_object_get_parent(object);
+        gst_object_unref(object);
+        object = parent;
     }
-    g_free(filename);
-    for (;;) {
-        rsize = read(inotifyFd, buf, sizeof(buf));
-        if (rsize == -1 && errno != EAGAIN) {
-            perror("read ");
-            // exit(EXIT_FAILURE);
-        }
+    if (object)
+        gst_object_unref(object);
+    return branch ? branch - 1 : SCHED_WEBRTC;
+}
 
-        if (!rsize) {
-            gst_printerr("read() from intify fd returned 0 !.\n");
-        }
+static gboolean get_structure_coord(const GstStructure *s, const gchar *field, gint *value) {
+    const GValue *v = gst_structure_get_value(s, field);
+    if (v && G_VALUE_HOLDS_UINT(v))
+        *value = g_value_get_uint(v);
+    else if (v && G_VALUE_HOLDS_INT(v))
+        *value = g_value_get_int(v);
+    else
+        return FALSE;
+    return TRUE;
+}
 
-        for (char *ptr = buf; ptr < buf + rsize;) {
-            event = (struct inotify_event *)ptr;
-            if (event->mask & IN_MODIFY || event->mask & IN_OPEN) {
-                if (!threads_running) {
-                    ret = pthread_mutex_lock(&mtx);
-                    if (ret) {
-                        g_error("Failed to lock on mutex.\n");
-                    }
-                    threads_running = TRUE;
-                    ret = pthread_mutex_unlock(&mtx);
-                    if (ret) {
-                        g_error("Failed to lock on mutex.\n");
-                    }
-                    if (config_data.app_sink) {
-                        g_thread_new("start_record_mkv", (GThreadFunc)start_appsrc_record, NULL);
-                    } else {
-                        g_thread_new("start_record_mkv", (GThreadFunc)start_udpsrc_rec, NULL);
-                    }
+static gboolean get_structure_rect(const GstStructure *s, const gchar *prefix, GstVideoRectangle *rect) {
+    gchar *x = g_strconcat(prefix, "x", NULL), *y = g_strconcat(prefix, "y", NULL);
+    gchar *w = g_strconcat(prefix, "width", NULL), *h = g_strconcat(prefix, "height", NULL);
+    gboolean ret = get_structure_coord(s, x, &rect->x) && get_structure_coord(s, y, &rect->y) &&
+                   get_structure_coord(s, w, &rect->w) && get_structure_coord(s, h, &rect->h);
+    g_free(x);
+    g_free(y);
+    g_free(w);
+    g_free(h);
+    return ret;
+}
 
-                    // start_motion_record();
-                }
-                break;
-            }
-            ptr += sizeof(struct inotify_event) + event->len;
+/**
+ * @brief The detectors post their results in analytics coordinates, they are handed to the
+ * box overlay of the full size rendition, see osd_boxes_attach(). Returns TRUE when nothing
+ * else needs the message.
+ */
+static gboolean on_analytics_message(GstMessage *message) {
+    GstElement *detector = GST_ELEMENT(GST_MESSAGE_SRC(message));
+    const GstStructure *s = gst_message_get_structure(message);
+    OsdBoxes *boxes = g_object_get_data(G_OBJECT(detector), "osd-boxes");
+    GstVideoRectangle rects[OSD_BOXES_MAX];
+    guint count = 0;
+
+    if (!boxes || !s)
+        return FALSE;
+    if (gst_structure_has_name(s, "facedetect")) {
+        const GValue *faces = gst_structure_get_value(s, "faces");
+        guint size = faces && GST_VALUE_HOLDS_LIST(faces) ? gst_value_list_get_size(faces) : 0;
+        for (guint i = 0; i < size && count < OSD_BOXES_MAX; i++) {
+            const GValue *face = gst_value_list_get_value(faces, i);
+            if (GST_VALUE_HOLDS_STRUCTURE(face) && get_structure_rect(gst_value_get_structure(face), "", &rects[count]))
+                count++;
         }
+    } else if (gst_structure_has_name(s, MOTION_MESSAGE)) {
+        // the "stop" box is empty, it clears the boxes.
+        if (get_structure_rect(s, "", &rects[0]) && rects[0].w > 0)
+            count = 1;
+    } else if (get_structure_rect(s, "object.", &rects[0]) || get_structure_rect(s, "", &rects[0])) {
+        // cvtracker post-debug-info.
+        count = 1;
+    } else {
+        return FALSE;
     }
+    osd_boxes_set(boxes, rects, count);
+    // the motion events also start the record, see on_pipeline_message().
+    return !gst_structure_has_name(s, MOTION_MESSAGE);
+}
 
-    gst_println("Exiting inotify thread..., errno: %d .\n", errno);
+static void count_stream_thread(gint kind, GstStreamStatusType type) {
+    if (type == GST_STREAM_STATUS_TYPE_ENTER)
+        g_atomic_int_inc(&stream_threads[kind]);
+    else if (type == GST_STREAM_STATUS_TYPE_LEAVE)
+        g_atomic_int_add(&stream_threads[kind], -1);
 }
 
-#if 0
-/* called when the appsink notifies us that there is a new buffer ready for
- * processing */
-static GstFlowReturn
-on_new_sample_from_sink(GstElement *elt, CustomAppData *data) {
-    GstSample *sample;
-    GstBuffer *app_buffer, *buffer;
-    GstElement *source;
-    GstFlowReturn ret = GST_FLOW_NOT_LINKED;
+// called from the new streaming thread itself.
+static void pin_stream_thread(gint kind, GstElement *owner) {
+    gint branch = kind == THREADS_MAIN ? get_sched_branch(owner)
+                  : kind == THREADS_RECORD ? SCHED_RECORD
+                                           : SCHED_WEBRTC;
+    gchar *name = g_strdup_printf("%s:%s", thread_sched_branch_name(branch), GST_OBJECT_NAME(owner));
+    thread_sched_apply(branch, name);
+    g_free(name);
+}
 
-    /* get the sample from appsink */
-    sample = gst_app_sink_pull_sample(GST_APP_SINK(elt));
-    buffer = gst_sample_get_buffer(sample);
+/**
+ * @brief The sync handler of every pipeline bus, run in the thread that posts the message:
+ * the streaming threads are pinned and counted as they enter and leave, the detector results
+ * are handed to the box overlay and dropped, nothing else is kept off the bus.
+ */
+static GstBusSyncReply on_bus_sync_message(GstBus *bus, GstMessage *message, gpointer user_data) {
+    gint kind = GPOINTER_TO_INT(user_data);
+    GstStreamStatusType type;
+    GstElement *owner = NULL;
+
+    switch (GST_MESSAGE_TYPE(message)) {
+    case GST_MESSAGE_STREAM_STATUS:
+        gst_message_parse_stream_status(message, &type, &owner);
+        if (type == GST_STREAM_STATUS_TYPE_ENTER)
+            pin_stream_thread(kind, owner);
+        count_stream_thread(kind, type);
+        // the peers of the main pipeline are added after create_instance(), in the webrtc branch.
+        if (kind == THREADS_MAIN && get_sched_branch(owner) == SCHED_WEBRTC)
+            count_stream_thread(THREADS_SINGLE, type);
+        break;
+    case GST_MESSAGE_ELEMENT:
+        if (on_analytics_message(message))
+            return GST_BUS_DROP;
+        break;
+    default:
+        break;
+    }
+    return GST_BUS_PASS;
+}
 
-    /* make a copy */
-    app_buffer = gst_buffer_copy(buffer);
+static void watch_pipeline_bus(GstElement *pipe, gint kind) {
+    GstBus *bus = gst_pipeline_get_bus(GST_PIPELINE(pipe));
+    gst_bus_set_sync_handler(bus, on_bus_sync_message, GINT_TO_POINTER(kind), NULL);
+    gst_object_unref(bus);
+}
+
+/**
+ * @brief The threads of a send pipeline only enter once it is PLAYING, the pooled ones have none in
+ * READY, so a peer reserves its expected share of webrtc.thread_budget as soon as its path is picked,
+ * and releases it in its stop_webrtc.
+ */
+#define PEER_PIPELINE_THREADS 6 // until measured: the appsrcs, the nicesrc, the DTLS and SRTP tasks.
+static gint peer_reserved = 0;
+static gint pipeline_peers = 0;
+static gint single_peers = 0;
+
+static gint get_peer_pipeline_threads() {
+    gint peers = g_atomic_int_get(&pipeline_peers);
+    gint threads = g_atomic_int_get(&stream_threads[THREADS_SEND]);
+    return peers > 0 && threads / peers > PEER_PIPELINE_THREADS ? threads / peers : PEER_PIPELINE_THREADS;
+}
+
+static void release_peer_threads(WebrtcItem *item) {
+    if (!item->reserved_threads)
+        return;
+    g_atomic_int_add(&peer_reserved, -item->reserved_threads);
+    g_atomic_int_add(&pipeline_peers, -1);
+    item->reserved_threads = 0;
+}
+
+static guint get_process_threads() {
+    gchar *status = NULL;
+    guint threads = 0;
+
+    if (g_file_get_contents("/proc/self/status", &status, NULL, NULL)) {
+        gchar *line = strstr(status, "\nThreads:");
+        if (line)
+            threads = g_ascii_strtoull(line + strlen("\nThreads:"), NULL, 10);
+        g_free(status);
+    }
+    return threads;
+}
+
+void get_thread_stats(ThreadStats *stats) {
+    stats->process = get_process_threads();
+    stats->main = MAX(g_atomic_int_get(&stream_threads[THREADS_MAIN]), 0);
+    stats->send = MAX(g_atomic_int_get(&stream_threads[THREADS_SEND]), 0);
+    stats->recv = MAX(g_atomic_int_get(&stream_threads[THREADS_RECV]), 0);
+    stats->record = MAX(g_atomic_int_get(&stream_threads[THREADS_RECORD]), 0);
+    stats->budget = MAX(config_data.webrtc.thread_budget, 0);
+    stats->reserved = MAX(g_atomic_int_get(&peer_reserved), 0);
+    stats->pipeline_peers = MAX(g_atomic_int_get(&pipeline_peers), 0);
+    stats->single = MAX(g_atomic_int_get(&stream_threads[THREADS_SINGLE]), 0);
+    stats->single_peers = MAX(g_atomic_int_get(&single_peers), 0);
+}
+
+/**
+ * @brief Demand driven encoding, the WebRTC renditions only get frames while a peer or a recording uses them.
+ * With park_idle, the whole pipeline pauses when nothing else is left, so the capture stops too.
+ */
+#define PARK_DELAY 10 // seconds without demand before the pipeline is paused.
+
+static GMutex demand_lock;
+static gint encoder_demand = 0;
+static gboolean has_persistent_encoder = FALSE;
+static gboolean pipeline_parked = FALSE;
+static guint park_timer = 0;
+
+static GstPadProbeReturn encoder_demand_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    EncoderEntry *entry = (EncoderEntry *)user_data;
+    if (entry->persistent || g_atomic_int_get(&encoder_demand) > 0) {
+        if (!entry->active) {
+            // the peers are waiting for a keyframe, do not wait for the next GOP.
+            entry->active = TRUE;
+            gst_element_send_event(entry->encoder,
+                                   gst_video_event_new_upstream_force_key_unit(GST_CLOCK_TIME_NONE, TRUE, 0));
+        }
+        return GST_PAD_PROBE_OK;
+    }
+    entry->active = FALSE;
+    return GST_PAD_PROBE_DROP;
+}
+
+static gboolean can_park_pipeline() {
+    // the analytics of Jetson do not go through the encoder registry.
+    return config_data.park_idle && !has_persistent_encoder &&
+           !config_data.splitfile_sink.enable && !config_data.udp.enable &&
+           !config_data.hls_onoff.av_hlssink && !config_data.hls_onoff.motion_hlssink &&
+           !config_data.hls_onoff.facedetect_hlssink && !config_data.hls_onoff.edge_hlssink &&
+           !config_data.hls_onoff.cvtracker_hlssink;
+}
+
+static gboolean park_pipeline(gpointer user_data) {
+    g_mutex_lock(&demand_lock);
+    park_timer = 0;
+    if (encoder_demand == 0 && !pipeline_parked) {
+        gst_element_set_state(pipeline, GST_STATE_PAUSED);
+        pipeline_parked = TRUE;
+        g_print("no consumer left, pause the capture.\n");
+    }
+    g_mutex_unlock(&demand_lock);
+    return G_SOURCE_REMOVE;
+}
+
+static void acquire_encoder_demand() {
+    g_mutex_lock(&demand_lock);
+    if (encoder_demand++ == 0) {
+        if (park_timer) {
+            g_source_remove(park_timer);
+            park_timer = 0;
+        }
+        if (pipeline_parked) {
+            gst_element_set_state(pipeline, GST_STATE_PLAYING);
+            pipeline_parked = FALSE;
+            g_print("resume the capture.\n");
+        }
+    }
+    g_mutex_unlock(&demand_lock);
+}
+
+static void release_encoder_demand() {
+    g_mutex_lock(&demand_lock);
+    if (encoder_demand > 0 && --encoder_demand == 0 && can_park_pipeline() && !park_timer)
+        park_timer = g_timeout_add_seconds(PARK_DELAY, park_pipeline, NULL);
+    g_mutex_unlock(&demand_lock);
+}
+
+/**
+ * @brief Get a rendition from the registry, create it at first request.
+ *
+ * @param input raw video element, a tee or the tail of an analytics chain.
+ * @param codec h264, h265, vp8 or vp9.
+ * @param width,height the encoded size, scaled when it differs from the capture size.
+ * @param profile rate-control profile name of the rendition.
+ * @param name the tee name if this call creates the rendition, may be NULL.
+ */
+static EncoderEntry *get_encoder_entry(GstElement *input, const gchar *codec, int width, int height,
+                                       const gchar *profile, const gchar *name) {
+    EncoderEntry *entry;
+    GstElement *queue, *encoder, *teesrc, *head, *capsfilter = NULL;
+    GstPad *pad;
+    gchar *key;
+
+    if (!input)
+        return NULL;
+
+    if (!encoder_htable)
+        encoder_htable = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+    key = get_encoder_key(input, codec, width, height, profile);
+    entry = g_hash_table_lookup(encoder_htable, key);
+    if (entry) {
+        g_free(key);
+        return entry;
+    }
+
+    encoder = get_video_encoder_by_name((gchar *)codec);
+    if (!encoder) {
+        g_printerr("encoder source all elements could not be created.\n");
+        g_free(key);
+        return NULL;
+    }
+    queue = gst_element_factory_make("queue", NULL);
+    teesrc = gst_element_factory_make("tee", name);
+    if (!queue || !teesrc) {
+        g_printerr("tee source elements could not be created.\n");
+        g_free(key);
+        return NULL;
+    }
+    gst_bin_add_many(GST_BIN(pipeline), queue, teesrc, NULL);
+    head = queue;
+
+    if (width != config_data.v4l2src_data.width || height != config_data.v4l2src_data.height) {
+        GstElement *scale;
+        GstCaps *caps;
+#if defined(HAS_JETSON_NANO)
+        scale = gst_element_factory_make("nvvidconv", NULL);
+#else
+        scale = gst_element_factory_make("videoscale", NULL);
+#endif
+        capsfilter = gst_element_factory_make("capsfilter", NULL);
+        caps = gst_caps_new_simple("video/x-raw",
+                                   "width", G_TYPE_INT, width,
+                                   "height", G_TYPE_INT, height, NULL);
+        g_object_set(G_OBJECT(capsfilter), "caps", caps, NULL);
+        gst_caps_unref(caps);
+        gst_bin_add_many(GST_BIN(pipeline), scale, capsfilter, NULL);
+        if (!gst_element_link_many(queue, scale, capsfilter, NULL)) {
+            g_print("Failed to link elements encoder scale\n");
+            g_free(key);
+            return NULL;
+        }
+        head = capsfilter;
+        // the encoders take the bitrate of the capture size.
+        set_encoder_bitrate(encoder, (guint64)get_exact_bitrate() / 1000 * width * height /
+                                         (config_data.v4l2src_data.width * config_data.v4l2src_data.height));
+    }
+#if !defined(HAS_JETSON_NANO)
+    else if (!g_strcmp0(profile, "abr")) {
+        // the adaptive bitrate rendition can also degrade the framerate and resolution.
+        GstElement *rate, *scale;
+        rate = gst_element_factory_make("videorate", NULL);
+        scale = gst_element_factory_make("videoscale", NULL);
+        capsfilter = gst_element_factory_make("capsfilter", NULL);
+        g_object_set(G_OBJECT(rate), "drop-only", TRUE, NULL);
+        gst_bin_add_many(GST_BIN(pipeline), rate, scale, capsfilter, NULL);
+        if (!gst_element_link_many(queue, rate, scale, capsfilter, NULL)) {
+            g_print("Failed to link elements encoder scale\n");
+            g_free(key);
+            return NULL;
+        }
+        head = capsfilter;
+    }
+#endif
+
+#if defined(HAS_JETSON_NANO)
+    if (!gst_element_link_many(head, encoder, teesrc, NULL)) {
+        g_print("Failed to link  elements encoder source \n");
+        g_free(key);
+        return NULL;
+    }
+#else
+    if (g_str_has_prefix(codec, "h264")) {
+        if (!gst_element_link_many(head, encoder, get_h264_caps(), teesrc, NULL)) {
+            g_print("Failed to link elements encoder  source\n");
+            g_free(key);
+            return NULL;
+        }
+    } else {
+        if (!gst_element_link_many(head, encoder, teesrc, NULL)) {
+            g_print("Failed to link elements encoder source \n");
+            g_free(key);
+            return NULL;
+        }
+    }
+#endif
+    link_request_src_pad(input, queue);
+
+    // the renditions made on demand are in the encode branch too.
+    set_sched_branch(queue, SCHED_ENCODE);
+    set_sched_branch(encoder, SCHED_ENCODE);
+
+    entry = g_new0(EncoderEntry, 1);
+    entry->encoder = encoder;
+    entry->capsfilter = capsfilter;
+    entry->tee = teesrc;
+    pad = gst_element_get_static_pad(queue, "sink");
+    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, encoder_demand_probe, entry, NULL);
+    gst_object_unref(pad);
+    g_print("new encoder rendition: %s\n", key);
+    g_hash_table_insert(encoder_htable, key, entry);
+    return entry;
+}
+
+static GstElement *get_shared_encoder(GstElement *input, const gchar *codec, int width, int height,
+                                      const gchar *profile, const gchar *name) {
+    EncoderEntry *entry = get_encoder_entry(input, codec, width, height, profile, name);
+    if (!entry)
+        return NULL;
+    // the storage and analytics sinks run all the time.
+    entry->persistent = TRUE;
+    has_persistent_encoder = TRUE;
+    return entry->tee;
+}
+
+/**
+ * @brief The shared rendition of the overlay video at the capture size.
+ */
+static GstElement *get_shared_video_encoder(const gchar *codec) {
+    return get_shared_encoder(get_overlay_tee(), codec,
+                              config_data.v4l2src_data.width,
+                              config_data.v4l2src_data.height,
+                              "live", NULL);
+}
+
+static EncoderEntry *abr_entry = NULL;
+static EncoderEntry *webrtc_entry = NULL;
+
+static GstElement *get_encoder_src() {
+    EncoderEntry *entry;
+    // the adaptive bitrate rendition is not shared with the storage sinks.
+    entry = get_encoder_entry(get_overlay_tee(), config_data.videnc,
+                              config_data.v4l2src_data.width,
+                              config_data.v4l2src_data.height,
+                              config_data.webrtc.abr.enable ? "abr" : "live",
+                              vid_encoder_tee);
+    if (!entry)
+        return NULL;
+    if (config_data.webrtc.abr.enable)
+        abr_entry = entry;
+    webrtc_entry = entry;
+    return entry->tee;
+}
+
+/**
+ * @brief The UDP consumers can not get a replay of the GOP, ask the WebRTC rendition for a keyframe now
+ * instead of waiting for the next one, i.e: nvv4l2h264enc runs with iframeinterval=1000.
+ */
+static void request_encoder_keyframe() {
+    if (webrtc_entry)
+        gst_element_send_event(webrtc_entry->encoder,
+                               gst_video_event_new_upstream_force_key_unit(GST_CLOCK_TIME_NONE, TRUE, 0));
+}
+
+/**
+ * @brief Simulcast ladder, layer 0 is the WebRTC rendition at the capture size,
+ * the others are the downscaled renditions of webrtc.simulcast.layers.
+ */
+static gint video_layer_count = 1;
+
+static guint get_layer_scale(gint layer) {
+    return layer > 0 ? config_data.webrtc.simulcast.layers[layer - 1] : 1;
+}
+
+/**
+ * @brief The largest layer that the estimate can carry at 75% of its nominal bitrate.
+ */
+static gint get_layer_by_bitrate(guint kbps) {
+    guint nominal = get_exact_bitrate() / 1000;
+    gint layer;
+    for (layer = 0; layer < video_layer_count - 1; layer++) {
+        guint scale = get_layer_scale(layer);
+        if ((guint64)kbps * scale * scale * 4 >= (guint64)nominal * 3)
+            break;
+    }
+    return layer;
+}
+
+/**
+ * @brief Adaptive bitrate of the WebRTC rendition.
+ * Every peer polls the "get-stats" of its webrtcbin and runs a loss based controller
+ * on the remote-inbound-rtp report, the encoder follows the lowest estimate of all peers.
+ * https://datatracker.ietf.org/doc/html/draft-ietf-rmcat-gcc-02#section-6
+ */
+static GMutex abr_lock;
+static GList *abr_peers = NULL;
+static guint abr_bitrate = 0; // kbps, applied to the encoder.
+static gint abr_level = 0;    // 0: full, 1: half framerate, 2: half framerate and resolution.
+
+typedef struct {
+    gdouble loss;
+    gdouble rtt;
+    gboolean found;
+} AbrStats;
+
+static guint get_abr_max_bitrate() {
+    guint nominal = get_exact_bitrate() / 1000;
+    if (config_data.webrtc.abr.max_kbps > 0)
+        return config_data.webrtc.abr.max_kbps;
+    return nominal;
+}
+
+#if !defined(HAS_JETSON_NANO)
+static void set_abr_level(gint level) {
+    GstCaps *caps;
+    int width = config_data.v4l2src_data.width;
+    int height = config_data.v4l2src_data.height;
+    int framerate = config_data.v4l2src_data.framerate;
+
+    if (level > 0)
+        framerate = MAX(framerate / 2, 5);
+    if (level > 1) {
+        width = (width / 2) & ~1;
+        height = (height / 2) & ~1;
+    }
+    caps = gst_caps_new_simple("video/x-raw",
+                               "width", G_TYPE_INT, width,
+                               "height", G_TYPE_INT, height,
+                               "framerate", GST_TYPE_FRACTION, framerate, 1, NULL);
+    g_object_set(G_OBJECT(abr_entry->capsfilter), "caps", caps, NULL);
+    gst_caps_unref(caps);
+    g_print("abr level: %d, %dx%d@%d\n", level, width, height, framerate);
+}
+#endif
+
+/* percentage of TL0 in set_vpx_temporal_bitrate. */
+static guint get_base_layer_share() {
+    return config_data.webrtc.temporal_layers == 3 ? 40 : 60;
+}
+
+/* must be called with abr_lock held. */
+static void update_abr_encoder() {
+    guint target = get_abr_max_bitrate();
+    guint nominal = get_exact_bitrate() / 1000;
+    gint level;
+    GList *item;
+
+    if (!abr_entry)
+        return;
+    // the last peer left, the other consumers of the rendition get it back in full.
+    if (!abr_peers) {
+        if (abr_bitrate && abr_bitrate != nominal)
+            set_encoder_bitrate(abr_entry->encoder, nominal);
+        abr_bitrate = 0;
+#if !defined(HAS_JETSON_NANO)
+        if (abr_level != 0 && abr_entry->capsfilter)
+            set_abr_level(0);
+#endif
+        abr_level = 0;
+        return;
+    }
+
+    for (item = abr_peers; item; item = item->next) {
+        WebrtcItem *peer = item->data;
+        // the peers on the lower simulcast layers do not drag down the full rendition.
+        if (g_atomic_int_get(&peer->send_avpair.layer) != 0)
+            continue;
+        // the base layer only peers get the share of TL0.
+        if (peer->send_avpair.base_layer_only)
+            target = MIN(target, peer->abr.bitrate * 100 / get_base_layer_share());
+        else
+            target = MIN(target, peer->abr.bitrate);
+    }
+
+    // ignore the changes less than 5%.
+    if (abr_bitrate && ABS((gint)target - (gint)abr_bitrate) * 20 < abr_bitrate)
+        return;
+
+    set_encoder_bitrate(abr_entry->encoder, target);
+    abr_bitrate = target;
+
+    level = target * 2 >= nominal ? 0 : (target * 4 >= nominal ? 1 : 2);
+    if (level < abr_level) {
+        // 25% headroom before going back up, so it does not flap around the threshold.
+        guint headroom = target * 4 / 5;
+        level = headroom * 2 >= nominal ? 0 : (headroom * 4 >= nominal ? 1 : 2);
+    }
+#if !defined(HAS_JETSON_NANO)
+    if (level != abr_level && abr_entry->capsfilter)
+        set_abr_level(level);
+#endif
+    abr_level = level;
+}
+
+static gboolean foreach_abr_stats(GQuark field_id, const GValue *value, gpointer user_data) {
+    AbrStats *stats = (AbrStats *)user_data;
+    const GstStructure *report;
+    GstWebRTCStatsType type;
+    gdouble val;
+
+    if (!GST_VALUE_HOLDS_STRUCTURE(value))
+        return TRUE;
+
+    report = gst_value_get_structure(value);
+    if (!gst_structure_get(report, "type", GST_TYPE_WEBRTC_STATS_TYPE, &type, NULL) ||
+        type != GST_WEBRTC_STATS_REMOTE_INBOUND_RTP)
+        return TRUE;
+
+    if (gst_structure_get_double(report, "fraction-lost", &val)) {
+        stats->loss = MAX(stats->loss, val);
+        stats->found = TRUE;
+    }
+    if (gst_structure_get_double(report, "round-trip-time", &val))
+        stats->rtt = MAX(stats->rtt, val);
+    return TRUE;
+}
+
+static void on_abr_stats(GstPromise *promise, gpointer user_data) {
+    WebrtcItem *item = (WebrtcItem *)user_data;
+    AbrStats stats = {0};
+    const GstStructure *reply;
+    guint bitrate;
+
+    if (gst_promise_wait(promise) != GST_PROMISE_RESULT_REPLIED)
+        goto out;
+
+    reply = gst_promise_get_reply(promise);
+    if (reply)
+        gst_structure_foreach(reply, foreach_abr_stats, &stats);
+
+    g_mutex_lock(&abr_lock);
+    // the peer may already leave.
+    if (!stats.found || !g_list_find(abr_peers, item)) {
+        g_mutex_unlock(&abr_lock);
+        goto out;
+    }
+
+    bitrate = item->abr.bitrate;
+    if (stats.loss > 0.1) {
+        bitrate = bitrate * (1.0 - 0.5 * stats.loss);
+    } else if (stats.rtt > config_data.webrtc.abr.max_rtt / 1000.0) {
+        // queues building up before the loss shows up.
+        bitrate = bitrate * 0.85;
+    } else if (stats.loss < 0.02) {
+        bitrate = bitrate * 1.05 + 10;
+    }
+    item->abr.bitrate = CLAMP(bitrate, (guint)config_data.webrtc.abr.min_kbps, get_abr_max_bitrate());
+    if (item->send_avpair.auto_layer) {
+        g_atomic_int_set(&item->send_avpair.pending_layer, get_layer_by_bitrate(item->abr.bitrate));
+        // a peer well below the rate driven by the others drops the upper temporal layers.
+        if (temporal_layers_enabled && abr_bitrate) {
+            if (item->abr.bitrate * 5 < abr_bitrate * 4)
+                g_atomic_int_set(&item->send_avpair.pending_base_layer, TRUE);
+            else if (item->abr.bitrate >= abr_bitrate)
+                g_atomic_int_set(&item->send_avpair.pending_base_layer, FALSE);
+        }
+    }
+    update_abr_encoder();
+    g_mutex_unlock(&abr_lock);
+out:
+    gst_promise_unref(promise);
+}
+
+static gboolean poll_abr_stats(gpointer user_data) {
+    WebrtcItem *item = (WebrtcItem *)user_data;
+    GstPromise *promise;
+
+    promise = gst_promise_new_with_change_func(on_abr_stats, item, NULL);
+    g_signal_emit_by_name(item->sendbin, "get-stats", NULL, promise);
+    return G_SOURCE_CONTINUE;
+}
+
+static void abr_add_peer(WebrtcItem *item) {
+    if (!config_data.webrtc.abr.enable || !abr_entry)
+        return;
+
+    g_mutex_lock(&abr_lock);
+    item->abr.bitrate = abr_bitrate ? abr_bitrate : get_abr_max_bitrate();
+    abr_peers = g_list_append(abr_peers, item);
+    update_abr_encoder();
+    g_mutex_unlock(&abr_lock);
+    item->abr.timer_id = g_timeout_add(config_data.webrtc.abr.interval, poll_abr_stats, item);
+}
+
+static void abr_remove_peer(WebrtcItem *item) {
+    if (!item->abr.timer_id)
+        return;
+
+    g_source_remove(item->abr.timer_id);
+    item->abr.timer_id = 0;
+    g_mutex_lock(&abr_lock);
+    abr_peers = g_list_remove(abr_peers, item);
+    // the rest of peers may go back up.
+    update_abr_encoder();
+    g_mutex_unlock(&abr_lock);
+}
+
+/**
+ * @brief GOP cache of the app_sink fan-out, the RTP packets of every layer since the first packet of its last keyframe.
+ * A new appsrc consumer gets it replayed first, so it starts on a keyframe instead of waiting for the next one.
+ * Each cache is only touched by the streaming thread of its appsink.
+ */
+typedef struct {
+    GPtrArray *buffers;
+    gsize bytes;
+    gboolean valid; // FALSE until the first keyframe, or after the GOP outgrew max_kb.
+} GopCache;
+
+static GopCache gop_caches[MAX_VIDEO_LAYERS];
+
+static void gop_cache_push(GopCache *cache, GstBuffer *buffer) {
+    if (!GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT)) {
+        g_ptr_array_set_size(cache->buffers, 0);
+        cache->bytes = 0;
+        cache->valid = TRUE;
+    }
+    if (!cache->valid)
+        return;
+
+    cache->bytes += gst_buffer_get_size(buffer);
+    if (cache->bytes > (gsize)config_data.webrtc.gop_cache.max_kb * 1024) {
+        g_ptr_array_set_size(cache->buffers, 0);
+        cache->bytes = 0;
+        cache->valid = FALSE;
+        return;
+    }
+    g_ptr_array_add(cache->buffers, gst_buffer_ref(buffer));
+}
+
+/* returns GST_FLOW_FLUSHING if the appsrc is not started yet, the replay is tried again with the next packet. */
+static GstFlowReturn gop_cache_replay(GopCache *cache, GstElement *appsrc) {
+    GstFlowReturn ret = GST_FLOW_OK;
+    for (guint i = 0; i < cache->buffers->len; i++) {
+        g_signal_emit_by_name(appsrc, "push-buffer", g_ptr_array_index(cache->buffers, i), &ret);
+        if (ret != GST_FLOW_OK)
+            break;
+    }
+    return ret;
+}
+
+static void request_sink_keyframe(GstElement *appsink) {
+    GstPad *pad = gst_element_get_static_pad(appsink, "sink");
+    gst_pad_push_event(pad, gst_video_event_new_upstream_force_key_unit(GST_CLOCK_TIME_NONE, TRUE, 0));
+    gst_object_unref(pad);
+}
+
+static AppsrcSet *fanout_enter(gint *epoch) {
+    *epoch = g_atomic_int_get(&fanout_epoch) & 1;
+    g_atomic_int_inc(&fanout_readers[*epoch]);
+    return g_atomic_pointer_get(&G_AppsrcSet);
+}
+
+static void fanout_leave(gint epoch) {
+    g_atomic_int_dec_and_test(&fanout_readers[epoch]);
+}
+
+/**
+ * @brief Called with G_appsrc_lock. Both epochs are drained, a reader that read the epoch before the
+ * previous publish may still be counted in the other one. The pushes to the leaky appsrcs never block,
+ * so the wait is as short as one fan-out pass.
+ */
+static void fanout_publish(AppsrcSet *set) {
+    AppsrcSet *old = G_AppsrcSet;
+
+    g_atomic_pointer_set(&G_AppsrcSet, set);
+    for (int i = 0; i < 2; i++) {
+        gint epoch = g_atomic_int_add(&fanout_epoch, 1) & 1;
+        while (g_atomic_int_get(&fanout_readers[epoch]))
+            g_usleep(50);
+    }
+    g_free(old);
+}
+
+static void fanout_add(AppSrcAVPair *pair) {
+    guint len = G_AppsrcSet ? G_AppsrcSet->len : 0;
+    AppsrcSet *set = g_malloc(sizeof(AppsrcSet) + (len + 1) * sizeof(AppSrcAVPair *));
+
+    if (len)
+        memcpy(set->pairs, G_AppsrcSet->pairs, len * sizeof(AppSrcAVPair *));
+    set->pairs[len] = pair;
+    set->len = len + 1;
+    fanout_publish(set);
+}
+
+/* once it returns, the fan-out no longer touches the pair and its appsrcs. */
+static void fanout_remove(AppSrcAVPair *pair) {
+    AppsrcSet *set;
+    guint len = G_AppsrcSet ? G_AppsrcSet->len : 0;
+
+    set = g_malloc(sizeof(AppsrcSet) + len * sizeof(AppSrcAVPair *));
+    set->len = 0;
+    for (guint i = 0; i < len; i++) {
+        if (G_AppsrcSet->pairs[i] != pair)
+            set->pairs[set->len++] = G_AppsrcSet->pairs[i];
+    }
+    if (set->len == len) {
+        g_free(set);
+        return;
+    }
+    if (!set->len) {
+        g_free(set);
+        set = NULL;
+    }
+    fanout_publish(set);
+}
+
+/* replay: the consumer is ready now, a WebRTC peer waits until it is connected. */
+static void add_appsrc_subscriber(AppSrcAVPair *pair, gboolean replay) {
+    if (config_data.webrtc.gop_cache.enable) {
+        // room for the replay, the leaky appsrc would drop the keyframe first.
+        g_object_set(pair->video_src, "max-bytes", (guint64)config_data.webrtc.gop_cache.max_kb * 2048, NULL);
+        pair->gop_replay = replay;
+    }
+    g_mutex_lock(&G_appsrc_lock);
+    fanout_add(pair);
+    g_mutex_unlock(&G_appsrc_lock);
+}
+
+/**
+ * @brief The packets before the DTLS handshake are dropped by webrtcbin, so the GOP replay
+ * or the keyframe request waits until the peer is connected.
+ */
+static void on_send_connection_state(GstElement *webrtcbin, GParamSpec *pspec, gpointer user_data) {
+    WebrtcItem *item = (WebrtcItem *)user_data;
+    GstWebRTCPeerConnectionState state;
+
+    g_object_get(webrtcbin, "connection-state", &state, NULL);
+    if (state != GST_WEBRTC_PEER_CONNECTION_STATE_CONNECTED)
+        return;
+    if (item->setup_start) {
+        g_print("%s connected, the setup took %.1f ms, shared DTLS certificate: %s.\n", GST_OBJECT_NAME(webrtcbin),
+                (g_get_monotonic_time() - item->setup_start) / 1000.0, config_data.webrtc.dtls.shared ? "yes" : "no");
+        item->setup_start = 0;
+    }
+    if (item->send_avpair.video_src && config_data.webrtc.gop_cache.enable)
+        g_atomic_int_set(&item->send_avpair.gop_replay, TRUE);
+    else
+        request_encoder_keyframe();
+}
+
+static void remove_appsrc_subscriber(AppSrcAVPair *pair) {
+    g_mutex_lock(&G_appsrc_lock);
+    fanout_remove(pair);
+    g_mutex_unlock(&G_appsrc_lock);
+    gst_caps_replace(&pair->video_caps, NULL);
+    gst_caps_replace(&pair->audio_caps, NULL);
+    pair->rtp_started = FALSE;
+    pair->client_queue.started = FALSE;
+    pair->client_queue.congested = FALSE;
+}
+
+typedef struct _ClientQueue ClientQueue;
+
+static struct {
+    gsize congestions;
+    gsize drops;
+    gsize keyframe_requests;
+} client_queue_stats;
+
+/**
+ * @brief Keyframe-aware drop of the video queue of a peer. Above max_ms of backlog the video is dropped
+ * until the backlog is down to half of it and a keyframe starts, so a slow peer gets a lower framerate
+ * instead of broken frames. Returns TRUE to drop, *request is set once per congestion to ask for the keyframe.
+ */
+static gboolean client_queue_drop(ClientQueue *queue, gint backlog_ms, gboolean keyframe_start, gboolean *request) {
+    *request = FALSE;
+    if (!queue->congested) {
+        if (backlog_ms <= queue->max_ms)
+            return FALSE;
+        queue->congested = TRUE;
+        queue->keyframe_requested = FALSE;
+        g_atomic_pointer_add(&client_queue_stats.congestions, 1);
+    }
+    if (backlog_ms <= queue->max_ms / 2) {
+        if (keyframe_start) {
+            queue->congested = FALSE;
+            return FALSE;
+        }
+        if (!queue->keyframe_requested) {
+            queue->keyframe_requested = *request = TRUE;
+            g_atomic_pointer_add(&client_queue_stats.keyframe_requests, 1);
+        }
+    } else if (keyframe_start) {
+        // that one came too early, ask again once the queue is down.
+        queue->keyframe_requested = FALSE;
+    }
+    g_atomic_pointer_add(&client_queue_stats.drops, 1);
+    return TRUE;
+}
+
+void get_client_queue_stats(ClientQueueStats *stats) {
+    stats->max_ms = MAX(config_data.webrtc.client_queue.max_ms, 0);
+    stats->congestions = g_atomic_pointer_get(&client_queue_stats.congestions);
+    stats->drops = g_atomic_pointer_get(&client_queue_stats.drops);
+    stats->keyframe_requests = g_atomic_pointer_get(&client_queue_stats.keyframe_requests);
+}
+
+/**
+ * @brief The fan-out measures the backlog of a peer between the running time of the last packet pushed
+ * to its appsrc and the last one out of it, without a lock or a property read per packet.
+ */
+static GstPadProbeReturn on_client_queue_out(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    ClientQueue *queue = (ClientQueue *)user_data;
+    GstClockTime pts = GST_BUFFER_PTS(GST_PAD_PROBE_INFO_BUFFER(info));
+    gint ms, old;
+
+    if (!GST_CLOCK_TIME_IS_VALID(pts))
+        return GST_PAD_PROBE_OK;
+    ms = (gint)(pts / GST_MSECOND);
+    // the replayed GOP is older than the live packets, it does not move it back.
+    do {
+        old = g_atomic_int_get(&queue->sent_ms);
+        if ((gint)((guint)ms - (guint)old) <= 0)
+            break;
+    } while (!g_atomic_int_compare_and_exchange(&queue->sent_ms, old, ms));
+    return GST_PAD_PROBE_OK;
+}
+
+static gboolean fanout_client_drop(AppSrcAVPair *pair, GstElement *appsink, GstClockTime pts, gboolean keyframe_start) {
+    ClientQueue *queue = &pair->client_queue;
+    gboolean request;
+    gint ms, backlog;
+
+    if (!queue->max_ms || !GST_CLOCK_TIME_IS_VALID(pts))
+        return FALSE;
+    ms = (gint)(pts / GST_MSECOND);
+    if (!queue->started) {
+        queue->started = TRUE;
+        queue->pushed_ms = ms;
+        g_atomic_int_set(&queue->sent_ms, ms);
+    }
+    backlog = (gint)((guint)queue->pushed_ms - (guint)g_atomic_int_get(&queue->sent_ms));
+    if (client_queue_drop(queue, backlog, keyframe_start, &request)) {
+        if (request)
+            request_sink_keyframe(appsink);
+        return TRUE;
+    }
+    queue->pushed_ms = ms;
+    return FALSE;
+}
+
+/**
+ * @brief A peer never blocks the shared pipeline, the time bound above the drop policy is a leaky backstop.
+ */
+static GstElement *make_client_queue() {
+    GstElement *queue = gst_element_factory_make("queue", NULL);
+    g_object_set(queue, "leaky", 2, NULL);
+    if (config_data.webrtc.client_queue.max_ms > 0)
+        g_object_set(queue, "max-size-buffers", 0, "max-size-bytes", 0,
+                     "max-size-time", (guint64)config_data.webrtc.client_queue.max_ms * 2 * GST_MSECOND, NULL);
+    return queue;
+}
+
+#if 0
+/* called when the appsink notifies us that there is a new buffer ready for
+ * processing */
+static GstFlowReturn
+on_new_sample_from_sink(GstElement *elt, CustomAppData *data) {
+    GstSample *sample;
+    GstBuffer *app_buffer, *buffer;
+    GstElement *source;
+    GstFlowReturn ret = GST_FLOW_NOT_LINKED;
+
+    /* get the sample from appsink */
+    sample = gst_app_sink_pull_sample(GST_APP_SINK(elt));
+    buffer = gst_sample_get_buffer(sample);
+
+    /* make a copy */
+    app_buffer = gst_buffer_copy(buffer);
 
     /* we don't need the appsink sample anymore */
     gst_sample_unref(sample);
@@ -1034,223 +2130,546 @@ on_new_sample_from_sink(GstElement *elt, CustomAppData *data) {
 
 #endif
 
-void udpsrc_cmd_rec_stop(gpointer user_data) {
-    RecordItem *item = (RecordItem *)user_data;
-    gst_element_set_state(GST_ELEMENT(item->pipeline),
-                          GST_STATE_NULL);
-    g_print("stop udpsrc record.\n");
+/**
+ * @brief The one recording bin, fed by the encoded tees of the WebRTC rendition, or of a fixed
+ * rendition at the capture size when the WebRTC one follows the ABR:
+ *
+ * video_sink -> queue -> parse -> tee "record_video" -> matroskamux -> filesink (a session)
+ * audio_sink -> queue -> opusparse -> tee "record_audio" --^
+ *
+ * It is built once. While no session is open, the queues take nothing without the pre-roll.
+ * With it, their src pads are blocked and they leak their oldest buffers past preroll.seconds
+ * plus the longest key-int interval seen, so the first keyframe the file starts at is still
+ * preroll.seconds before the event. preroll.max_kb caps them first, a long GOP then shortens
+ * the pre-roll. The queues only hold references to the encoded buffers.
+ * A session is only a muxer and a filesink linked to the tees, it starts at a keyframe and is
+ * finalized by its own EOS, no encoder, pipeline, socket or streaming thread is created for it.
+ *
+ * The sessions are named, owned by a peer or the motion record, and only opened, closed and
+ * listed from the main loop.
+ */
+enum {
+    RECORD_VIDEO,
+    RECORD_AUDIO,
+    RECORD_STREAMS
+};
 
-    gst_object_unref(GST_OBJECT(item->pipeline));
-    if (pthread_mutex_lock(&cmd_mtx)) {
-        g_error("Failed to lock on mutex.\n");
-    }
-    cmd_recording = FALSE;
-    if (pthread_mutex_unlock(&cmd_mtx)) {
-        g_error("Failed to lock on mutex.\n");
+typedef struct {
+    gchar *name;
+    gchar *owner;
+    gchar *path;
+    gint64 start_time; // wall clock, microseconds.
+    GstElement *mux;
+    GstElement *filesink;
+    GstPad *tee_pads[RECORD_STREAMS];
+    gint started; // the video passed its first keyframe, the audio waits for it.
+    gint eos;     // the filesink got the EOS.
+    gsize bytes;   // written to the filesink.
+    gsize dropped; // before the first keyframe.
+    gint64 leaked; // by the queues of the bin when it was opened.
+} RecordFile;
+
+static GstElement *record_bin = NULL;
+static EncoderEntry *record_entry = NULL;
+static gint record_idle = FALSE; // no session and no pre-roll, the queues drop at their sink.
+static GstClockTime record_gop = 0, record_last_key = GST_CLOCK_TIME_NONE;
+static GstElement *record_tees[RECORD_STREAMS];
+static GstElement *record_queues[RECORD_STREAMS];
+static GstPad *record_queue_pads[RECORD_STREAMS];
+static gulong record_blocks[RECORD_STREAMS];
+static gsize record_in[RECORD_STREAMS], record_out[RECORD_STREAMS];
+static GHashTable *record_sessions = NULL; // name -> RecordFile, the open ones.
+static guint record_serial = 0;
+
+static GstPadProbeReturn on_record_blocked(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn on_record_queue_buffer(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    g_atomic_pointer_add((gsize *)user_data, 1);
+    return GST_PAD_PROBE_OK;
+}
+
+static void request_record_keyframe() {
+    if (record_entry)
+        gst_element_send_event(record_entry->encoder,
+                               gst_video_event_new_upstream_force_key_unit(GST_CLOCK_TIME_NONE, TRUE, 0));
+}
+
+static gboolean has_record_preroll() {
+    return config_data.preroll.seconds > 0 && config_data.preroll.max_kb > 0;
+}
+
+// the pre-roll keeps one more key-int interval, the gate of the file drops up to it.
+static void update_record_gop(GstClockTime pts) {
+    GstClockTime gop;
+
+    if (GST_CLOCK_TIME_IS_VALID(record_last_key) && pts > record_last_key && pts - record_last_key > record_gop) {
+        record_gop = pts - record_last_key;
+        gop = (GstClockTime)config_data.preroll.seconds * GST_SECOND + record_gop;
+        for (int i = 0; i < RECORD_STREAMS; i++) {
+            if (record_queues[i])
+                g_object_set(record_queues[i], "max-size-time", (guint64)gop, NULL);
+        }
+        g_print("record pre-roll: key-int %.1f seconds, the queues hold %.1f seconds.\n",
+                (gdouble)record_gop / GST_SECOND, (gdouble)gop / GST_SECOND);
     }
-    item->pipeline = NULL;
+    record_last_key = pts;
 }
 
-int get_record_state() { return cmd_recording ? 1 : 0; }
+static GstPadProbeReturn on_record_queue_in(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    gint stream = GPOINTER_TO_INT(user_data);
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+
+    if (g_atomic_int_get(&record_idle))
+        return GST_PAD_PROBE_DROP;
+    g_atomic_pointer_add(&record_in[stream], 1);
+    if (stream == RECORD_VIDEO && has_record_preroll() && GST_BUFFER_PTS_IS_VALID(buffer) &&
+        !GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT))
+        update_record_gop(GST_BUFFER_PTS(buffer));
+    return GST_PAD_PROBE_OK;
+}
 
-static gchar *udpsrc_audio_cmdline(const gchar *sink) {
-    gchar *opus;
-    if (g_str_has_prefix(sink, "mux")) {
-        opus = g_strdup("rtpopusdepay");
-    } else {
-        opus = g_strdup("rtpopusdepay !rtpopuspay");
+// buffers the full queues of the bin threw away, a disk slower than the stream.
+static gint64 get_record_leaked() {
+    gint64 leaked = 0, count;
+    guint level;
+
+    for (int i = 0; i < RECORD_STREAMS; i++) {
+        if (!record_queues[i])
+            continue;
+        // the counters and the level are read apart from the streaming thread.
+        g_object_get(record_queues[i], "current-level-buffers", &level, NULL);
+        count = (gint64)g_atomic_pointer_get(&record_in[i]) - (gint64)g_atomic_pointer_get(&record_out[i]) - level;
+        leaked += MAX(count, 0);
     }
-    gchar *audio_src = g_strdup_printf("udpsrc port=%d multicast-group=%s  multicast-iface=lo ! "
-                                       " application/x-rtp,media=(string)audio,clock-rate=(int)48000,encoding-name=(string)OPUS,payload=(int)97 ! "
-                                       " %s !  queue leaky=1 ! %s.",
-                                       config_data.webrtc.udpsink.port + 1,
-                                       config_data.webrtc.udpsink.addr, opus, sink);
-    g_free(opus);
-    return audio_src;
+    return leaked;
 }
 
-static gchar *get_rtp_args() {
-    gchar *rtp = NULL;
-    if (g_strcmp0(config_data.videnc, "vp8")) {
-        rtp = g_strdup_printf("rtp%sdepay ! %sparse", config_data.videnc, config_data.videnc);
-    } else {
-        rtp = g_strdup_printf("rtp%sdepay ", config_data.videnc);
+// hold the pre-roll in the queues, or let it go into the files.
+static void set_record_blocked(gboolean blocked) {
+    if (!has_record_preroll()) {
+        g_atomic_int_set(&record_idle, blocked);
+        return;
+    }
+    for (int i = 0; i < RECORD_STREAMS; i++) {
+        if (!record_queue_pads[i])
+            continue;
+        if (blocked && !record_blocks[i]) {
+            record_blocks[i] = gst_pad_add_probe(record_queue_pads[i], GST_PAD_PROBE_TYPE_BLOCK_DOWNSTREAM,
+                                                 on_record_blocked, NULL, NULL);
+        } else if (!blocked && record_blocks[i]) {
+            gst_pad_remove_probe(record_queue_pads[i], record_blocks[i]);
+            record_blocks[i] = 0;
+        }
     }
-    return rtp;
 }
 
-void udpsrc_cmd_rec_start(gpointer user_data) {
-    /**
-     * @brief I want to create a module for recording, but it cannot be dynamically added and deleted while the pipeline is running。
-     * Maybe it's because I'm not familiar with its mechanics.
-     *
-     */
-    gchar *fullpath;
-    if (pthread_mutex_lock(&cmd_mtx)) {
-        g_error("Failed to lock on mutex.\n");
+static int start_record_bin() {
+    GstElement *queue, *parse, *tee;
+    GstPad *pad;
+    gchar *tmpname;
+
+    if (!_check_initial_status())
+        return -1;
+    // the ABR rendition changes its bitrate, size and framerate under the file, the muxer refuses them.
+    if (config_data.webrtc.abr.enable)
+        record_entry = get_encoder_entry(get_overlay_tee(), config_data.videnc,
+                                         config_data.v4l2src_data.width,
+                                         config_data.v4l2src_data.height, "live", NULL);
+    else
+        record_entry = webrtc_entry;
+    if (!record_entry)
+        return -1;
+    record_bin = gst_bin_new("record_bin");
+    gst_bin_add(GST_BIN(pipeline), record_bin);
+
+    for (int i = 0; i < RECORD_STREAMS; i++) {
+        GstElement *source = i == RECORD_VIDEO ? record_entry->tee : audio_source;
+        if (!source)
+            continue;
+        queue = gst_element_factory_make("queue", NULL);
+        tee = gst_element_factory_make("tee", i == RECORD_VIDEO ? "record_video" : "record_audio");
+        if (i == RECORD_AUDIO) {
+            parse = gst_element_factory_make("opusparse", NULL);
+        } else if (g_strcmp0(config_data.videnc, "vp8")) {
+            tmpname = g_strdup_printf("%sparse", config_data.videnc);
+            parse = gst_element_factory_make(tmpname, NULL);
+            g_free(tmpname);
+            // every file starts with the stream headers.
+            if (g_str_has_prefix(config_data.videnc, "h26"))
+                g_object_set(parse, "config-interval", -1, NULL);
+        } else {
+            // vp8parse not avavilable ?
+            parse = gst_element_factory_make("identity", NULL);
+        }
+        if (!queue || !parse || !tee) {
+            g_printerr("record bin elements could not be created.\n");
+            return -1;
+        }
+        g_object_set(tee, "allow-not-linked", TRUE, NULL);
+        if (has_record_preroll())
+            g_object_set(queue, "leaky", 2, "max-size-buffers", 0,
+                         "max-size-bytes", (guint)config_data.preroll.max_kb * 1024 / (i == RECORD_VIDEO ? 1 : 8),
+                         "max-size-time", (guint64)config_data.preroll.seconds * GST_SECOND, NULL);
+        else
+            g_object_set(queue, "leaky", 2, NULL);
+        gst_bin_add_many(GST_BIN(record_bin), queue, parse, tee, NULL);
+        if (!gst_element_link_many(queue, parse, tee, NULL)) {
+            g_printerr("Failed to link elements record bin.\n");
+            return -1;
+        }
+        record_tees[i] = tee;
+        record_queues[i] = queue;
+        record_queue_pads[i] = gst_element_get_static_pad(queue, "src");
+        gst_pad_add_probe(record_queue_pads[i], GST_PAD_PROBE_TYPE_BUFFER, on_record_queue_buffer, &record_out[i], NULL);
+
+        pad = gst_element_get_static_pad(queue, "sink");
+        gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, on_record_queue_in, GINT_TO_POINTER(i), NULL);
+        gst_element_add_pad(record_bin, gst_ghost_pad_new(i == RECORD_VIDEO ? "video_sink" : "audio_sink", pad));
+        gst_object_unref(pad);
+        link_request_src_pad_with_dst_name(source, record_bin, i == RECORD_VIDEO ? "video_sink" : "audio_sink");
     }
-    cmd_recording = TRUE;
-    if (pthread_mutex_unlock(&cmd_mtx)) {
-        g_error("Failed to lock on mutex.\n");
+    record_sessions = g_hash_table_new(g_str_hash, g_str_equal);
+
+    set_record_blocked(TRUE);
+    if (has_record_preroll()) {
+        // the pre-roll is only there if the rendition runs before the event.
+        acquire_encoder_demand();
+        g_print("record pre-roll: %d seconds, at most %d KB.\n", config_data.preroll.seconds, config_data.preroll.max_kb);
+    }
+    return 0;
+}
+
+static GstPadProbeReturn on_record_file_gate(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    RecordFile *file = (RecordFile *)user_data;
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+
+    if (g_atomic_int_get(&file->started))
+        return GST_PAD_PROBE_REMOVE;
+    if (pad != file->tee_pads[RECORD_VIDEO] || GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT)) {
+        g_atomic_pointer_add(&file->dropped, 1);
+        return GST_PAD_PROBE_DROP;
     }
+    g_atomic_int_set(&file->started, TRUE);
+    return GST_PAD_PROBE_REMOVE;
+}
 
-    RecordItem *item = (RecordItem *)user_data;
-    gchar *timestr = NULL;
-    gchar *cmdline = NULL;
-    GError *error = NULL;
-    gchar *today = get_today_str();
+static void record_file_free(RecordFile *file) {
+    for (int i = 0; i < RECORD_STREAMS; i++) {
+        if (!file->tee_pads[i])
+            continue;
+        gst_element_release_request_pad(record_tees[i], file->tee_pads[i]);
+        gst_object_unref(file->tee_pads[i]);
+    }
+    gst_element_set_state(file->filesink, GST_STATE_NULL);
+    gst_element_set_state(file->mux, GST_STATE_NULL);
+    gst_bin_remove_many(GST_BIN(record_bin), file->mux, file->filesink, NULL);
+    g_free(file->name);
+    g_free(file->owner);
+    g_free(file->path);
+    g_free(file);
+}
 
-    gchar *outdir = g_strconcat(config_data.root_dir, "/record/", today, NULL);
-    g_free(today);
+static gboolean finish_record_file(gpointer user_data) {
+    RecordFile *file = (RecordFile *)user_data;
 
-    timestr = get_format_current_time();
-    gst_println("starting record at: %s .\n", timestr);
-    g_free(timestr);
+    g_print("stop record %s: %s, %" G_GSIZE_FORMAT " bytes.\n", file->name, file->path, file->bytes);
+    record_file_free(file);
+    return G_SOURCE_REMOVE;
+}
 
-    _mkdir(outdir, 0755);
-    timestr = get_current_time_str();
-    gchar *filename = g_strdup_printf("/webrtc_record-%s.mkv", timestr);
-    fullpath = g_strconcat(outdir, filename, NULL);
-    g_free(filename);
-    g_free(timestr);
-    gchar *upenc = g_ascii_strup(config_data.videnc, strlen(config_data.videnc));
-    gchar *rtp = get_rtp_args();
-    gchar *video_src = g_strdup_printf("udpsrc port=%d multicast-group=%s multicast-iface=lo ! "
-                                       " application/x-rtp,media=(string)video,clock-rate=(int)90000,encoding-name=(string)%s,payload=(int)96 ! "
-                                       " %s !  queue leaky=1 ! mux. ",
-                                       config_data.webrtc.udpsink.port, config_data.webrtc.udpsink.addr, upenc, rtp);
-    g_free(upenc);
-    g_free(rtp);
-    if (config_data.audio.enable) {
-        gchar *audio_src = udpsrc_audio_cmdline("mux");
-        cmdline = g_strdup_printf(" matroskamux name=mux ! filesink  async=false location=\"%s\" %s %s ", fullpath, audio_src, video_src);
-        g_free(audio_src);
-    } else {
-        cmdline = g_strdup_printf(" matroskamux name=mux ! filesink  async=false location=\"%s\" %s ", fullpath, video_src);
+static GstPadProbeReturn on_record_file_sink(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    RecordFile *file = (RecordFile *)user_data;
+
+    if (info->type & GST_PAD_PROBE_TYPE_BUFFER) {
+        g_atomic_pointer_add(&file->bytes, gst_buffer_get_size(GST_PAD_PROBE_INFO_BUFFER(info)));
+        return GST_PAD_PROBE_OK;
     }
+    if (GST_EVENT_TYPE(GST_PAD_PROBE_INFO_EVENT(info)) != GST_EVENT_EOS)
+        return GST_PAD_PROBE_OK;
+    // the file is complete, the elements are released from the main loop.
+    if (!g_atomic_int_exchange(&file->eos, TRUE))
+        g_idle_add(finish_record_file, file);
+    return GST_PAD_PROBE_DROP;
+}
 
-    g_free(fullpath);
-    g_free(outdir);
-    g_print("record cmdline: %s \n", cmdline);
-    g_free(video_src);
+static GstPadProbeReturn on_record_file_unlink(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    GstPad *sinkpad = gst_pad_get_peer(pad);
 
-    item->pipeline = gst_parse_launch(cmdline, &error);
-    if (error) {
-        gchar *message = g_strdup_printf("Unable to build pipeline: %s\n", error->message);
-        g_print("%s", message);
-        g_free(message);
-        g_error_free(error);
+    // the muxer gets the EOS of each stream, and writes its index once it has them all.
+    if (sinkpad) {
+        gst_pad_unlink(pad, sinkpad);
+        gst_pad_send_event(sinkpad, gst_event_new_eos());
+        gst_object_unref(sinkpad);
     }
+    return GST_PAD_PROBE_REMOVE;
+}
 
-    g_free(cmdline);
-    gst_element_set_state(item->pipeline, GST_STATE_READY);
+static guint count_record_sessions(const gchar *owner) {
+    GHashTableIter iter;
+    RecordFile *file;
+    guint count = 0;
 
-    gst_element_set_state(item->pipeline, GST_STATE_PLAYING);
+    g_hash_table_iter_init(&iter, record_sessions);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&file)) {
+        if (!g_strcmp0(file->owner, owner))
+            count++;
+    }
+    return count;
 }
 
-#if !defined(GLIB_AVAILABLE_IN_2_74)
-typedef struct {
-    guint timeout_id;
-    gpointer user_data;
-} TimeoutFulldata;
+static gboolean has_record_owner_prefix(const gchar *name, const gchar *owner) {
+    gsize len = strlen(owner);
+    return !strncmp(name, owner, len) && name[len] == '-';
+}
 
-static void
-destroy_timeout(TimeoutFulldata *tdata) {
-    tdata->timeout_id = 0;
-    g_free(tdata);
+// the names generated for the owners, <owner>-<serial>.
+static gboolean is_record_owner_name(const gchar *name) {
+    return has_record_owner_prefix(name, RECORD_OWNER_PEER) || has_record_owner_prefix(name, RECORD_OWNER_MOTION);
 }
-#endif
 
-static gboolean stop_udpsrc_rec(gpointer user_data) {
-#if defined(GLIB_AVAILABLE_IN_2_74)
-    GstElement *rec_pipeline = (GstElement *)user_data;
-#else
-    TimeoutFulldata *tdata = (TimeoutFulldata *)user_data;
-    GstElement *rec_pipeline = (GstElement *)tdata->user_data;
-    if (tdata->timeout_id) {
-        g_source_remove(tdata->timeout_id);
-        tdata->timeout_id = 0;
+/**
+ * @brief Open a recording session, outdir/record/<today>/<name>_<time>.mkv, with a name
+ * given by its owner or <owner>-<serial>. Returns the name, NULL without the bin, when the
+ * name is taken or is one generated for another owner, or when the owner has rec_sessions.
+ */
+const gchar *record_session_start(const gchar *name, const gchar *owner) {
+    RecordFile *file;
+    GObjectClass *klass;
+    gchar *today, *outdir, *timestr, *filename, *name_buf;
+    gboolean unblocked;
+
+    if (!record_bin || !record_tees[RECORD_VIDEO]) {
+        g_printerr("no recording bin, unable to record.\n");
+        return NULL;
+    }
+    if (name && !*name)
+        name = NULL;
+    if (config_data.rec_sessions > 0 && count_record_sessions(owner) >= (guint)config_data.rec_sessions) {
+        g_printerr("%s has %d records already.\n", owner, config_data.rec_sessions);
+        return NULL;
+    }
+    if (name && is_record_owner_name(name) && !has_record_owner_prefix(name, owner)) {
+        g_printerr("record %s is a name of another owner.\n", name);
+        return NULL;
+    }
+    name_buf = name ? g_strdup(name) : NULL;
+    while (!name_buf || (!name && g_hash_table_contains(record_sessions, name_buf))) {
+        g_free(name_buf);
+        name_buf = g_strdup_printf("%s-%u", owner, ++record_serial);
+    }
+    // every session is in the table, a taken name never replaces a running one.
+    if (g_hash_table_contains(record_sessions, name_buf)) {
+        g_printerr("record %s is already running.\n", name_buf);
+        g_free(name_buf);
+        return NULL;
+    }
+    file = g_new0(RecordFile, 1);
+    file->mux = gst_element_factory_make("matroskamux", NULL);
+    file->filesink = gst_element_factory_make("filesink", NULL);
+    if (!file->mux || !file->filesink) {
+        g_printerr("record file elements could not be created.\n");
+        g_free(name_buf);
+        g_free(file);
+        return NULL;
     }
+    file->owner = g_strdup(owner);
+    file->name = name_buf;
+    file->start_time = g_get_real_time();
+    file->leaked = get_record_leaked();
+
+    today = get_today_str();
+    outdir = g_strconcat(config_data.root_dir, "/record/", today, NULL);
+    _mkdir(outdir, 0755);
+    timestr = get_current_time_str();
+    // the name is from the peer, it can not leave the directory.
+    filename = g_strcanon(g_strdup(file->name), G_CSET_A_2_Z G_CSET_a_2_z G_CSET_DIGITS "-_", '_');
+    file->path = g_strdup_printf("%s/%s_%s.mkv", outdir, filename, timestr);
+    g_free(filename);
+    g_free(timestr);
+    g_free(outdir);
+    g_free(today);
+
+    klass = G_OBJECT_GET_CLASS(file->mux);
+    // the timestamps of the main pipeline, i.e. hours of running time before the record.
+    if (g_object_class_find_property(klass, "offset-to-zero"))
+        g_object_set(file->mux, "offset-to-zero", TRUE, NULL);
+    g_object_set(file->filesink, "location", file->path, "async", FALSE, NULL);
+    gst_bin_add_many(GST_BIN(record_bin), file->mux, file->filesink, NULL);
+    gst_element_link(file->mux, file->filesink);
+    {
+        GstPad *pad = gst_element_get_static_pad(file->filesink, "sink");
+        gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+                          on_record_file_sink, file, NULL);
+        gst_object_unref(pad);
+    }
+    gst_element_sync_state_with_parent(file->filesink);
+    gst_element_sync_state_with_parent(file->mux);
+
+    /* linked from the file up to the tees, the gate drops up to the first keyframe. */
+    for (int i = 0; i < RECORD_STREAMS; i++) {
+        GstPad *sinkpad;
+        if (!record_tees[i])
+            continue;
+#if GST_VERSION_MINOR >= 20
+        file->tee_pads[i] = gst_element_request_pad_simple(record_tees[i], "src_%u");
+        sinkpad = gst_element_request_pad_simple(file->mux, i == RECORD_VIDEO ? "video_%u" : "audio_%u");
+#else
+        file->tee_pads[i] = gst_element_get_request_pad(record_tees[i], "src_%u");
+        sinkpad = gst_element_get_request_pad(file->mux, i == RECORD_VIDEO ? "video_%u" : "audio_%u");
 #endif
-    gst_element_set_state(GST_ELEMENT(rec_pipeline),
-                          GST_STATE_NULL);
-    g_print("stop udpsrc record.\n");
+        gst_pad_add_probe(file->tee_pads[i], GST_PAD_PROBE_TYPE_BUFFER, on_record_file_gate, file, NULL);
+        if (gst_pad_link(file->tee_pads[i], sinkpad) != GST_PAD_LINK_OK)
+            g_printerr("unable to link the %s of the recording bin.\n", GST_OBJECT_NAME(record_tees[i]));
+        gst_object_unref(sinkpad);
+    }
+
+    unblocked = g_hash_table_size(record_sessions) == 0;
+    if (unblocked) {
+        if (has_record_preroll()) {
+            guint64 level_time = 0;
+            guint level_bytes = 0;
+            g_object_get(record_queues[RECORD_VIDEO], "current-level-time", &level_time,
+                         "current-level-bytes", &level_bytes, NULL);
+            g_print("record pre-roll: %.1f seconds, %u KB of %d KB queued.\n",
+                    (gdouble)level_time / GST_SECOND, level_bytes / 1024, config_data.preroll.max_kb);
+        } else {
+            acquire_encoder_demand();
+        }
+        set_record_blocked(FALSE);
+    }
+    g_hash_table_insert(record_sessions, file->name, file);
+    /* only a file that unblocks the pre-roll starts at its first queued keyframe, the other
+     * files join the running stream and wait for a new one. */
+    if (!unblocked || !has_record_preroll())
+        request_record_keyframe();
+    g_print("start record %s of %s: %s, %u running.\n", file->name, owner, file->path,
+            g_hash_table_size(record_sessions));
+    return file->name;
+}
 
-    gst_object_unref(GST_OBJECT(rec_pipeline));
-    if (pthread_mutex_lock(&mtx)) {
-        g_error("Failed to lock on mutex.\n");
+/* the file is finalized on the streaming threads and freed once its EOS reached the filesink. */
+static void record_file_close(RecordFile *file) {
+    g_hash_table_remove(record_sessions, file->name);
+    for (int i = 0; i < RECORD_STREAMS; i++) {
+        if (file->tee_pads[i])
+            gst_pad_add_probe(file->tee_pads[i], GST_PAD_PROBE_TYPE_IDLE, on_record_file_unlink, file, NULL);
     }
-    threads_running = FALSE;
-    if (pthread_mutex_unlock(&mtx)) {
-        g_error("Failed to lock on mutex.\n");
+
+    if (g_hash_table_size(record_sessions) == 0) {
+        set_record_blocked(TRUE);
+        if (!has_record_preroll())
+            release_encoder_demand();
     }
+}
 
+/* a peer only stops its own sessions, a NULL owner stops any. */
+gboolean record_session_stop(const gchar *name, const gchar *owner) {
+    RecordFile *file;
+
+    if (!record_sessions || !name)
+        return FALSE;
+    file = g_hash_table_lookup(record_sessions, name);
+    if (!file || (owner && g_strcmp0(file->owner, owner)))
+        return FALSE;
+    record_file_close(file);
     return TRUE;
 }
 
-static int start_udpsrc_rec(gpointer user_data) {
-    /**
-     * @brief I want to create a module for recording, but it cannot be dynamically added and deleted while the pipeline is running。
-     * Maybe it's because I'm not familiar with its mechanics.
-     *
-     */
-    GstElement *rec_pipeline;
-    gchar *fullpath;
-    gchar *timestr = NULL;
-    gchar *cmdline = NULL;
-    gchar *today = get_today_str();
-
-    gchar *outdir = g_strconcat(config_data.root_dir, "/record/", today, NULL);
-    g_free(today);
+guint record_session_stop_owner(const gchar *owner) {
+    GHashTableIter iter;
+    RecordFile *file;
+    GList *files = NULL;
+    guint stopped;
+
+    if (!record_sessions)
+        return 0;
+    g_hash_table_iter_init(&iter, record_sessions);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&file)) {
+        if (!g_strcmp0(file->owner, owner))
+            files = g_list_prepend(files, file);
+    }
+    stopped = g_list_length(files);
+    g_list_free_full(files, (GDestroyNotify)record_file_close);
+    return stopped;
+}
 
-    timestr = get_format_current_time();
-    gst_println("starting record at: %s .\n", timestr);
-    g_free(timestr);
+static void clear_record_session_stats(gpointer data) {
+    RecordSessionStats *stats = (RecordSessionStats *)data;
 
-    _mkdir(outdir, 0755);
-    timestr = get_current_time_str();
-    gchar *filename = g_strdup_printf("/motion-%s.mkv", timestr);
-    g_free(timestr);
-    fullpath = g_strconcat(outdir, filename, NULL);
-    g_free(outdir);
+    g_free(stats->name);
+    g_free(stats->owner);
+    g_free(stats->path);
+}
 
-    gchar *upenc = g_ascii_strup(config_data.videnc, strlen(config_data.videnc));
-    gchar *rtp = get_rtp_args();
-    gchar *video_src = g_strdup_printf("udpsrc port=%d multicast-group=%s  multicast-iface=lo ! "
-                                       " application/x-rtp,media=(string)video,clock-rate=(int)90000,encoding-name=(string)%s,payload=(int)96 ! "
-                                       " %s ! queue leaky=1 ! mux. ",
-                                       config_data.webrtc.udpsink.port, config_data.webrtc.udpsink.addr, upenc, rtp);
-    g_free(upenc);
-    g_free(rtp);
-    if (audio_source != NULL) {
-        gchar *audio_src = udpsrc_audio_cmdline("mux");
-        cmdline = g_strdup_printf(" matroskamux name=mux ! filesink  async=false location=\"%s\" %s %s ", fullpath, audio_src, video_src);
-        g_free(audio_src);
-    } else {
-        cmdline = g_strdup_printf(" matroskamux name=mux ! filesink  async=false location=\"%s\"  %s ", fullpath, video_src);
+GArray *get_record_sessions() {
+    GArray *sessions = g_array_new(FALSE, TRUE, sizeof(RecordSessionStats));
+    GHashTableIter iter;
+    RecordFile *file;
+    gint64 leaked;
+
+    g_array_set_clear_func(sessions, clear_record_session_stats);
+    if (!record_sessions)
+        return sessions;
+    leaked = get_record_leaked();
+    g_hash_table_iter_init(&iter, record_sessions);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&file)) {
+        RecordSessionStats stats = {
+            .name = g_strdup(file->name),
+            .owner = g_strdup(file->owner),
+            .path = g_strdup(file->path),
+            .start_time = file->start_time / G_USEC_PER_SEC,
+            .bytes = g_atomic_pointer_get(&file->bytes),
+            // the queues are shared, their drops count in every running session.
+            .dropped = MAX((gint64)g_atomic_pointer_get(&file->dropped) + leaked - file->leaked, 0),
+        };
+        g_array_append_val(sessions, stats);
     }
+    return sessions;
+}
 
-    g_free(fullpath);
-    g_print("record cmdline: %s \n", cmdline);
+static GstElement *udp_video_pay = NULL, *udp_audio_pay = NULL;
 
-    g_free(video_src);
+/* the negotiated caps of a udpsink payloader, NULL until it has sent a packet. */
+static GstCaps *get_udp_pay_caps(GstElement *pay) {
+    GstCaps *caps;
+    GstPad *pad;
+
+    if (!pay)
+        return NULL;
+    pad = gst_element_get_static_pad(pay, "src");
+    caps = gst_pad_get_current_caps(pad);
+    gst_object_unref(pad);
+    return caps;
+}
 
-    rec_pipeline = gst_parse_launch(cmdline, NULL);
+/* caps: of the udpsink payloader, set on the udpsrc by the caller instead of a repay. */
+static gchar *udpsrc_audio_cmdline(const gchar *sink, GstCaps *caps) {
+    gchar *opus;
+    if (caps) {
+        opus = g_strdup("");
+    } else {
+        opus = g_strdup("rtpopusdepay !rtpopuspay !");
+    }
+    // the udpsrc thread pushes to the webrtcbin as it is.
+    gchar *audio_src = g_strdup_printf("udpsrc name=audio_udpsrc port=%d multicast-group=%s  multicast-iface=lo ! "
+                                       " application/x-rtp,media=(string)audio,clock-rate=(int)48000,encoding-name=(string)OPUS,payload=(int)97 ! "
+                                       " %s %s.",
+                                       config_data.webrtc.udpsink.port + 1,
+                                       config_data.webrtc.udpsink.addr, opus, sink);
+    g_free(opus);
+    return audio_src;
+}
 
-    g_free(cmdline);
-    gst_element_set_state(rec_pipeline, GST_STATE_PLAYING);
-#if defined(GLIB_AVAILABLE_IN_2_74)
-    g_timeout_add_once(record_time * 1000, (GSourceOnceFunc)stop_udpsrc_rec, rec_pipeline);
-#else
-    TimeoutFulldata *tdata = g_new(TimeoutFulldata, 1);
-    tdata->user_data = user_data;
-    tdata->timeout_id = g_timeout_add_full(G_PRIORITY_DEFAULT,
-                                           record_time * 1000,
-                                           (GSourceFunc)stop_udpsrc_rec,
-                                           tdata,
-                                           (GDestroyNotify)destroy_timeout);
-#endif
-    return 0;
+static gchar *get_rtp_args() {
+    gchar *rtp = NULL;
+    if (g_strcmp0(config_data.videnc, "vp8")) {
+        rtp = g_strdup_printf("rtp%sdepay ! %sparse", config_data.videnc, config_data.videnc);
+    } else {
+        rtp = g_strdup_printf("rtp%sdepay ", config_data.videnc);
+    }
+    return rtp;
 }
 
 #if 0
@@ -1355,35 +2774,6 @@ on_peer_connection_state_notify(GstElement *webrtcbin, GParamSpec *pspec,
     g_free(new_state);
 }
 
-void appsrc_cmd_rec_stop(gpointer user_data) {
-    RecordItem *item = (RecordItem *)user_data;
-    gst_element_set_state(GST_ELEMENT(item->pipeline),
-                          GST_STATE_NULL);
-    g_print("stop appsrc record.\n");
-
-    gst_object_unref(GST_OBJECT(item->pipeline));
-    if (pthread_mutex_lock(&cmd_mtx)) {
-        g_error("Failed to lock on mutex.\n");
-    }
-    cmd_recording = FALSE;
-    if (pthread_mutex_unlock(&cmd_mtx)) {
-        g_error("Failed to lock on mutex.\n");
-    }
-    g_mutex_lock(&G_appsrc_lock);
-    G_AppsrcList = g_list_remove(G_AppsrcList, &item->rec_avpair);
-    g_mutex_unlock(&G_appsrc_lock);
-    if (item->rec_avpair.audio_src)
-        gst_object_unref(item->rec_avpair.audio_src);
-    gst_object_unref(item->rec_avpair.video_src);
-    item->pipeline = NULL;
-}
-
-static void on_enough_data(GstElement *appsrc, gpointer user_data) {
-    gchar *name = gst_element_get_name(appsrc);
-    g_print("appsrc %s have enough data\n", name);
-    g_free(name);
-}
-
 #if 0
 static void need_data(GstElement *appsrc, gpointer user_data) {
     gchar *name = gst_element_get_name(appsrc);
@@ -1392,203 +2782,140 @@ static void need_data(GstElement *appsrc, gpointer user_data) {
 }
 #endif
 
-static void appsrc_cmd_rec_start(gpointer user_data) {
-    /**
-     * @brief I want to create a module for recording, but it cannot be dynamically added and deleted while the pipeline is running。
-     * Maybe it's because I'm not familiar with its mechanics.
-     *
-     */
-    RecordItem *item = (RecordItem *)user_data;
-    gchar *fullpath;
-    gchar *cmdline;
-    gchar *timestr = NULL;
-    gchar *today = NULL;
-
-    if (pthread_mutex_lock(&cmd_mtx)) {
-        g_error("Failed to lock on mutex.\n");
-    }
-    cmd_recording = TRUE;
-    if (pthread_mutex_unlock(&cmd_mtx)) {
-        g_error("Failed to lock on mutex.\n");
-    }
-
-    today = get_today_str();
-    const gchar *vid_str = "video_appsrc_cmd_rec";
-    const gchar *aid_str = "audio_appsrc_cmd_rec";
-
-    gchar *outdir = g_strconcat(config_data.root_dir, "/record/", today, NULL);
-    g_free(today);
-
-    timestr = get_format_current_time();
-    gst_println("start record at: %s .\n", timestr);
-    g_free(timestr);
-
-    _mkdir(outdir, 0755);
-    timestr = get_current_time_str();
-
-    /** here just work for mpegtsmux */
-    gchar *filename = g_strdup_printf("/webrtc-%s.mkv", timestr);
-    g_free(timestr);
-    fullpath = g_strconcat(outdir, filename, NULL);
-    g_free(outdir);
-    gchar *upenc = g_ascii_strup(config_data.videnc, strlen(config_data.videnc));
-    gchar *rtp = get_rtp_args();
-    gchar *video_src = g_strdup_printf("appsrc  name=%s format=3 leaky-type=1  ! "
-                                       " application/x-rtp,media=(string)video,clock-rate=(int)90000,encoding-name=(string)%s,payload=(int)96 ! "
-                                       " %s !  queue leaky=1 ! mux. ",
-                                       vid_str, upenc, rtp);
-    g_free(upenc);
-    g_free(rtp);
-    if (config_data.audio.enable) {
-        gchar *audio_src = g_strdup_printf("appsrc name=%s  format=3  leaky-type=1  ! "
-                                           " application/x-rtp,media=(string)audio,clock-rate=(int)48000,encoding-name=(string)OPUS,payload=(int)97 ! "
-                                           " rtpopusdepay  ! opusparse ! queue leaky=1 ! mux.",
-                                           aid_str);
-        cmdline = g_strdup_printf(" matroskamux name=mux ! filesink  async=false location=\"%s\" %s %s ", fullpath, audio_src, video_src);
-        g_free(audio_src);
-    } else {
-        cmdline = g_strdup_printf(" matroskamux name=mux ! filesink  async=false location=\"%s\" %s ", fullpath, video_src);
-    }
-
-    g_free(fullpath);
-    g_free(filename);
-    g_print("webrtc cmdline: %s \n", cmdline);
-
-    g_free(video_src);
-
-    item->pipeline = gst_parse_launch(cmdline, NULL);
-    g_free(cmdline);
-
-    gst_element_set_state(item->pipeline, GST_STATE_PLAYING);
-    item->rec_avpair.video_src = gst_bin_get_by_name(GST_BIN(item->pipeline), vid_str);
-    // g_signal_connect(appsrc_vid, "need-data", (GCallback)need_data, video_sink);
-    g_signal_connect(item->rec_avpair.video_src, "enough-data", (GCallback)on_enough_data, NULL);
-    item->rec_avpair.audio_src = config_data.audio.enable ? gst_bin_get_by_name(GST_BIN(item->pipeline), aid_str) : NULL;
-
-    // g_signal_connect(appsrc_aid, "need-data", (GCallback)need_data, audio_sink);
-    g_mutex_lock(&G_appsrc_lock);
-    G_AppsrcList = g_list_append(G_AppsrcList, &item->rec_avpair);
-    g_mutex_unlock(&G_appsrc_lock);
+/**
+ * @brief The motion record, driven by the events of the motion detector on the main loop:
+ *
+ * IDLE -start-> DEBOUNCE -debounce_ms, still moving-> RECORDING -stop-> POSTROLL -postroll_s-> IDLE
+ *
+ * The detector only posts the stop hold_ms after the last moving frame, so the debounce looks
+ * at its updates instead: the clip opens only if one came within the last frame interval, a
+ * flicker shorter than debounce_ms goes back to IDLE. A start in POSTROLL goes back to RECORDING
+ * and extends the clip. The quiet tail of a clip is thus hold_ms + postroll_s. A clip reaching rec_len is closed, and the next one opens at once if the
+ * motion still goes on.
+ */
+typedef enum {
+    MOTION_REC_IDLE,
+    MOTION_REC_DEBOUNCE,
+    MOTION_REC_RECORDING,
+    MOTION_REC_POSTROLL,
+} MotionRecState;
+
+static struct {
+    MotionRecState state;
+    gboolean moving; // between the start and the stop of the detector.
+    gint64 last_motion; // monotonic time of the last start or update.
+    guint timer;     // the debounce or the post-roll.
+    guint max_timer; // the longest clip.
+    gchar *clip;     // the name of its record session.
+} motion_rec = {MOTION_REC_IDLE};
+
+static void set_motion_rec_timer(guint *timer, guint ms, GSourceFunc func) {
+    if (*timer)
+        g_source_remove(*timer);
+    *timer = ms ? g_timeout_add(ms, func, NULL) : 0;
 }
 
-static gboolean stop_appsrc_rec(gpointer user_data) {
-    gchar *timestr;
-
-#if defined(GLIB_AVAILABLE_IN_2_74)
-    RecordItem *item = (RecordItem *)user_data;
-#else
-    TimeoutFulldata *tdata = (TimeoutFulldata *)user_data;
-    RecordItem *item = (RecordItem *)tdata->user_data;
-    if (tdata->timeout_id) {
-        g_source_remove(tdata->timeout_id);
-        tdata->timeout_id = 0;
-    }
-#endif
-    gst_element_send_event(item->pipeline, gst_event_new_eos());
-    gst_element_set_state(item->pipeline, GST_STATE_NULL);
-    timestr = get_format_current_time();
-    gst_println("stop appsrc record at: %s .\n", timestr);
-    g_free(timestr);
-
-    // gst_println("after stop record pipeline state: %s !!!!\n", gst_element_state_get_name(state));
-    if (pthread_mutex_lock(&mtx)) {
-        g_error("Failed to lock on mutex.\n");
-    }
-    threads_running = FALSE;
-    if (pthread_mutex_unlock(&mtx)) {
-        g_error("Failed to lock on mutex.\n");
-    }
-
-    g_mutex_lock(&G_appsrc_lock);
-    G_AppsrcList = g_list_remove(G_AppsrcList, &item->rec_avpair);
-    g_mutex_unlock(&G_appsrc_lock);
-    if (item->rec_avpair.audio_src)
-        gst_object_unref(item->rec_avpair.audio_src);
-    gst_object_unref(item->rec_avpair.video_src);
+static gboolean on_motion_rec_max(gpointer user_data);
 
-    gst_object_unref(item->pipeline);
-    g_free(item);
-    return TRUE;
+static void open_motion_clip() {
+    motion_rec.clip = g_strdup(record_session_start(NULL, RECORD_OWNER_MOTION));
+    motion_rec.state = MOTION_REC_RECORDING;
+    set_motion_rec_timer(&motion_rec.max_timer, record_time * 1000, on_motion_rec_max);
 }
 
-static void
-start_appsrc_record() {
-    RecordItem *item;
-    gchar *fullpath;
-    gchar *cmdline;
-    gchar *timestr = NULL;
-    gchar *today = NULL;
-    today = get_today_str();
-    const gchar *vid_str = "video_appsrc";
-    const gchar *aid_str = "audio_appsrc";
-    item = g_new0(RecordItem, 1);
-    gchar *outdir = g_strconcat(config_data.root_dir, "/record/", today, NULL);
-    g_free(today);
+static void close_motion_clip() {
+    set_motion_rec_timer(&motion_rec.timer, 0, NULL);
+    set_motion_rec_timer(&motion_rec.max_timer, 0, NULL);
+    record_session_stop(motion_rec.clip, RECORD_OWNER_MOTION);
+    g_clear_pointer(&motion_rec.clip, g_free);
+    motion_rec.state = MOTION_REC_IDLE;
+}
 
-    timestr = get_format_current_time();
-    gst_println("start appsrc record at: %s .\n", timestr);
-    g_free(timestr);
+static gboolean on_motion_rec_max(gpointer user_data) {
+    motion_rec.max_timer = 0;
+    close_motion_clip();
+    if (motion_rec.moving)
+        open_motion_clip();
+    return G_SOURCE_REMOVE;
+}
 
-    _mkdir(outdir, 0755);
-    timestr = get_current_time_str();
+static gboolean is_still_moving() {
+    // one frame interval of the detectors, and one more for the bus dispatch.
+    gint64 interval = 2 * G_USEC_PER_SEC / MAX(config_data.analytics.framerate, 1);
+    return g_get_monotonic_time() - motion_rec.last_motion <= interval;
+}
 
-    /** here just work for mpegtsmux */
-    gchar *filename = g_strdup_printf("/motion-%s.mkv", timestr);
-    g_free(timestr);
-    fullpath = g_strconcat(outdir, filename, NULL);
-    g_free(outdir);
+static gboolean on_motion_rec_timer(gpointer user_data) {
+    motion_rec.timer = 0;
+    if (motion_rec.state == MOTION_REC_DEBOUNCE) {
+        if (is_still_moving())
+            open_motion_clip();
+        else
+            motion_rec.state = MOTION_REC_IDLE;
+    } else if (motion_rec.state == MOTION_REC_POSTROLL)
+        close_motion_clip();
+    return G_SOURCE_REMOVE;
+}
 
-    gchar *upenc = g_ascii_strup(config_data.videnc, strlen(config_data.videnc));
-    gchar *rtp = get_rtp_args();
-    gchar *video_src = g_strdup_printf("appsrc  name=%s format=3 leaky-type=1  ! "
-                                       " application/x-rtp,media=(string)video,clock-rate=(int)90000,encoding-name=(string)%s,payload=(int)96 ! "
-                                       " %s ! queue leaky=1 ! mux. ",
-                                       vid_str, upenc, rtp);
-    g_free(upenc);
-    g_free(rtp);
-    if (config_data.audio.enable) {
-        gchar *audio_src = g_strdup_printf("appsrc name=%s  format=3 leaky-type=1 ! "
-                                           " application/x-rtp,media=(string)audio,clock-rate=(int)48000,encoding-name=(string)OPUS,payload=(int)97 ! "
-                                           " rtpopusdepay  ! opusparse ! queue leaky=1 ! mux.",
-                                           aid_str);
-        cmdline = g_strdup_printf(" matroskamux name=mux ! filesink  async=false location=\"%s\" %s %s ", fullpath, audio_src, video_src);
-        g_free(audio_src);
-    } else {
-        cmdline = g_strdup_printf(" matroskamux name=mux ! filesink  async=false location=\"%s\" %s ", fullpath, video_src);
+static void on_motion_event(gboolean moving) {
+    motion_rec.moving = moving;
+    switch (motion_rec.state) {
+    case MOTION_REC_IDLE:
+        if (!moving)
+            break;
+        if (config_data.motion.debounce_ms > 0) {
+            motion_rec.state = MOTION_REC_DEBOUNCE;
+            set_motion_rec_timer(&motion_rec.timer, config_data.motion.debounce_ms, on_motion_rec_timer);
+        } else {
+            open_motion_clip();
+        }
+        break;
+    case MOTION_REC_DEBOUNCE:
+        if (!moving) {
+            set_motion_rec_timer(&motion_rec.timer, 0, NULL);
+            motion_rec.state = MOTION_REC_IDLE;
+        }
+        break;
+    case MOTION_REC_RECORDING:
+        if (moving)
+            break;
+        if (config_data.motion.postroll_s > 0) {
+            motion_rec.state = MOTION_REC_POSTROLL;
+            set_motion_rec_timer(&motion_rec.timer, config_data.motion.postroll_s * 1000, on_motion_rec_timer);
+        } else {
+            close_motion_clip();
+        }
+        break;
+    case MOTION_REC_POSTROLL:
+        if (moving) {
+            set_motion_rec_timer(&motion_rec.timer, 0, NULL);
+            motion_rec.state = MOTION_REC_RECORDING;
+        }
+        break;
     }
+}
 
-    g_free(fullpath);
-    g_free(filename);
-    g_print("webrtc cmdline: %s \n", cmdline);
-    g_free(video_src);
-
-    item->pipeline = gst_parse_launch(cmdline, NULL);
-    g_free(cmdline);
-
-    item->rec_avpair.video_src = gst_bin_get_by_name(GST_BIN(item->pipeline), vid_str);
-    // g_signal_connect(appsrc_vid, "need-data", (GCallback)need_data, video_sink);
-    g_signal_connect(item->rec_avpair.video_src, "enough-data", (GCallback)on_enough_data, NULL);
-
-    item->rec_avpair.audio_src = config_data.audio.enable ? gst_bin_get_by_name(GST_BIN(item->pipeline), aid_str) : NULL;
-    // g_signal_connect(appsrc_aid, "need-data", (GCallback)need_data, audio_sink);
-    g_signal_connect(item->rec_avpair.audio_src, "enough-data", (GCallback)on_enough_data, NULL);
-
-    gst_element_set_state(item->pipeline, GST_STATE_PLAYING);
-
-#if defined(GLIB_AVAILABLE_IN_2_74)
-    g_timeout_add_once(record_time * 1000, (GSourceOnceFunc)stop_appsrc_rec, item);
-#else
-    TimeoutFulldata *tdata = g_new(TimeoutFulldata, 1);
-    tdata->user_data = item;
-    tdata->timeout_id = g_timeout_add_full(G_PRIORITY_DEFAULT,
-                                           record_time * 1000,
-                                           (GSourceFunc)stop_appsrc_rec,
-                                           tdata,
-                                           (GDestroyNotify)destroy_timeout);
-#endif
-    g_mutex_lock(&G_appsrc_lock);
-    G_AppsrcList = g_list_append(G_AppsrcList, &item->rec_avpair);
-    g_mutex_unlock(&G_appsrc_lock);
+/**
+ * @brief The bus of the main pipeline, dispatched on the main loop. The motion detector
+ * drives the record here, see motion_attach().
+ */
+static gboolean on_pipeline_message(GstBus *bus, GstMessage *message, gpointer user_data) {
+    const GstStructure *s;
+    const gchar *event;
+
+    if (GST_MESSAGE_TYPE(message) != GST_MESSAGE_ELEMENT || !config_data.motion_rec)
+        return TRUE;
+    s = gst_message_get_structure(message);
+    if (!s || !gst_structure_has_name(s, MOTION_MESSAGE))
+        return TRUE;
+    event = gst_structure_get_string(s, "event");
+    if (!g_strcmp0(event, "start") || !g_strcmp0(event, "update"))
+        motion_rec.last_motion = g_get_monotonic_time();
+    if (!g_strcmp0(event, "start"))
+        on_motion_event(TRUE);
+    else if (!g_strcmp0(event, "stop"))
+        on_motion_event(FALSE);
+    return TRUE;
 }
 
 static gboolean
@@ -1938,6 +3265,16 @@ data_channel_on_message_string(GObject *dc, gchar *str, gpointer user_data) {
             gint64 value = json_object_get_int_member(ctrl_object, "value");
             set_ctrl_value(config_data.v4l2src_data.device, id, value);
         }
+    } else if (!g_strcmp0(type_string, "layer")) {
+        // {"type":"layer","layer":-1} goes back to the layer selected by the bitrate estimate.
+        gint64 layer = json_object_get_int_member_with_default(root_json_object, "layer", -1);
+        item_entry->send_avpair.auto_layer = layer < 0;
+        if (layer >= 0)
+            g_atomic_int_set(&item_entry->send_avpair.pending_layer, MIN(layer, video_layer_count - 1));
+        // {"type":"layer","layer":0,"base":true} forwards the temporal base layer only.
+        if (!item_entry->send_avpair.auto_layer)
+            g_atomic_int_set(&item_entry->send_avpair.pending_base_layer,
+                             json_object_get_boolean_member_with_default(root_json_object, "base", FALSE));
     }
 cleanup:
     g_free(tmp_str);
@@ -2026,6 +3363,8 @@ static void start_recv_webrtcbin(gpointer user_data) {
 
     // turn_srv = g_strdup_printf("turn://%s:%s@%s", config_data.webrtc.turn.user, config_data.webrtc.turn.pwd, config_data.webrtc.turn.url);
     item->recv.recvpipe = gst_pipeline_new(pipe_name);
+    dtls_cert_attach(item->recv.recvpipe);
+    watch_pipeline_bus(item->recv.recvpipe, THREADS_RECV);
     // item->recv.recvbin = gst_element_factory_make("webrtcbin",bin_name);
     // g_object_set(item->recv.recvbin, "turn-server", config_data.webrtc.turn, NULL);
 
@@ -2073,6 +3412,10 @@ static void start_recv_webrtcbin(gpointer user_data) {
 static void stop_appsrc_webrtc(gpointer user_data) {
     WebrtcItem *webrtc_entry = (WebrtcItem *)user_data;
 
+    release_peer_threads(webrtc_entry);
+    abr_remove_peer(webrtc_entry);
+    release_encoder_demand();
+
     gst_element_set_state(GST_ELEMENT(webrtc_entry->sendpipe),
                           GST_STATE_NULL);
 
@@ -2082,9 +3425,7 @@ static void stop_appsrc_webrtc(gpointer user_data) {
     if (webrtc_entry->send_channel)
         g_object_unref(webrtc_entry->send_channel);
 
-    g_mutex_lock(&G_appsrc_lock);
-    G_AppsrcList = g_list_remove(G_AppsrcList, &webrtc_entry->send_avpair);
-    g_mutex_unlock(&G_appsrc_lock);
+    remove_appsrc_subscriber(&webrtc_entry->send_avpair);
     gst_object_unref(webrtc_entry->send_avpair.video_src);
     gst_object_unref(webrtc_entry->send_avpair.audio_src);
 }
@@ -2092,6 +3433,10 @@ static void stop_appsrc_webrtc(gpointer user_data) {
 static void stop_udpsrc_webrtc(gpointer user_data) {
     WebrtcItem *webrtc_entry = (WebrtcItem *)user_data;
 
+    release_peer_threads(webrtc_entry);
+    abr_remove_peer(webrtc_entry);
+    release_encoder_demand();
+
     gst_element_set_state(GST_ELEMENT(webrtc_entry->sendpipe),
                           GST_STATE_NULL);
 
@@ -2109,9 +3454,17 @@ void start_udpsrc_webrtcbin(WebrtcItem *item) {
     gchar *webrtc_name = g_strdup_printf("send_%" G_GUINT64_FORMAT, item->hash_id);
 
     gchar *upenc = g_ascii_strup(config_data.videnc, strlen(config_data.videnc));
+    GstCaps *vcaps = get_udp_pay_caps(udp_video_pay);
+    GstCaps *acaps = get_udp_pay_caps(udp_audio_pay);
     // here must have rtph264depay and rtph264pay to be compatible with  mobile browser.
+    // unless the udpsrc gets the caps of the shared payloader, config-interval=-1 and aggregate-mode=1 are set there.
 
-    if (g_str_has_prefix(config_data.videnc, "h26")) {
+    if (vcaps) {
+        video_src = g_strdup_printf("udpsrc name=video_udpsrc port=%d multicast-group=%s multicast-iface=lo  socket-timestamp=1  ! "
+                                    " application/x-rtp,media=(string)video,clock-rate=(int)90000,encoding-name=(string)%s,payload=(int)96 ! "
+                                    " %s. ",
+                                    config_data.webrtc.udpsink.port, config_data.webrtc.udpsink.addr, upenc, webrtc_name);
+    } else if (g_str_has_prefix(config_data.videnc, "h26")) {
         gchar *rtp = get_rtp_args();
         video_src = g_strdup_printf("udpsrc port=%d multicast-group=%s multicast-iface=lo  socket-timestamp=1  ! "
                                     " application/x-rtp,media=(string)video,clock-rate=(int)90000,encoding-name=(string)%s,payload=(int)96 ! "
@@ -2127,7 +3480,7 @@ void start_udpsrc_webrtcbin(WebrtcItem *item) {
 
     g_free(upenc);
     if (audio_source != NULL) {
-        gchar *audio_src = udpsrc_audio_cmdline(webrtc_name);
+        gchar *audio_src = udpsrc_audio_cmdline(webrtc_name, acaps);
         cmdline = g_strdup_printf("webrtcbin name=%s stun-server=stun://%s %s %s ", webrtc_name, config_data.webrtc.stun, audio_src, video_src);
         // g_print("webrtc cmdline: %s \n", cmdline);
         g_free(audio_src);
@@ -2141,22 +3494,40 @@ void start_udpsrc_webrtcbin(WebrtcItem *item) {
     }
     // g_print("webrtc cmdline: %s \n", cmdline);
     item->sendpipe = gst_parse_launch(cmdline, NULL);
+    dtls_cert_attach(item->sendpipe);
+    watch_pipeline_bus(item->sendpipe, THREADS_SEND);
+    if (vcaps) {
+        GstElement *udpsrc = gst_bin_get_by_name(GST_BIN(item->sendpipe), "video_udpsrc");
+        g_object_set(udpsrc, "caps", vcaps, NULL);
+        gst_object_unref(udpsrc);
+        gst_caps_unref(vcaps);
+    }
+    if (acaps) {
+        GstElement *udpsrc = gst_bin_get_by_name(GST_BIN(item->sendpipe), "audio_udpsrc");
+        if (udpsrc) {
+            g_object_set(udpsrc, "caps", acaps, NULL);
+            gst_object_unref(udpsrc);
+        }
+        gst_caps_unref(acaps);
+    }
     gst_element_set_state(item->sendpipe, GST_STATE_READY);
 
     g_free(cmdline);
 
     item->sendbin = gst_bin_get_by_name(GST_BIN(item->sendpipe), webrtc_name);
+    g_object_set(G_OBJECT(item->sendbin), "bundle-policy", 3, NULL);
     if (config_data.webrtc.turn.enable) {
         webrtcbin_add_turn(item->sendbin);
     }
     g_free(webrtc_name);
-    item->record.get_rec_state = &get_record_state;
-    item->record.start = &udpsrc_cmd_rec_start;
-    item->record.stop = &udpsrc_cmd_rec_stop;
     item->recv.addremote = &start_recv_webrtcbin;
     item->stop_webrtc = &stop_udpsrc_webrtc;
 
+    g_signal_connect(item->sendbin, "notify::connection-state",
+                     G_CALLBACK(on_send_connection_state), item);
     create_data_channel((gpointer)item);
+    abr_add_peer(item);
+    acquire_encoder_demand();
 #if 0
     gst_debug_bin_to_dot_file_with_ts(GST_BIN(item->sendpipe), GST_DEBUG_GRAPH_SHOW_ALL, "udpsrc_webrtc");
 #endif
@@ -2173,6 +3544,7 @@ int start_av_udpsink() {
     g_free(tmpname);
 
     MAKE_ELEMENT_AND_ADD(video_sink, "udpsink");
+    udp_video_pay = video_pay;
 
     /* Configure udpsink */
     g_object_set(video_sink, "sync", FALSE, "async", FALSE,
@@ -2209,6 +3581,7 @@ int start_av_udpsink() {
         MAKE_ELEMENT_AND_ADD(audio_sink, "udpsink");
         MAKE_ELEMENT_AND_ADD(audio_pay, "rtpopuspay");
         MAKE_ELEMENT_AND_ADD(aqueue, "queue");
+        udp_audio_pay = audio_pay;
         g_object_set(audio_sink, "sync", FALSE, "async", FALSE,
                      "port", config_data.webrtc.udpsink.port + 1,
                      "host", config_data.webrtc.udpsink.addr,
@@ -2228,56 +3601,303 @@ int start_av_udpsink() {
     return 0;
 }
 
+static GstBuffer *rewrite_rtp_header(GstBuffer *buffer, guint header_len, guint32 ssrc, guint16 seq) {
+    GstBuffer *out = gst_buffer_new();
+    GstMemory *header = gst_allocator_alloc(NULL, header_len, NULL);
+    GstMapInfo map;
+
+    gst_memory_map(header, &map, GST_MAP_WRITE);
+    gst_buffer_extract(buffer, 0, map.data, header_len);
+    GST_WRITE_UINT16_BE(map.data + 2, seq);
+    GST_WRITE_UINT32_BE(map.data + 8, ssrc);
+    gst_memory_unmap(header, &map);
+    gst_buffer_append_memory(out, header);
+    // the payload memory is shared, gst_rtp_buffer_map() expects the header in the first memory only.
+    gst_buffer_copy_into(out, buffer, GST_BUFFER_COPY_FLAGS | GST_BUFFER_COPY_MEMORY, header_len, -1);
+    GST_BUFFER_PTS(out) = GST_BUFFER_PTS(buffer);
+    GST_BUFFER_DTS(out) = GST_BUFFER_DTS(buffer);
+    GST_BUFFER_DURATION(out) = GST_BUFFER_DURATION(buffer);
+    return out;
+}
+
 #define FSINK_VNAME "fsink_video"
 #define FSINK_ANAME "fsink_audio"
 
+/**
+ * @brief Single pipeline mode, the peers are webrtcbins of the main pipeline fed by the tees of shared
+ * payloaders, with no pipeline, clock and thread set of their own, only their queues.
+ */
+int start_av_fsink() {
+    if (!_check_initial_status())
+        return -1;
+    GstElement *aqueue, *vqueue, *video_tee, *audio_tee, *video_pay, *audio_pay;
+
+    MAKE_ELEMENT_AND_ADD(vqueue, "queue");
+    gchar *tmpname = g_strdup_printf("rtp%spay", config_data.videnc);
+    MAKE_ELEMENT_AND_ADD(video_pay, tmpname);
+    g_free(tmpname);
+
+    video_tee = gst_element_factory_make("tee", FSINK_VNAME);
+    gst_bin_add(GST_BIN(pipeline), video_tee);
+    // no peer yet, or one that is leaving.
+    g_object_set(video_tee, "allow-not-linked", TRUE, NULL);
+
+    if (g_str_has_prefix(config_data.videnc, "h26")) {
+        g_object_set(video_pay, "config-interval", -1, "aggregate-mode", 1, NULL);
+    }
+
+    if (g_strcmp0(config_data.videnc, "vp8")) {
+        // vp8parse not avavilable ?
+        GstElement *videoparse;
+        tmpname = g_strdup_printf("%sparse", config_data.videnc);
+        MAKE_ELEMENT_AND_ADD(videoparse, tmpname);
+        g_free(tmpname);
+        if (!gst_element_link_many(vqueue, videoparse, video_pay, video_tee, NULL)) {
+            g_error("Failed to link elements video to fsink.\n");
+            return -1;
+        }
+    } else {
+        if (!gst_element_link_many(vqueue, video_pay, video_tee, NULL)) {
+            g_error("Failed to link elements video to fsink.\n");
+            return -1;
+        }
+    }
+
+    link_request_src_pad(video_encoder, vqueue);
+
+    if (audio_source != NULL) {
+        MAKE_ELEMENT_AND_ADD(audio_pay, "rtpopuspay");
+        MAKE_ELEMENT_AND_ADD(aqueue, "queue");
+        audio_tee = gst_element_factory_make("tee", FSINK_ANAME);
+        gst_bin_add(GST_BIN(pipeline), audio_tee);
+        g_object_set(audio_tee, "allow-not-linked", TRUE, NULL);
+        g_object_set(audio_pay, "pt", 97, NULL);
+        if (!gst_element_link_many(aqueue, audio_pay, audio_tee, NULL)) {
+            g_error("Failed to link elements audio to fsink.\n");
+            return -1;
+        }
+        link_request_src_pad(audio_source, aqueue);
+    }
+    return 0;
+}
+
+/**
+ * @brief The branch of a peer in the single pipeline, video and audio. It outlives its WebrtcItem,
+ * the detach is finished from the main loop once both tee pads are unlinked.
+ */
+typedef struct {
+    GstElement *tees[2];
+    GstPad *tee_pads[2];
+    GstElement *queues[2];
+    GstElement *webrtcbin;
+    gint unlinking;
+    ClientQueue client_queue;
+    gboolean in_keyframe; // the last video packet was a keyframe one.
+    gboolean rtp_started;
+    guint16 rtp_seq_delta;
+} SendBranch;
+
+/**
+ * @brief The keyframe-aware drop of the single pipeline, from the level of the queue itself. The tee
+ * carries the RTP of the shared payloader, the sequence is shifted over the dropped packets.
+ */
+static GstPadProbeReturn on_client_queue_in(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    SendBranch *branch = (SendBranch *)user_data;
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+    gboolean delta = GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+    gboolean keyframe_start = !delta && !branch->in_keyframe;
+    GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+    guint64 level = 0;
+    gboolean request;
+
+    branch->in_keyframe = !delta;
+    g_object_get(branch->queues[0], "current-level-time", &level, NULL);
+    if (client_queue_drop(&branch->client_queue, (gint)(level / GST_MSECOND), keyframe_start, &request)) {
+        if (request)
+            gst_pad_push_event(pad, gst_video_event_new_upstream_force_key_unit(GST_CLOCK_TIME_NONE, TRUE, 0));
+        if (branch->rtp_started)
+            branch->rtp_seq_delta--;
+        return GST_PAD_PROBE_DROP;
+    }
+    branch->rtp_started = TRUE;
+    if (branch->rtp_seq_delta && gst_rtp_buffer_map(buffer, GST_MAP_READ, &rtp)) {
+        guint32 ssrc = gst_rtp_buffer_get_ssrc(&rtp);
+        guint16 seq = gst_rtp_buffer_get_seq(&rtp) + branch->rtp_seq_delta;
+        guint header_len = gst_rtp_buffer_get_header_len(&rtp);
+        gst_rtp_buffer_unmap(&rtp);
+        GST_PAD_PROBE_INFO_DATA(info) = rewrite_rtp_header(buffer, header_len, ssrc, seq);
+        gst_buffer_unref(buffer);
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+static gboolean finish_detach(gpointer user_data) {
+    SendBranch *branch = (SendBranch *)user_data;
+
+    for (int i = 0; i < 2; i++) {
+        if (!branch->tee_pads[i])
+            continue;
+        gst_element_release_request_pad(branch->tees[i], branch->tee_pads[i]);
+        gst_object_unref(branch->tee_pads[i]);
+        gst_object_unref(branch->tees[i]);
+    }
+    // the queue threads stop before the webrtcbin they push into.
+    for (int i = 0; i < 2; i++) {
+        if (!branch->queues[i])
+            continue;
+        gst_element_set_state(branch->queues[i], GST_STATE_NULL);
+        gst_bin_remove(GST_BIN(pipeline), branch->queues[i]);
+        gst_object_unref(branch->queues[i]);
+    }
+    gst_element_set_state(branch->webrtcbin, GST_STATE_NULL);
+    gst_bin_remove(GST_BIN(pipeline), branch->webrtcbin);
+    gst_object_unref(branch->webrtcbin);
+    g_free(branch);
+    return G_SOURCE_REMOVE;
+}
+
+/**
+ * @brief Runs once the tee pad is not pushing, in its streaming thread or at once. Only the unlink is done
+ * here, the request pad release and the state changes would wait on that same thread.
+ */
+static GstPadProbeReturn on_branch_idle(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    SendBranch *branch = (SendBranch *)user_data;
+    GstPad *sinkpad = gst_pad_get_peer(pad);
+
+    if (sinkpad) {
+        gst_pad_unlink(pad, sinkpad);
+        gst_object_unref(sinkpad);
+    }
+    if (g_atomic_int_dec_and_test(&branch->unlinking))
+        g_idle_add(finish_detach, branch);
+    return GST_PAD_PROBE_REMOVE;
+}
+
 static void stop_webrtc(gpointer user_data) {
     WebrtcItem *item = (WebrtcItem *)user_data;
-    gst_element_set_state(item->sendbin, GST_STATE_NULL);
-    gst_bin_remove(GST_BIN(pipeline), item->sendbin);
-    gst_object_unref(item->sendbin);
+    SendBranch *branch = (SendBranch *)item->send_branch;
+
+    g_atomic_int_add(&single_peers, -1);
+    abr_remove_peer(item);
+    release_encoder_demand();
+
+    // the webrtcbin is only gone once the branch is detached, the item is freed before.
+    g_signal_handlers_disconnect_by_data(item->sendbin, item);
+    if (item->receive_channel)
+        g_signal_handlers_disconnect_by_data(item->receive_channel, item);
+    if (item->send_channel)
+        g_object_unref(item->send_channel);
+    item->send_branch = NULL;
+
+    g_atomic_int_set(&branch->unlinking, branch->tee_pads[1] ? 2 : 1);
+    for (int i = 0; i < 2; i++) {
+        if (branch->tee_pads[i])
+            gst_pad_add_probe(branch->tee_pads[i], GST_PAD_PROBE_TYPE_IDLE, on_branch_idle, branch, NULL);
+    }
 }
 
 void start_webrtcbin(WebrtcItem *item) {
+    SendBranch *branch = g_new0(SendBranch, 1);
     // gchar *turn_srv = NULL;
     gchar *stun;
     gchar *webrtc_name = g_strdup_printf("send_%" G_GUINT64_FORMAT, item->hash_id);
     // g_print("webrtc_name: %s\n", webrtc_name);
     item->sendbin = gst_element_factory_make("webrtcbin", webrtc_name);
+    g_free(webrtc_name);
+    g_assert(item->sendbin != NULL);
     stun = g_strdup_printf("stun://%s", config_data.webrtc.stun);
-    g_object_set(item->sendbin, "stun-server", stun, NULL);
+    g_object_set(item->sendbin, "stun-server", stun, "bundle-policy", 3, NULL);
     g_free(stun);
     if (config_data.webrtc.turn.enable) {
         webrtcbin_add_turn(item->sendbin);
     }
-    g_free(webrtc_name);
-    g_assert(item->sendbin != NULL);
+    dtls_cert_attach(item->sendbin);
     gst_bin_add(GST_BIN(pipeline), item->sendbin);
+    branch->webrtcbin = gst_object_ref(item->sendbin);
+    item->send_branch = branch;
+
+    // each peer has its own queue, a slow one never back-pressures the tee.
+    for (int i = 0; i < 2; i++) {
+        branch->tees[i] = gst_bin_get_by_name(GST_BIN(pipeline), i ? FSINK_ANAME : FSINK_VNAME);
+        if (!branch->tees[i])
+            continue;
+        branch->queues[i] = make_client_queue();
+        gst_bin_add(GST_BIN(pipeline), branch->queues[i]);
+        gst_object_ref(branch->queues[i]);
+        link_request_src_pad(branch->queues[i], item->sendbin);
+    }
+    g_assert(branch->tees[0] != NULL);
+    branch->client_queue.max_ms = MAX(config_data.webrtc.client_queue.max_ms, 0);
+    if (branch->client_queue.max_ms) {
+        GstPad *pad = gst_element_get_static_pad(branch->queues[0], "sink");
+        gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, on_client_queue_in, branch, NULL);
+        gst_object_unref(pad);
+    }
 
-    GstElement *vtee = gst_bin_get_by_name(GST_BIN(pipeline), FSINK_VNAME);
-    g_assert(vtee != NULL);
-    link_request_src_pad(vtee, item->sendbin);
-
-    if (audio_source != NULL) {
-        GstElement *atee = gst_bin_get_by_name(GST_BIN(pipeline), FSINK_ANAME);
-        link_request_src_pad(atee, item->sendbin);
-        // gst_object_unref(atee);
+    // a parked pipeline is resumed before the branch follows its state.
+    acquire_encoder_demand();
+    gst_element_sync_state_with_parent(item->sendbin);
+    for (int i = 0; i < 2; i++) {
+        if (branch->queues[i])
+            gst_element_sync_state_with_parent(branch->queues[i]);
     }
 
-    gst_element_set_state(item->sendbin, GST_STATE_PLAYING);
+    /* linked from the peer up to the tee, the tee pad is linked last, once everything below it is running,
+     * so the tee never pushes into a flushing pad and no blocking is needed on attach. */
+    for (int i = 0; i < 2; i++) {
+        GstPad *sinkpad;
+        if (!branch->tees[i])
+            continue;
+#if GST_VERSION_MINOR >= 20
+        branch->tee_pads[i] = gst_element_request_pad_simple(branch->tees[i], "src_%u");
+#else
+        branch->tee_pads[i] = gst_element_get_request_pad(branch->tees[i], "src_%u");
+#endif
+        sinkpad = gst_element_get_static_pad(branch->queues[i], "sink");
+        if (gst_pad_link(branch->tee_pads[i], sinkpad) != GST_PAD_LINK_OK)
+            g_printerr("unable to link the %s of the single pipeline.\n", GST_OBJECT_NAME(branch->tees[i]));
+        gst_object_unref(sinkpad);
+    }
 
-    item->record.get_rec_state = &get_record_state;
-    item->record.start = &udpsrc_cmd_rec_start;
-    item->record.stop = &udpsrc_cmd_rec_stop;
     item->recv.addremote = &start_recv_webrtcbin;
     item->stop_webrtc = &stop_webrtc;
+    g_atomic_int_inc(&single_peers);
 
+    g_signal_connect(item->sendbin, "notify::connection-state",
+                     G_CALLBACK(on_send_connection_state), item);
     create_data_channel((gpointer)item);
+    abr_add_peer(item);
 #if 0
-    gst_debug_bin_to_dot_file_with_ts(GST_BIN(item->sendpipe), GST_DEBUG_GRAPH_SHOW_ALL, "udpsrc_webrtc");
+    gst_debug_bin_to_dot_file_with_ts(GST_BIN(pipeline), GST_DEBUG_GRAPH_SHOW_ALL, "single_webrtc");
 #endif
 }
 
+/**
+ * @brief The thread budget of the peers: a new peer gets a pipeline of its own while the threads of
+ * the send pipelines, entered or reserved, leave room for its expected share in webrtc.thread_budget.
+ * Past it the peer is a webrtcbin of the main pipeline. It saves the appsrcs, the pipeline and its
+ * clock, but the webrtcbin still runs its nicesrc, DTLS and SRTP tasks next to its two queues, so
+ * those peers still cost a few threads each, reported as "single_per_peer" in the stats.
+ */
+void start_budget_webrtcbin(WebrtcItem *item) {
+    gint expected = get_peer_pipeline_threads();
+    gint used = MAX(g_atomic_int_get(&stream_threads[THREADS_SEND]), g_atomic_int_get(&peer_reserved));
+
+    if (used + expected > config_data.webrtc.thread_budget) {
+        g_print("%d send threads of the budget of %d, the peer joins the main pipeline.\n",
+                used, config_data.webrtc.thread_budget);
+        start_webrtcbin(item);
+        return;
+    }
+    item->reserved_threads = expected;
+    g_atomic_int_add(&peer_reserved, expected);
+    g_atomic_int_inc(&pipeline_peers);
+    if (config_data.app_sink)
+        start_appsrc_webrtcbin(item);
+    else
+        start_udpsrc_webrtcbin(item);
+}
+
 int start_av_fakesink() {
     if (!_check_initial_status())
         return -1;
@@ -2346,30 +3966,54 @@ check_webrtcbin_state_by_timer(GstElement *webrtcbin) {
     g_signal_emit_by_name(G_OBJECT(webrtcbin), "notify::ice-connection-state", NULL, NULL);
 }
 
-void start_appsrc_webrtcbin(WebrtcItem *item) {
+/**
+ * @brief A send pipeline of the app_sink fan-out, built and taken to READY ahead of the connection.
+ * The element names only have to be unique in their own pipeline, so they follow a serial instead of the connection.
+ */
+typedef struct {
+    GstElement *pipeline;
+    GstElement *webrtcbin;
+    GstElement *video_src;
+    GstElement *audio_src;
+} SendPipeline;
+
+static GAsyncQueue *send_pool = NULL;
+static GThreadPool *send_pool_builder = NULL;
+static gint send_pool_pending = 0; // builds queued or running.
+static gint send_pipeline_serial = 0;
+static struct {
+    gsize hits;
+    gsize misses;
+    gsize built;
+} send_pool_stats;
+
+static SendPipeline *build_send_pipeline() {
+    SendPipeline *send = g_new0(SendPipeline, 1);
     gchar *cmdline = NULL;
     // gchar *turn_srv = NULL;
+    guint serial = g_atomic_int_add(&send_pipeline_serial, 1);
 
-    gchar *webrtc_name = g_strdup_printf("webrtc_appsrc_%" G_GUINT64_FORMAT, item->hash_id);
+    gchar *webrtc_name = g_strdup_printf("webrtc_appsrc_%u", serial);
     // vcaps = gst_caps_from_string("video/x-h264,stream-format=(string)avc,alignment=(string)au,width=(int)1280,height=(int)720,framerate=(fraction)30/1,profile=(string)main");
     // acaps = gst_caps_from_string("audio/x-opus, channels=(int)1,channel-mapping-family=(int)1");
     gchar *upenc = g_ascii_strup(config_data.videnc, strlen(config_data.videnc));
-    gchar *rtp = get_rtp_args();
-    gchar *video_src = g_strdup_printf("appsrc  name=video_%" G_GUINT64_FORMAT " format=3 leaky-type=2 ! "
-                                       " application/x-rtp,media=(string)video,clock-rate=(int)90000,encoding-name=(string)%s,payload=(int)96 ! "
-                                       " %s ! rtp%spay  ! queue leaky=2 !"
+    /* the appsrc queue already has its own streaming thread, no queue after it. The time bound is the backstop
+     * of the keyframe-aware drop, unless the GOP replay is pushed into it at once. */
+    gchar *max_time = config_data.webrtc.client_queue.max_ms > 0 && !config_data.webrtc.gop_cache.enable
+                          ? g_strdup_printf("max-time=%" G_GUINT64_FORMAT, (guint64)config_data.webrtc.client_queue.max_ms * 2 * GST_MSECOND)
+                          : g_strdup("");
+    // the fan-out carries the RTP of the shared payloaders as it is, with their caps.
+    gchar *video_src = g_strdup_printf("appsrc  name=video_%u format=3 leaky-type=2 %s ! "
                                        " application/x-rtp,media=(string)video,clock-rate=(int)90000,encoding-name=(string)%s,payload=(int)96 ! "
-                                       " queue leaky=2 ! %s. ",
-                                       item->hash_id, upenc, rtp, config_data.videnc, upenc, webrtc_name);
+                                       " %s. ",
+                                       serial, max_time, upenc, webrtc_name);
     g_free(upenc);
-    g_free(rtp);
+    g_free(max_time);
     if (audio_source != NULL) {
-        gchar *audio_src = g_strdup_printf("appsrc name=audio_%" G_GUINT64_FORMAT "  format=3 leaky-type=2 ! "
-                                           " application/x-rtp,media=(string)audio,clock-rate=(int)48000,encoding-name=(string)OPUS,payload=(int)97 ! "
-                                           " rtpopusdepay ! rtpopuspay ! queue leaky=2 ! "
+        gchar *audio_src = g_strdup_printf("appsrc name=audio_%u  format=3 leaky-type=2 ! "
                                            " application/x-rtp,media=(string)audio,clock-rate=(int)48000,encoding-name=(string)OPUS,payload=(int)97 ! "
-                                           " queue leaky=2 ! %s.",
-                                           item->hash_id, webrtc_name);
+                                           " %s.",
+                                           serial, webrtc_name);
         cmdline = g_strdup_printf("webrtcbin name=%s stun-server=stun://%s %s %s ", webrtc_name, config_data.webrtc.stun, audio_src, video_src);
         g_free(audio_src);
     } else {
@@ -2382,40 +4026,117 @@ void start_appsrc_webrtcbin(WebrtcItem *item) {
     // g_print("webrtc cmdline: %s \n", cmdline);
     g_free(video_src);
 
-    item->sendpipe = gst_parse_launch(cmdline, NULL);
+    send->pipeline = gst_parse_launch(cmdline, NULL);
     g_free(cmdline);
+    dtls_cert_attach(send->pipeline);
+    watch_pipeline_bus(send->pipeline, THREADS_SEND);
 
-    item->sendbin = gst_bin_get_by_name(GST_BIN(item->sendpipe), webrtc_name);
+    send->webrtcbin = gst_bin_get_by_name(GST_BIN(send->pipeline), webrtc_name);
+    // one ICE and DTLS transport, so one set of their threads, for the media and the data channel.
+    g_object_set(G_OBJECT(send->webrtcbin), "bundle-policy", 3, NULL);
     if (config_data.webrtc.turn.enable) {
-        webrtcbin_add_turn(item->sendbin);
+        webrtcbin_add_turn(send->webrtcbin);
     }
     g_free(webrtc_name);
 
-    webrtc_name = g_strdup_printf("video_%" G_GUINT64_FORMAT, item->hash_id);
-    item->send_avpair.video_src = gst_bin_get_by_name(GST_BIN(item->sendpipe), webrtc_name);
+    webrtc_name = g_strdup_printf("video_%u", serial);
+    send->video_src = gst_bin_get_by_name(GST_BIN(send->pipeline), webrtc_name);
     g_free(webrtc_name);
 #if 0
-    g_signal_connect(item->send_avpair.video_src, "enough-data", (GCallback)on_enough_data, NULL);
-    g_signal_connect(item->send_avpair.video_src, "need-data", (GCallback)need_data, NULL);
+    g_signal_connect(send->video_src, "enough-data", (GCallback)on_enough_data, NULL);
+    g_signal_connect(send->video_src, "need-data", (GCallback)need_data, NULL);
 #endif
 
-    webrtc_name = g_strdup_printf("audio_%" G_GUINT64_FORMAT, item->hash_id);
-    item->send_avpair.audio_src = gst_bin_get_by_name(GST_BIN(item->sendpipe), webrtc_name);
+    webrtc_name = g_strdup_printf("audio_%u", serial);
+    send->audio_src = gst_bin_get_by_name(GST_BIN(send->pipeline), webrtc_name);
     g_free(webrtc_name);
+
 #if 0
-    g_signal_connect(item->send_avpair.audio_src, "enough-data", (GCallback)on_enough_data, NULL);
-    g_signal_connect(item->send_avpair.audio_src, "need-data", (GCallback)need_data, NULL);
+    g_signal_connect(send->audio_src, "enough-data", (GCallback)on_enough_data, NULL);
+    g_signal_connect(send->audio_src, "need-data", (GCallback)need_data, NULL);
 #endif
-    g_mutex_lock(&G_appsrc_lock);
-    G_AppsrcList = g_list_append(G_AppsrcList, &item->send_avpair);
-    g_mutex_unlock(&G_appsrc_lock);
+    gst_element_set_state(send->pipeline, GST_STATE_READY);
+    return send;
+}
+
+static void send_pool_build(gpointer data, gpointer user_data) {
+    if (config_data.webrtc.pool.refill_delay > 0)
+        g_usleep(config_data.webrtc.pool.refill_delay * 1000);
+    g_async_queue_push(send_pool, build_send_pipeline());
+    g_atomic_pointer_add(&send_pool_stats.built, 1);
+    g_atomic_int_dec_and_test(&send_pool_pending);
+}
+
+/* called from the main loop only, the builder thread only decrements the pending count. */
+static void send_pool_refill() {
+    while (g_async_queue_length(send_pool) + g_atomic_int_get(&send_pool_pending) < config_data.webrtc.pool.size) {
+        g_atomic_int_inc(&send_pool_pending);
+        g_thread_pool_push(send_pool_builder, GINT_TO_POINTER(1), NULL);
+    }
+}
+
+static void start_send_pool() {
+    GError *err = NULL;
+
+    if (config_data.webrtc.pool.size <= 0)
+        return;
+    send_pool = g_async_queue_new();
+    // one builder, the pool is refilled in the background and never competes with itself.
+    send_pool_builder = g_thread_pool_new(send_pool_build, NULL, 1, FALSE, &err);
+    if (err != NULL) {
+        g_printerr("unable to create the send pipeline pool: %s\n", err->message);
+        g_clear_error(&err);
+        g_async_queue_unref(send_pool);
+        send_pool = NULL;
+        return;
+    }
+    send_pool_refill();
+}
+
+static SendPipeline *claim_send_pipeline() {
+    SendPipeline *send;
+
+    if (!send_pool)
+        return build_send_pipeline();
+    send = g_async_queue_try_pop(send_pool);
+    if (send) {
+        g_atomic_pointer_add(&send_pool_stats.hits, 1);
+    } else {
+        g_atomic_pointer_add(&send_pool_stats.misses, 1);
+        send = build_send_pipeline();
+    }
+    send_pool_refill();
+    return send;
+}
+
+void get_send_pool_stats(SendPoolStats *stats) {
+    stats->size = MAX(config_data.webrtc.pool.size, 0);
+    stats->ready = send_pool ? MAX(g_async_queue_length(send_pool), 0) : 0;
+    stats->hits = g_atomic_pointer_get(&send_pool_stats.hits);
+    stats->misses = g_atomic_pointer_get(&send_pool_stats.misses);
+    stats->built = g_atomic_pointer_get(&send_pool_stats.built);
+}
+
+void start_appsrc_webrtcbin(WebrtcItem *item) {
+    SendPipeline *send = claim_send_pipeline();
+
+    item->sendpipe = send->pipeline;
+    item->sendbin = send->webrtcbin;
+    item->send_avpair.video_src = send->video_src;
+    item->send_avpair.audio_src = send->audio_src;
+    item->send_avpair.client_queue.max_ms = MAX(config_data.webrtc.client_queue.max_ms, 0);
+    if (item->send_avpair.client_queue.max_ms) {
+        GstPad *pad = gst_element_get_static_pad(send->video_src, "src");
+        gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, on_client_queue_out, &item->send_avpair.client_queue, NULL);
+        gst_object_unref(pad);
+    }
+    g_free(send);
+
+    item->send_avpair.auto_layer = config_data.webrtc.abr.enable;
+    add_appsrc_subscriber(&item->send_avpair, FALSE);
 
-    gst_element_set_state(item->sendpipe, GST_STATE_READY);
     create_data_channel((gpointer)item);
 
-    item->record.get_rec_state = &get_record_state;
-    item->record.start = &appsrc_cmd_rec_start;
-    item->record.stop = &appsrc_cmd_rec_stop;
     item->recv.addremote = &start_recv_webrtcbin;
     item->stop_webrtc = &stop_appsrc_webrtc;
     g_signal_connect(item->sendbin, "notify::ice-gathering-state",
@@ -2426,23 +4147,155 @@ void start_appsrc_webrtcbin(WebrtcItem *item) {
 
     g_signal_connect(item->sendbin, "on-new-transceiver",
                      G_CALLBACK(_on_new_transceiver), item->sendbin);
+    g_signal_connect(item->sendbin, "notify::connection-state",
+                     G_CALLBACK(on_send_connection_state), item);
     g_timeout_add(3 * 1000, (GSourceFunc)check_webrtcbin_state_by_timer, item->sendbin);
+    abr_add_peer(item);
+    acquire_encoder_demand();
+}
+
+/**
+ * @brief The temporal layer id of a VP8 RTP packet, from the payload descriptor.
+ * https://datatracker.ietf.org/doc/html/rfc7741#section-4.2
+ */
+static gint get_rtp_vp8_tid(GstBuffer *buffer, gboolean *tl0_start) {
+    GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+    guint8 *payload;
+    guint size, pos = 1;
+    gint tid = 0;
+
+    *tl0_start = FALSE;
+    if (!gst_rtp_buffer_map(buffer, GST_MAP_READ, &rtp))
+        return 0;
+
+    payload = gst_rtp_buffer_get_payload(&rtp);
+    size = gst_rtp_buffer_get_payload_len(&rtp);
+    if (size > 2 && (payload[0] & 0x80)) {
+        guint8 ext = payload[pos++];
+        if (ext & 0x80) // PictureID, 15 bits if M is set.
+            pos += (payload[pos] & 0x80) ? 2 : 1;
+        if (ext & 0x40) // TL0PICIDX
+            pos++;
+        if ((ext & 0x20) && pos < size) // TID|Y|KEYIDX
+            tid = payload[pos] >> 6;
+    }
+    // S bit and partition index 0.
+    *tl0_start = size > 0 && tid == 0 && (payload[0] & 0x1f) == 0x10;
+    gst_rtp_buffer_unmap(&rtp);
+    return tid;
+}
+
+/**
+ * @brief Every subscriber gets the same buffer, the appsrcs only take a reference to it. The timestamps are
+ * rebased to running time on a new buffer header that shares the memory of the appsink one, without the
+ * metas, or the appsink buffer itself is pushed if they already are. The counters are read by the "stats" command.
+ */
+static struct {
+    gsize samples;
+    gsize shared;
+    gsize rebased;
+    gsize payload_copies;
+    gsize pushes;
+} fanout_stats;
+
+static GstBuffer *fanout_rebase(GstBuffer *buffer, GstClockTime pts, GstClockTime dts) {
+    GstBuffer *rebased;
+
+    g_atomic_pointer_add(&fanout_stats.samples, 1);
+    if (GST_BUFFER_PTS(buffer) == pts && GST_BUFFER_DTS(buffer) == dts) {
+        g_atomic_pointer_add(&fanout_stats.shared, 1);
+        return gst_buffer_ref(buffer);
+    }
+
+    rebased = gst_buffer_new();
+    gst_buffer_copy_into(rebased, buffer, GST_BUFFER_COPY_FLAGS | GST_BUFFER_COPY_TIMESTAMPS | GST_BUFFER_COPY_MEMORY, 0, -1);
+    GST_BUFFER_PTS(rebased) = pts;
+    GST_BUFFER_DTS(rebased) = dts;
+    g_atomic_pointer_add(&fanout_stats.rebased, 1);
+    // a NO_SHARE memory is copied by gst_buffer_copy_into().
+    for (guint i = 0; i < gst_buffer_n_memory(rebased); i++) {
+        if (gst_buffer_peek_memory(rebased, i) != gst_buffer_peek_memory(buffer, i)) {
+            g_atomic_pointer_add(&fanout_stats.payload_copies, 1);
+            break;
+        }
+    }
+    return rebased;
+}
+
+void get_fanout_stats(FanoutStats *stats) {
+    gint epoch;
+    AppsrcSet *set;
+
+    stats->samples = g_atomic_pointer_get(&fanout_stats.samples);
+    stats->shared = g_atomic_pointer_get(&fanout_stats.shared);
+    stats->rebased = g_atomic_pointer_get(&fanout_stats.rebased);
+    stats->payload_copies = g_atomic_pointer_get(&fanout_stats.payload_copies);
+    stats->pushes = g_atomic_pointer_get(&fanout_stats.pushes);
+    set = fanout_enter(&epoch);
+    stats->subscribers = set ? set->len : 0;
+    fanout_leave(epoch);
+}
+
+/**
+ * @brief The payloaders of the shared branch already produce WebRTC-ready RTP, so the client pipelines
+ * only take their caps, once, with the first packet. The parameter sets of H.26x are in-band.
+ */
+static void fanout_set_caps(GstElement *appsrc, GstCaps **current, GstCaps *caps) {
+    if (*current || !caps)
+        return;
+    gst_caps_replace(current, caps);
+    g_object_set(appsrc, "caps", caps, NULL);
+}
+
+static gboolean rtp_rewrite = FALSE; // the peers may switch the simulcast layer or skip the temporal ones.
+static gboolean layer_in_keyframe[MAX_VIDEO_LAYERS]; // the last packet of the layer was a keyframe one.
+
+/**
+ * @brief Each peer keeps the SSRC of its first layer and a continuous sequence, across the simulcast
+ * switches and the dropped temporal layers. Only a new header is allocated for the packets that change,
+ * the others are pushed as they are. The layers share the timestamp-offset, so the timestamps are kept.
+ */
+static GstBuffer *fanout_rtp_rewrite(AppSrcAVPair *pair, GstBuffer *buffer) {
+    GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+    guint32 ssrc;
+    guint16 seq;
+    guint header_len;
+
+    if (!gst_rtp_buffer_map(buffer, GST_MAP_READ, &rtp))
+        return gst_buffer_ref(buffer);
+    ssrc = gst_rtp_buffer_get_ssrc(&rtp);
+    seq = gst_rtp_buffer_get_seq(&rtp);
+    header_len = gst_rtp_buffer_get_header_len(&rtp);
+    gst_rtp_buffer_unmap(&rtp);
+
+    if (!pair->rtp_started) {
+        pair->rtp_started = TRUE;
+        pair->rtp_ssrc = pair->rtp_ssrc_in = ssrc;
+        pair->rtp_seq_delta = 0;
+    } else if (ssrc != pair->rtp_ssrc_in) {
+        pair->rtp_ssrc_in = ssrc;
+        pair->rtp_seq_delta = (guint16)(pair->rtp_last_seq + 1 - seq);
+    }
+    pair->rtp_last_seq = seq + pair->rtp_seq_delta;
+    if (ssrc == pair->rtp_ssrc && !pair->rtp_seq_delta)
+        return gst_buffer_ref(buffer);
+    return rewrite_rtp_header(buffer, header_len, pair->rtp_ssrc, pair->rtp_last_seq);
 }
 
 static GstFlowReturn
 on_new_sample_from_sink(GstElement *elt, gpointer user_data) {
     GstSample *sample;
     GstFlowReturn ret;
-    gchar *sink_name = gst_element_get_name(elt);
-    // g_print("new sample from :%s\n", sink_name);
-    gboolean isVideo = g_str_has_prefix(sink_name, "video");
-    g_free(sink_name);
+    gint layer = GPOINTER_TO_INT(user_data);
+    // the name is set once at creation, no copy of it per packet.
+    gboolean isVideo = g_str_has_prefix(GST_OBJECT_NAME(elt), "video");
 
     sample = gst_app_sink_pull_sample(GST_APP_SINK(elt));
     ret = GST_FLOW_ERROR;
     if (sample) {
         GstBuffer *buffer = gst_sample_get_buffer(sample);
         GstSegment *seg = gst_sample_get_segment(sample);
+        GstCaps *caps = gst_sample_get_caps(sample);
         GstClockTime pts, dts;
         ret = GST_FLOW_OK;
 
@@ -2456,17 +4309,85 @@ on_new_sample_from_sink(GstElement *elt, gpointer user_data) {
             dts = gst_segment_to_running_time(seg, GST_FORMAT_TIME, dts);
 
         if (buffer) {
-            /* Make writable so we can adjust the timestamps */
-            buffer = gst_buffer_copy(buffer);
-            GST_BUFFER_PTS(buffer) = pts;
-            GST_BUFFER_DTS(buffer) = dts;
-            GList *item;
-            g_mutex_lock(&G_appsrc_lock);
-            for (item = G_AppsrcList; item; item = item->next) {
-                AppSrcAVPair *pair = item->data;
-                g_signal_emit_by_name(isVideo ? pair->video_src : pair->audio_src, "push-buffer", buffer, &ret);
+            buffer = fanout_rebase(buffer, pts, dts);
+            AppsrcSet *set;
+            gint epoch;
+            // a subscriber that is not PLAYING yet or already stopped must not stop the shared appsink.
+            GstFlowReturn push_ret;
+            gboolean tl0_start = FALSE;
+            gboolean keyframe_start = FALSE;
+            gint tid = 0;
+            if (isVideo) {
+                gboolean delta = GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+                keyframe_start = !delta && !layer_in_keyframe[layer];
+                layer_in_keyframe[layer] = !delta;
             }
-            g_mutex_unlock(&G_appsrc_lock);
+            if (isVideo && temporal_layers_enabled)
+                tid = get_rtp_vp8_tid(buffer, &tl0_start);
+            if (isVideo && config_data.webrtc.gop_cache.enable)
+                gop_cache_push(&gop_caches[layer], buffer);
+            set = fanout_enter(&epoch);
+            for (guint i = 0; set && i < set->len; i++) {
+                AppSrcAVPair *pair = set->pairs[i];
+                if (isVideo) {
+                    // switch the simulcast layer at the first packet of a keyframe.
+                    gint pending = g_atomic_int_get(&pair->pending_layer);
+                    if (pending != pair->layer && pending == layer &&
+                        !GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT))
+                        g_atomic_int_set(&pair->layer, pending);
+                    if (pair->layer != layer)
+                        continue;
+                    fanout_set_caps(pair->video_src, &pair->video_caps, caps);
+                    if (pair->gop_replay) {
+                        GopCache *cache = &gop_caches[layer];
+                        if (cache->valid && cache->buffers->len) {
+                            // the cache already ends with this packet.
+                            if (gop_cache_replay(cache, pair->video_src) != GST_FLOW_FLUSHING)
+                                pair->gop_replay = FALSE;
+                            // the backlog is measured again from the next live packet.
+                            pair->client_queue.started = FALSE;
+                            continue;
+                        }
+                        // nothing to replay, ask for a keyframe and wait for it.
+                        pair->gop_replay = FALSE;
+                        pair->wait_keyframe = TRUE;
+                        request_sink_keyframe(elt);
+                    }
+                    if (pair->wait_keyframe) {
+                        if (GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT))
+                            continue;
+                        pair->wait_keyframe = FALSE;
+                    }
+                    if (fanout_client_drop(pair, elt, pts, keyframe_start)) {
+                        if (pair->rtp_started)
+                            pair->rtp_seq_delta--;
+                        continue;
+                    }
+                    // the upper layers only reference TL0, so the switch is clean at a TL0 frame.
+                    if (tl0_start)
+                        pair->base_layer_only = g_atomic_int_get(&pair->pending_base_layer);
+                    if (pair->base_layer_only && tid > 0) {
+                        // the peer sees no gap in the sequence.
+                        if (pair->rtp_started)
+                            pair->rtp_seq_delta--;
+                        continue;
+                    }
+                    if (rtp_rewrite) {
+                        GstBuffer *out = fanout_rtp_rewrite(pair, buffer);
+                        g_signal_emit_by_name(pair->video_src, "push-buffer", out, &push_ret);
+                        g_atomic_pointer_add(&fanout_stats.pushes, 1);
+                        gst_buffer_unref(out);
+                        continue;
+                    }
+                } else if (!pair->audio_src) {
+                    continue;
+                } else {
+                    fanout_set_caps(pair->audio_src, &pair->audio_caps, caps);
+                }
+                g_signal_emit_by_name(isVideo ? pair->video_src : pair->audio_src, "push-buffer", buffer, &push_ret);
+                g_atomic_pointer_add(&fanout_stats.pushes, 1);
+            }
+            fanout_leave(epoch);
 
             gst_buffer_unref(buffer);
         }
@@ -2477,21 +4398,76 @@ on_new_sample_from_sink(GstElement *elt, gpointer user_data) {
     return ret;
 }
 
-int start_av_appsink() {
-    if (!_check_initial_status())
-        return -1;
-    GstElement *aqueue, *vqueue, *video_sink, *audio_sink, *video_pay, *audio_pay;
+static GstPadProbeReturn keyframe_state_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    gint *keyframe = (gint *)user_data;
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+    *keyframe = !GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+    return GST_PAD_PROBE_OK;
+}
+
+static void mark_rtp_keyframe(GstBuffer *buffer, gint *keyframe) {
+    if (*keyframe) {
+        GST_BUFFER_FLAG_UNSET(buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+        *keyframe = 0;
+    } else {
+        GST_BUFFER_FLAG_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+    }
+}
+
+static GstPadProbeReturn keyframe_mark_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    if (GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_BUFFER_LIST) {
+        GstBufferList *list = gst_buffer_list_make_writable(GST_PAD_PROBE_INFO_BUFFER_LIST(info));
+        for (guint i = 0; i < gst_buffer_list_length(list); i++)
+            mark_rtp_keyframe(gst_buffer_list_get_writable(list, i), user_data);
+        GST_PAD_PROBE_INFO_DATA(info) = list;
+    } else {
+        GstBuffer *buffer = gst_buffer_make_writable(GST_PAD_PROBE_INFO_BUFFER(info));
+        mark_rtp_keyframe(buffer, user_data);
+        GST_PAD_PROBE_INFO_DATA(info) = buffer;
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+/**
+ * @brief Only the first RTP packet of a keyframe comes out of the payloader without the DELTA_UNIT flag,
+ * so the fan-out can find where a subscriber may join or switch.
+ */
+static void add_keyframe_marker(GstElement *payloader) {
+    GstPad *pad;
+    gint *keyframe = g_new0(gint, 1);
+
+    pad = gst_element_get_static_pad(payloader, "sink");
+    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, keyframe_state_probe, keyframe, NULL);
+    gst_object_unref(pad);
+
+    pad = gst_element_get_static_pad(payloader, "src");
+    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST,
+                      keyframe_mark_probe, keyframe, g_free);
+    gst_object_unref(pad);
+}
+
+static guint rtp_timestamp_offset = 0;
+
+static int add_video_appsink(GstElement *enctee, gint layer) {
+    GstElement *vqueue, *video_sink, *video_pay;
     MAKE_ELEMENT_AND_ADD(vqueue, "queue");
     gchar *tmpname = g_strdup_printf("rtp%spay", config_data.videnc);
     MAKE_ELEMENT_AND_ADD(video_pay, tmpname);
     g_free(tmpname);
 
-    video_sink = gst_element_factory_make("appsink", "video_sink");
+    tmpname = layer ? g_strdup_printf("video_sink_%d", layer) : g_strdup("video_sink");
+    video_sink = gst_element_factory_make("appsink", tmpname);
+    g_free(tmpname);
     /* Configure udpsink */
     g_object_set(video_sink, "sync", FALSE, "async", FALSE,
                  "emit-signals", TRUE, "drop", TRUE, "max-buffers", 100, NULL);
+    // the same RTP timestamps on every simulcast layer, a switch only rewrites the SSRC and the sequence.
+    g_object_set(video_pay, "timestamp-offset", rtp_timestamp_offset, NULL);
     if (g_str_has_prefix(config_data.videnc, "h26")) {
         g_object_set(video_pay, "config-interval", -1, "aggregate-mode", 1, NULL);
+    } else if (temporal_layers_enabled) {
+        // 15-bit PictureID, so the TL0PICIDX/TID fields of the encoder meta are written.
+        g_object_set(video_pay, "picture-id-mode", 2, NULL);
     }
 
     g_object_set(vqueue, "leaky", 1, NULL);
@@ -2514,11 +4490,40 @@ int start_av_appsink() {
             return -1;
         }
     }
+    add_keyframe_marker(video_pay);
+    gop_caches[layer].buffers = g_ptr_array_new_with_free_func((GDestroyNotify)gst_buffer_unref);
 
-    link_request_src_pad(video_encoder, vqueue);
+    link_request_src_pad(enctee, vqueue);
 
     g_signal_connect(video_sink, "new-sample",
-                     (GCallback)on_new_sample_from_sink, NULL);
+                     (GCallback)on_new_sample_from_sink, GINT_TO_POINTER(layer));
+    return 0;
+}
+
+int start_av_appsink() {
+    if (!_check_initial_status())
+        return -1;
+    GstElement *aqueue, *audio_sink, *audio_pay;
+
+    rtp_timestamp_offset = g_random_int();
+    if (add_video_appsink(video_encoder, 0))
+        return -1;
+
+    if (config_data.webrtc.simulcast.enable) {
+        for (int i = 0; i < config_data.webrtc.simulcast.count; i++) {
+            guint scale = config_data.webrtc.simulcast.layers[i];
+            EncoderEntry *entry = get_encoder_entry(get_overlay_tee(), config_data.videnc,
+                                                    (config_data.v4l2src_data.width / scale) & ~1,
+                                                    (config_data.v4l2src_data.height / scale) & ~1,
+                                                    "live", NULL);
+            if (!entry || add_video_appsink(entry->tee, video_layer_count))
+                break;
+            video_layer_count++;
+        }
+        g_print("simulcast layers: %d\n", video_layer_count);
+    }
+    // the keyframe-aware drop of a slow peer skips packets too.
+    rtp_rewrite = video_layer_count > 1 || temporal_layers_enabled || config_data.webrtc.client_queue.max_ms > 0;
 
     if (audio_source != NULL) {
         audio_sink = gst_element_factory_make("appsink", "audio_sink");
@@ -2549,24 +4554,19 @@ int start_av_appsink() {
 int splitfile_sink() {
     if (!_check_initial_status())
         return -1;
-    GstElement *splitmuxsink, *videoparse, *vqueue, *clock, *encoder, *textoverlay;
+    GstElement *splitmuxsink, *videoparse, *vqueue, *encoder;
 
     gchar *tmpfile;
-    encoder = get_hardware_h264_encoder();
+    encoder = get_shared_video_encoder("h264");
+    if (!encoder)
+        return -1;
     gchar *outdir = g_strconcat(config_data.root_dir, "/daily_record", NULL);
     MAKE_ELEMENT_AND_ADD(splitmuxsink, "splitmuxsink");
     MAKE_ELEMENT_AND_ADD(videoparse, "h264parse");
     MAKE_ELEMENT_AND_ADD(vqueue, "queue");
-    MAKE_ELEMENT_AND_ADD(clock, "clockoverlay");
-    g_object_set(clock, "time-format", "%D %H:%M:%S", NULL);
-    MAKE_ELEMENT_AND_ADD(textoverlay, "textoverlay");
-    g_object_set(textoverlay, "text", g_getenv("LANG"),
-                 "valignment", 1, // bottom
-                 "halignment", 0, // left
-                 NULL);
 
     g_object_set(vqueue, "leaky", 1, NULL);
-    if (!gst_element_link_many(vqueue, clock, textoverlay, encoder, videoparse, splitmuxsink, NULL)) {
+    if (!gst_element_link_many(vqueue, videoparse, splitmuxsink, NULL)) {
         g_error("Failed to link elements splitmuxsink.\n");
         return -1;
     }
@@ -2580,7 +4580,7 @@ int splitfile_sink() {
     _mkdir(outdir, 0755);
     g_free(outdir);
 
-    link_request_src_pad(video_source, vqueue);
+    link_request_src_pad(encoder, vqueue);
 
 #if 0
     // add audio to muxer.
@@ -2632,28 +4632,47 @@ static void set_hlssink_object(GstElement *hlssink, gchar *outdir, gchar *locati
     g_free(tmp2);
 }
 
-int av_hlssink() {
-    GstElement *hlssink, *videoparse, *mpegtsmux, *vqueue, *encoder;
-    if (!_check_initial_status())
-        return -1;
-    encoder = get_hardware_h264_encoder();
-    gchar *outdir = g_strconcat(config_data.root_dir, "/hls", NULL);
-    MAKE_ELEMENT_AND_ADD(hlssink, "hlssink");
-    MAKE_ELEMENT_AND_ADD(videoparse, "h264parse");
-    MAKE_ELEMENT_AND_ADD(vqueue, "queue");
-    MAKE_ELEMENT_AND_ADD(mpegtsmux, "mpegtsmux");
+/**
+ * @brief queue ! h264parse ! mpegtsmux ! hlssink from an encoder tee.
+ *
+ * @return the mpegtsmux for more streams, NULL on failure.
+ */
+static GstElement *get_hlssink_mux(GstElement *enctee, gchar *outdir, gchar *location) {
+    GstElement *hlssink, *videoparse, *mpegtsmux, *vqueue;
+    hlssink = gst_element_factory_make("hlssink", NULL);
+    videoparse = gst_element_factory_make("h264parse", NULL);
+    vqueue = gst_element_factory_make("queue", NULL);
+    mpegtsmux = gst_element_factory_make("mpegtsmux", NULL);
+    if (!hlssink || !videoparse || !vqueue || !mpegtsmux) {
+        g_printerr("hlssink all elements could not be created.\n");
+        return NULL;
+    }
+    gst_bin_add_many(GST_BIN(pipeline), hlssink, videoparse, vqueue, mpegtsmux, NULL);
     g_object_set(vqueue, "leaky", 1, NULL);
     if (!gst_element_link_many(vqueue, videoparse, mpegtsmux, hlssink, NULL)) {
-        g_error("Failed to link elements av hlssink\n");
-        return -1;
+        g_error("Failed to link elements hlssink\n");
+        return NULL;
     }
-    g_object_set(vqueue, "leaky", 1, NULL);
-    set_hlssink_object(hlssink, outdir, "/segment%05d.ts");
-
+    set_hlssink_object(hlssink, outdir, location);
     _mkdir(outdir, 0755);
+
+    link_request_src_pad(enctee, vqueue);
+    return mpegtsmux;
+}
+
+int av_hlssink() {
+    GstElement *mpegtsmux, *encoder;
+    if (!_check_initial_status())
+        return -1;
+    encoder = get_shared_video_encoder("h264");
+    if (!encoder)
+        return -1;
+    gchar *outdir = g_strconcat(config_data.root_dir, "/hls", NULL);
+    mpegtsmux = get_hlssink_mux(encoder, outdir, "/segment%05d.ts");
     g_free(outdir);
+    if (!mpegtsmux)
+        return -1;
 
-    link_request_src_pad(encoder, vqueue);
     // add audio to muxer.
     if (audio_source != NULL) {
         GstElement *aqueue, *opusparse;
@@ -2677,7 +4696,6 @@ int udp_multicastsink() {
     GstElement *aqueue;
     if (!_check_initial_status())
         return -1;
-    // encoder = get_hardware_h264_encoder();
     bin = gst_bin_new("udp_bin");
     SUB_BIN_MAKE_ELEMENT_AND_ADD(bin, udpsink, "udpsink");
     SUB_BIN_MAKE_ELEMENT_AND_ADD(bin, cparse, "h264parse");
@@ -2722,7 +4740,7 @@ int udp_multicastsink() {
         link_request_src_pad_with_dst_name(audio_source, bin, "audio_sink");
     }
 
-    link_request_src_pad_with_dst_name(video_encoder, bin, "video_sink");
+    link_request_src_pad_with_dst_name(get_shared_video_encoder("h264"), bin, "video_sink");
 
     return 0;
 }
@@ -2785,57 +4803,136 @@ int motion_hlssink() {
 }
 
 #else
+/**
+ * @brief The one downscaled copy of the capture every OpenCV detector reads, scaled and
+ * converted once at the analytics size, format and framerate. The leaky queues drop the
+ * frames the detectors are too slow for instead of holding back the capture.
+ */
+static GstElement *analytics_tee = NULL;
+
+static GstElement *get_analytics_tee() {
+    GstElement *queue, *videorate, *videoscale, *videoconvert, *capsfilter, *teesrc;
+    GstCaps *caps;
+
+    if (analytics_tee)
+        return analytics_tee;
+
+    queue = gst_element_factory_make("queue", NULL);
+    videorate = gst_element_factory_make("videorate", NULL);
+    videoscale = gst_element_factory_make("videoscale", NULL);
+    videoconvert = gst_element_factory_make("videoconvert", NULL);
+    capsfilter = gst_element_factory_make("capsfilter", NULL);
+    teesrc = gst_element_factory_make("tee", "analytics_tee");
+    if (!queue || !videorate || !videoscale || !videoconvert || !capsfilter || !teesrc) {
+        g_printerr("analytics source elements could not be created.\n");
+        return NULL;
+    }
+    g_object_set(queue, "leaky", 2, "max-size-buffers", 1, NULL);
+    g_object_set(videorate, "drop-only", TRUE, NULL);
+    caps = gst_caps_new_simple("video/x-raw",
+                               "format", G_TYPE_STRING, config_data.analytics.format,
+                               "width", G_TYPE_INT, config_data.analytics.width,
+                               "height", G_TYPE_INT, config_data.analytics.height,
+                               "framerate", GST_TYPE_FRACTION, config_data.analytics.framerate, 1, NULL);
+    g_object_set(G_OBJECT(capsfilter), "caps", caps, NULL);
+    gst_caps_unref(caps);
+    g_object_set(teesrc, "allow-not-linked", TRUE, NULL);
+
+    gst_bin_add_many(GST_BIN(pipeline), queue, videorate, videoscale, videoconvert, capsfilter, teesrc, NULL);
+    // the rate is dropped before the scale and the scale before the conversion, each on the fewest pixels.
+    if (!gst_element_link_many(queue, videorate, videoscale, videoconvert, capsfilter, teesrc, NULL)) {
+        g_print("Failed to link elements analytics source \n");
+        return NULL;
+    }
+    link_request_src_pad(video_source, queue);
+    analytics_tee = teesrc;
+    return analytics_tee;
+}
+
+/**
+ * @brief analytics tee -> queue -> videoconvert -> detector -> sink (a fakesink if NULL).
+ * The conversion is a passthrough when the analytics format is already the detector's.
+ */
+static int link_analytics_detector(GstElement *detector, GstElement *sink) {
+    GstElement *tee, *queue, *convert;
+
+    tee = get_analytics_tee();
+    if (!tee)
+        return -1;
+    MAKE_ELEMENT_AND_ADD(queue, "queue");
+    MAKE_ELEMENT_AND_ADD(convert, "videoconvert");
+    g_object_set(queue, "leaky", 2, "max-size-buffers", 1, NULL);
+    if (!sink) {
+        MAKE_ELEMENT_AND_ADD(sink, "fakesink");
+        g_object_set(sink, "sync", FALSE, "async", FALSE, NULL);
+    }
+    if (!gst_element_link_many(queue, convert, detector, sink, NULL)) {
+        g_printerr("Failed to link elements analytics %s.\n", GST_OBJECT_NAME(detector));
+        return -1;
+    }
+    return link_request_src_pad(tee, queue);
+}
+
+/**
+ * @brief The full size rendition of a detector: the capture with the clock, the optional
+ * caption and the detections drawn as boxes, see on_analytics_message().
+ */
+static int link_detection_rendition(GstElement *detector, const gchar *caption, const gchar *outdir,
+                                    const gchar *filename) {
+    GstElement *queue, *convert, *tail, *encoder;
+    GstCaps *caps;
+    OsdBoxes *boxes;
+
+    MAKE_ELEMENT_AND_ADD(queue, "queue");
+    MAKE_ELEMENT_AND_ADD(convert, "videoconvert");
+    MAKE_ELEMENT_AND_ADD(tail, "capsfilter");
+    g_object_set(queue, "leaky", 2, NULL);
+    caps = gst_caps_from_string(OSD_VIDEO_CAPS);
+    g_object_set(G_OBJECT(tail), "caps", caps, NULL);
+    gst_caps_unref(caps);
+    if (!gst_element_link_many(queue, convert, tail, NULL)) {
+        g_printerr("Failed to link elements %s rendition.\n", GST_OBJECT_NAME(detector));
+        return -1;
+    }
+    // the shared OSD, with the caption in place of the sysinfo.
+    osd_attach(tail, config_data.hls.showtext ? caption : NULL);
+    boxes = osd_boxes_attach(tail, config_data.analytics.width, config_data.analytics.height);
+    g_object_set_data(G_OBJECT(detector), "osd-boxes", boxes);
+
+    encoder = get_shared_encoder(tail, "h264", config_data.v4l2src_data.width,
+                                 config_data.v4l2src_data.height, "live", NULL);
+    if (!encoder || !get_hlssink_mux(encoder, outdir, filename))
+        return -1;
+    return link_request_src_pad(video_source, queue);
+}
+
 int motion_hlssink() {
-    GstElement *hlssink, *videoparse, *pre_convert, *post_convert;
-    GstElement *queue, *motioncells, *encoder, *mpegtsmux, *clock;
+    GstElement *detector;
+    GstCaps *caps;
+    int ret;
+
     if (!_check_initial_status())
         return -1;
 
     gchar *outdir = g_strconcat(config_data.root_dir, "/hls/motion", NULL);
-    encoder = get_hardware_h264_encoder();
 
-    MAKE_ELEMENT_AND_ADD(hlssink, "hlssink");
-    MAKE_ELEMENT_AND_ADD(videoparse, "h264parse");
-    MAKE_ELEMENT_AND_ADD(queue, "queue");
-    MAKE_ELEMENT_AND_ADD(pre_convert, "videoconvert");
-    MAKE_ELEMENT_AND_ADD(post_convert, "videoconvert");
-    MAKE_ELEMENT_AND_ADD(motioncells, "motioncells");
-    MAKE_ELEMENT_AND_ADD(mpegtsmux, "mpegtsmux");
-    MAKE_ELEMENT_AND_ADD(clock, "clockoverlay");
-    g_object_set(clock, "time-format", "%D %H:%M:%S", NULL);
-    g_object_set(queue, "leaky", 1, NULL);
-    if (config_data.hls.showtext) {
-        GstElement *textoverlay;
-        MAKE_ELEMENT_AND_ADD(textoverlay, "textoverlay");
-        if (!gst_element_link_many(pre_convert, motioncells, post_convert,
-                                   textoverlay, clock, encoder, queue, videoparse,
-                                   mpegtsmux, hlssink, NULL)) {
-            g_error("Failed to link elements motion sink.\n");
-            return -1;
-        }
-        g_object_set(textoverlay, "text", "videoconvert ! motioncells postallmotion=true ! videoconvert",
-                     "valignment", 1, // bottom
-                     "halignment", 0, // left
-                     NULL);
-    } else {
-        if (!gst_element_link_many(pre_convert, motioncells, post_convert, clock,
-                                   encoder, queue, videoparse, mpegtsmux, hlssink, NULL)) {
-            g_error("Failed to link elements motion sink.\n");
-            return -1;
-        }
+    // the detector reads the Y plane, the analytics frames are only converted when they have none.
+    detector = gst_element_factory_make("capsfilter", "motion_detect");
+    if (!detector) {
+        g_printerr("capsfilter is not available\n");
+        return -1;
     }
+    gst_bin_add(GST_BIN(pipeline), detector);
+    caps = gst_caps_from_string("video/x-raw,format=(string){GRAY8,I420,YV12,NV12}");
+    g_object_set(G_OBJECT(detector), "caps", caps, NULL);
+    gst_caps_unref(caps);
+    motion_attach(detector);
 
-    set_hlssink_object(hlssink, outdir, "/motion-%05d.ts");
-    gchar *tmp2;
-    tmp2 = g_strconcat(outdir, "/motioncells", NULL);
-    g_object_set(motioncells,
-                 // "postallmotion", TRUE,
-                 "datafile", tmp2,
-                 NULL);
-    g_free(tmp2);
-    _mkdir(outdir, 0755);
+    ret = link_detection_rendition(detector, "analytics ! videoconvert ! motion_detect", outdir, "/motion-%05d.ts");
     g_free(outdir);
-    return link_request_src_pad(video_source, pre_convert);
+    if (ret < 0)
+        return ret;
+    return link_analytics_detector(detector, NULL);
 }
 #endif
 
@@ -2870,51 +4967,29 @@ int cvtracker_hlssink() {
 
 #else
 int cvtracker_hlssink() {
-    GstElement *hlssink, *videoparse, *pre_convert, *post_convert;
-    GstElement *queue, *cvtracker, *encoder, *mpegtsmux, *clock;
+    GstElement *cvtracker;
+    int ret;
 
     if (!_check_initial_status())
         return -1;
 
     gchar *outdir = g_strconcat(config_data.root_dir, "/hls/cvtracker", NULL);
-    encoder = get_hardware_h264_encoder();
 
-    MAKE_ELEMENT_AND_ADD(hlssink, "hlssink");
-    MAKE_ELEMENT_AND_ADD(videoparse, "h264parse");
-    MAKE_ELEMENT_AND_ADD(queue, "queue");
-    MAKE_ELEMENT_AND_ADD(pre_convert, "videoconvert");
-    MAKE_ELEMENT_AND_ADD(post_convert, "videoconvert");
     MAKE_ELEMENT_AND_ADD(cvtracker, "cvtracker");
-    MAKE_ELEMENT_AND_ADD(mpegtsmux, "mpegtsmux");
-    MAKE_ELEMENT_AND_ADD(clock, "clockoverlay");
-    g_object_set(clock, "time-format", "%D %H:%M:%S", NULL);
-    g_object_set(cvtracker, "object-initial-x", 600, "object-initial-y", 300, "object-initial-height", 100, "object-initial-width", 100, NULL);
-    if (config_data.hls.showtext) {
-        GstElement *textoverlay;
-        MAKE_ELEMENT_AND_ADD(textoverlay, "textoverlay");
-        if (!gst_element_link_many(pre_convert, cvtracker, post_convert,
-                                   textoverlay, clock, encoder, queue, videoparse,
-                                   mpegtsmux, hlssink, NULL)) {
-            g_error("Failed to link elements cvtracker sink.\n");
-            return -1;
-        }
-        g_object_set(textoverlay, "text", "videoconvert ! cvtracker ! videoconvert",
-                     "valignment", 1, // bottom
-                     "halignment", 0, // left
-                     NULL);
-    } else {
-        if (!gst_element_link_many(pre_convert, cvtracker, post_convert, clock, encoder, queue, videoparse,
-                                   mpegtsmux, hlssink, NULL)) {
-            g_error("Failed to link elements motion sink.\n");
-            return -1;
-        }
-    }
-
-    set_hlssink_object(hlssink, outdir, "/cvtracker-%05d.ts");
-    _mkdir(outdir, 0755);
+    // the initial object was at 600,300 100x100 of a 1280x720 capture, kept in the same place.
+    g_object_set(cvtracker,
+                 "object-initial-x", 600 * config_data.analytics.width / 1280,
+                 "object-initial-y", 300 * config_data.analytics.height / 720,
+                 "object-initial-width", MAX(100 * config_data.analytics.width / 1280, 8),
+                 "object-initial-height", MAX(100 * config_data.analytics.height / 720, 8),
+                 "draw-rect", FALSE,
+                 "post-debug-info", TRUE, NULL);
+
+    ret = link_detection_rendition(cvtracker, "analytics ! videoconvert ! cvtracker", outdir, "/cvtracker-%05d.ts");
     g_free(outdir);
-
-    return link_request_src_pad(video_source, pre_convert);
+    if (ret < 0)
+        return ret;
+    return link_analytics_detector(cvtracker, NULL);
 }
 #endif
 
@@ -2953,53 +5028,24 @@ int facedetect_hlssink() {
 }
 #else
 int facedetect_hlssink() {
-    GstElement *hlssink, *videoparse, *pre_convert, *post_convert;
-    GstElement *queue, *post_queue, *facedetect, *encoder, *mpegtsmux;
+    GstElement *facedetect;
+    int ret;
 
     if (!_check_initial_status())
         return -1;
     gchar *outdir = g_strconcat(config_data.root_dir, "/hls/face", NULL);
 
-    MAKE_ELEMENT_AND_ADD(hlssink, "hlssink");
-    MAKE_ELEMENT_AND_ADD(videoparse, "h264parse");
-    MAKE_ELEMENT_AND_ADD(queue, "queue");
-    MAKE_ELEMENT_AND_ADD(post_queue, "queue");
-    MAKE_ELEMENT_AND_ADD(pre_convert, "videoconvert");
-    MAKE_ELEMENT_AND_ADD(post_convert, "videoconvert");
     MAKE_ELEMENT_AND_ADD(facedetect, "facedetect");
-    MAKE_ELEMENT_AND_ADD(mpegtsmux, "mpegtsmux");
-    g_object_set(queue, "leaky", 1, NULL);
-    encoder = get_hardware_h264_encoder();
-
-    if (config_data.hls.showtext) {
-        GstElement *textoverlay;
-        MAKE_ELEMENT_AND_ADD(textoverlay, "textoverlay");
-        if (!gst_element_link_many(queue, pre_convert, facedetect, post_convert,
-                                   textoverlay, encoder, post_queue, videoparse,
-                                   mpegtsmux, hlssink, NULL)) {
-            g_error("Failed to link elements facedetect sink.\n");
-            return -1;
-        }
-        g_object_set(textoverlay, "text", "queue leaky=1 ! videoconvert ! facedetect min-stddev=24 scale-factor=2.8 ! videoconvert",
-                     "valignment", 1, // bottom
-                     "halignment", 0, // left
-                     NULL);
-    } else {
-        if (!gst_element_link_many(queue, pre_convert, facedetect, post_convert,
-                                   encoder, post_queue, videoparse,
-                                   hlssink, NULL)) {
-            g_error("Failed to link elements facedetect sink.\n");
-            return -1;
-        }
-    }
-    set_hlssink_object(hlssink, outdir, "/facedetect-%05d.ts");
-
-    g_object_set(facedetect, "min-stddev", 24, "scale-factor", 2.8,
+    // a finer pyramid than at the capture size is affordable on the analytics frames.
+    g_object_set(facedetect, "min-stddev", 24, "scale-factor", 1.2, "display", FALSE,
                  "eyes-profile", "/usr/share/opencv4/haarcascades/haarcascade_eye_tree_eyeglasses.xml", NULL);
 
-    _mkdir(outdir, 0755);
+    ret = link_detection_rendition(facedetect, "analytics ! videoconvert ! facedetect min-stddev=24 scale-factor=1.2",
+                                   outdir, "/facedetect-%05d.ts");
     g_free(outdir);
-    return link_request_src_pad(video_source, queue);
+    if (ret < 0)
+        return ret;
+    return link_analytics_detector(facedetect, NULL);
 }
 #endif
 
@@ -3031,53 +5077,36 @@ int edgedect_hlssink() {
 }
 #else
 int edgedect_hlssink() {
-    GstElement *hlssink, *videoparse, *pre_convert, *post_convert, *clock;
-    GstElement *post_queue, *edgedetect, *encoder, *mpegtsmux;
+    GstElement *post_convert, *tail;
+    GstElement *edgedetect, *encoder;
+    GstCaps *caps;
 
     if (!_check_initial_status())
         return -1;
 
     gchar *outdir = g_strconcat(config_data.root_dir, "/hls/edge", NULL);
-    MAKE_ELEMENT_AND_ADD(hlssink, "hlssink");
-    MAKE_ELEMENT_AND_ADD(videoparse, "h264parse");
-    MAKE_ELEMENT_AND_ADD(post_queue, "queue");
-    MAKE_ELEMENT_AND_ADD(pre_convert, "videoconvert");
     MAKE_ELEMENT_AND_ADD(post_convert, "videoconvert");
     MAKE_ELEMENT_AND_ADD(edgedetect, "edgedetect");
-    MAKE_ELEMENT_AND_ADD(mpegtsmux, "mpegtsmux");
-    MAKE_ELEMENT_AND_ADD(clock, "clockoverlay");
-    g_object_set(clock, "time-format", "%D %H:%M:%S", NULL);
-    g_object_set(post_queue, "leaky", 1, NULL);
-    encoder = get_hardware_h264_encoder();
-
-    if (config_data.hls.showtext) {
-        GstElement *textoverlay;
-        MAKE_ELEMENT_AND_ADD(textoverlay, "textoverlay");
-        if (!gst_element_link_many(pre_convert, edgedetect, post_convert,
-                                   textoverlay, clock, encoder, post_queue, videoparse,
-                                   mpegtsmux, hlssink, NULL)) {
-            g_error("Failed to link elements cvtracker sink.\n");
-            return -1;
-        }
-        g_object_set(textoverlay, "text", "videoconvert ! edgedetect threshold1=80 threshold2=240  ! videoconvert",
-                     "valignment", 1, // bottom
-                     "halignment", 0, // left
-                     NULL);
-
-    } else {
-        if (!gst_element_link_many(pre_convert, edgedetect, post_convert,
-                                   clock, encoder, post_queue, videoparse,
-                                   hlssink, NULL)) {
-            g_error("Failed to link elements motion sink.\n");
-            return -1;
-        }
-    }
-    set_hlssink_object(hlssink, outdir, "/edgedetect-%05d.ts");
+    MAKE_ELEMENT_AND_ADD(tail, "capsfilter");
     g_object_set(edgedetect, "threshold1", 80, "threshold2", 240, NULL);
+    caps = gst_caps_from_string(OSD_VIDEO_CAPS);
+    g_object_set(G_OBJECT(tail), "caps", caps, NULL);
+    gst_caps_unref(caps);
+    if (!gst_element_link(post_convert, tail)) {
+        g_printerr("Failed to link elements edge sink.\n");
+        return -1;
+    }
+    // the shared OSD, with the caption in place of the sysinfo.
+    osd_attach(tail, config_data.hls.showtext ? "analytics ! videoconvert ! edgedetect threshold1=80 threshold2=240 ! videoconvert" : NULL);
+
+    // the edges are the picture itself, encoded at the analytics size.
+    encoder = get_shared_encoder(tail, "h264", config_data.analytics.width,
+                                 config_data.analytics.height, "live", NULL);
+    if (!encoder || !get_hlssink_mux(encoder, outdir, "/edgedetect-%05d.ts"))
+        return -1;
 
-    _mkdir(outdir, 0755);
     g_free(outdir);
-    return link_request_src_pad(video_source, pre_convert);
+    return link_analytics_detector(edgedetect, post_convert);
 }
 #endif
 
@@ -3118,25 +5147,14 @@ static void _initial_device() {
     is_initial = TRUE;
 }
 
-GThread *start_inotify_thread(void) {
-    GThread *tid = NULL;
-    gchar *fullpath;
-    char abpath[PATH_MAX];
-
-    fullpath = g_strconcat(config_data.root_dir, "/hls/motion/motioncells-0.vamc", NULL);
-    g_print("Starting inotify watch thread....\n");
-    if (!realpath(fullpath, abpath)) {
-        g_printerr("Get realpath of %s failed\n", fullpath);
-        return NULL;
-    }
-    g_free(fullpath);
-    tid = g_thread_new("_inotify_thread", _inotify_thread, g_strdup(abpath));
-
-    return tid;
-}
-
 GstElement *create_instance() {
     pipeline = gst_pipeline_new("pipeline");
+    watch_pipeline_bus(pipeline, THREADS_MAIN);
+    GstBus *bus = gst_pipeline_get_bus(GST_PIPELINE(pipeline));
+    gst_bus_add_watch(bus, on_pipeline_message, NULL);
+    gst_object_unref(bus);
+    g_signal_connect(pipeline, "deep-element-added", G_CALLBACK(on_branch_element_added), NULL);
+    building_branch = SCHED_CAPTURE;
 
     if (!capture_htable)
         capture_htable = initial_capture_hashtable();
@@ -3158,6 +5176,10 @@ GstElement *create_instance() {
 
         // gst_element_sync_state_with_parent(cmdlinebin);
         gst_bin_add(GST_BIN(pipeline), cmdlinebin);
+        // the command line sends RTP to the udpsink address, there is no appsink to fan out.
+        config_data.app_sink = FALSE;
+        config_data.webrtc.single_pipeline = FALSE;
+        config_data.webrtc.thread_budget = 0;
         return pipeline;
     }
 
@@ -3165,6 +5187,7 @@ GstElement *create_instance() {
         _initial_device();
 
     // start_av_fakesink();
+    building_branch = SCHED_RECORD;
     if (config_data.splitfile_sink.enable)
         splitfile_sink();
 
@@ -3172,9 +5195,15 @@ GstElement *create_instance() {
     if (config_data.udp.enable)
         udp_multicastsink();
 
+    // the motion clips and the record command of the WebRTC peers.
+    if (config_data.motion_rec || config_data.webrtc.enable)
+        start_record_bin();
+
+    building_branch = SCHED_HLS;
     if (config_data.hls_onoff.av_hlssink)
         av_hlssink();
 
+    building_branch = SCHED_ANALYTICS;
     if (config_data.hls_onoff.edge_hlssink)
         edgedect_hlssink();
 
@@ -3187,12 +5216,33 @@ GstElement *create_instance() {
     if (config_data.hls_onoff.motion_hlssink) {
         motion_hlssink();
     }
+    // and the peers of the single pipeline, added later.
+    building_branch = SCHED_WEBRTC;
+    if (config_data.webrtc.enable && config_data.webrtc.dtls.shared)
+        dtls_cert_start(config_data.webrtc.dtls.rotate_days);
+
     if (config_data.app_sink) {
         start_av_appsink();
+        if (config_data.webrtc.enable && !config_data.webrtc.single_pipeline)
+            start_send_pool();
+    } else if (config_data.webrtc.simulcast.enable) {
+        g_print("simulcast needs the app_sink fan-out, only the full layer will be sent.\n");
     }
 
-    if (config_data.webrtc.enable)
+    // the peers past the thread budget join it too.
+    if (config_data.webrtc.enable && (config_data.webrtc.single_pipeline || config_data.webrtc.thread_budget > 0))
+        start_av_fsink();
+
+    // the udpsrc consumers need it without the app_sink fan-out, otherwise it is only for the external ones.
+    if (config_data.webrtc.enable && ((!config_data.app_sink && !config_data.webrtc.single_pipeline) ||
+                                      config_data.webrtc.udpsink.enable))
         start_av_udpsink();
 
+    // nobody is connected yet.
+    g_mutex_lock(&demand_lock);
+    if (encoder_demand == 0 && can_park_pipeline() && !park_timer)
+        park_timer = g_timeout_add_seconds(PARK_DELAY, park_pipeline, NULL);
+    g_mutex_unlock(&demand_lock);
+
     return pipeline;
 }
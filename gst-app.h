@@ -41,10 +41,29 @@ create_instance();
 void start_udpsrc_webrtcbin(WebrtcItem *item);
 void start_appsrc_webrtcbin(WebrtcItem *item);
 void start_webrtcbin(WebrtcItem *item);
+void start_budget_webrtcbin(WebrtcItem *item);
 
-void udpsrc_cmd_rec_start(gpointer user_data);
-void udpsrc_cmd_rec_stop(gpointer user_data);
-int get_record_state(void);
+/**
+ * @brief The concurrent recordings, each one a muxer on the encoded stream of the WebRTC
+ * rendition. Only called from the main loop.
+ */
+#define RECORD_OWNER_PEER "peer"     // "peer-<hash id>".
+#define RECORD_OWNER_MOTION "motion" // the motion clips.
+
+const gchar *record_session_start(const gchar *name, const gchar *owner);
+gboolean record_session_stop(const gchar *name, const gchar *owner);
+guint record_session_stop_owner(const gchar *owner);
+
+typedef struct {
+    gchar *name;
+    gchar *owner;
+    gchar *path;
+    gint64 start_time; // unix time.
+    gsize bytes;       // written to the file.
+    gsize dropped;     // buffers of the stream not in the file.
+} RecordSessionStats;
+
+GArray *get_record_sessions(void); // of RecordSessionStats, g_array_unref() frees them.
 
 int splitfile_sink();
 int av_hlssink();
@@ -56,8 +75,52 @@ int cvtracker_hlssink();
 int facedetect_hlssink();
 int edgedect_hlssink();
 
+typedef struct {
+    gsize samples;        // buffers pulled from the appsinks.
+    gsize shared;         // pushed as they are, already in running time.
+    gsize rebased;        // new buffer header in running time, sharing the memory.
+    gsize payload_copies; // the memory could not be shared.
+    gsize pushes;         // push-buffer to the subscribers.
+    guint subscribers;
+} FanoutStats;
+
+void get_fanout_stats(FanoutStats *stats);
+
+typedef struct {
+    guint max_ms;
+    gsize congestions;       // peers over max_ms of video backlog.
+    gsize drops;             // video packets dropped until their keyframe.
+    gsize keyframe_requests;
+} ClientQueueStats;
+
+void get_client_queue_stats(ClientQueueStats *stats);
+
+typedef struct {
+    guint process; // all the threads of the process.
+    guint main;    // streaming threads of the main pipeline, with the peers of the single pipeline.
+    guint send;    // of the peer send pipelines.
+    guint recv;
+    guint record;
+    guint budget;  // webrtc.thread_budget of send, 0 is unlimited.
+    guint reserved; // of the budget, by the peers whose threads may not have entered yet.
+    guint pipeline_peers; // the peers with a send pipeline.
+    guint single;  // the part of main in the webrtcbins and queues of the single pipeline peers.
+    guint single_peers;
+} ThreadStats;
+
+void get_thread_stats(ThreadStats *stats);
+
+typedef struct {
+    gint size;   // pipelines kept in READY.
+    gint ready;  // in the pool now.
+    gsize hits;  // connections that claimed a pooled pipeline.
+    gsize misses; // connections that had to build one.
+    gsize built; // pipelines built by the pool.
+} SendPoolStats;
+
+void get_send_pool_stats(SendPoolStats *stats);
+
 gchar *get_shellcmd_results(const gchar *shellcmd);
-GThread *start_inotify_thread(void);
 
 GstStateChangeReturn start_app();
 
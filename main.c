@@ -30,6 +30,7 @@
 #include "sql.h"
 #include "v4l2ctl.h"
 #include "common_priv.h"
+#include "thread_sched.h"
 
 static GMainLoop *loop;
 static GstElement *pipeline;
@@ -43,8 +44,6 @@ static const gchar *video_encodecs[] = {
 
 static gchar *config_path;
 
-// static GThread *inotify_watch = NULL;
-
 static void _get_cpuid() {
     // refer from https://en.wikipedia.org/wiki/CPUID#EAX=3:_Processor_Serial_Number
     // https://wiki.osdev.org/CPUID
@@ -119,10 +118,6 @@ message_cb(GstBus *bus, GstMessage *message, gpointer user_data) {
                     gst_element_state_get_name(old_state), gst_element_state_get_name(new_state));
             GST_DEBUG_BIN_TO_DOT_FILE(GST_BIN(pipeline),
                                       GST_DEBUG_GRAPH_SHOW_ALL, gst_element_state_get_name(new_state));
-            if (new_state == GST_STATE_PLAYING) {
-                if (inotify_watch == NULL && config_data.app_sink && config_data.hls_onoff.motion_hlssink && config_data.motion_rec)
-                    inotify_watch = start_inotify_thread();
-            }
             break;
         }
     default:
@@ -182,7 +177,8 @@ static void read_config_json(gchar *fullpath) {
         config_data.splitfile_sink.max_files = json_object_get_int_member(object, "max_files");
         config_data.splitfile_sink.max_size_time = json_object_get_int_member(object, "max_size_time");
     }
-    config_data.app_sink = json_object_get_boolean_member(root_obj, "app_sink");
+    // the in-process fan-out is the default, the loopback udpsink hop is only kept with "app_sink": false.
+    config_data.app_sink = json_object_get_boolean_member_with_default(root_obj, "app_sink", TRUE);
     object = json_object_get_object_member(root_obj, "hls_onoff");
 
     config_data.hls_onoff.av_hlssink = json_object_get_boolean_member(object, "av_hlssink");
@@ -205,6 +201,22 @@ static void read_config_json(gchar *fullpath) {
         gst_println("Unsupported video encoding, please use the default h264. ");
         config_data.videnc = "h264";
     }
+
+    config_data.encoder.software.sliced_threads = TRUE;
+    config_data.encoder.software.vbv_ms = 300;
+    if (json_object_has_member(root_obj, "encoder")) {
+        object = json_object_get_object_member(root_obj, "encoder");
+        config_data.encoder.probe = json_object_get_boolean_member_with_default(object, "probe", FALSE);
+        if (json_object_has_member(object, "software")) {
+            JsonObject *sw_obj = json_object_get_object_member(object, "software");
+            const gchar *name = json_object_get_string_member_with_default(sw_obj, "name", "");
+            if (name[0] != '\0')
+                config_data.encoder.software.name = g_strdup(name);
+            config_data.encoder.software.threads = json_object_get_int_member_with_default(sw_obj, "threads", 0);
+            config_data.encoder.software.sliced_threads = json_object_get_boolean_member_with_default(sw_obj, "sliced_threads", TRUE);
+            config_data.encoder.software.vbv_ms = json_object_get_int_member_with_default(sw_obj, "vbv_ms", 300);
+        }
+    }
     const gchar *tpath = json_object_get_string_member(root_obj, "rootdir");
     if (tpath[0] == '~') {
         config_data.root_dir = g_strconcat("/home/", g_getenv("USER"), &tpath[1], NULL);
@@ -224,8 +236,30 @@ static void read_config_json(gchar *fullpath) {
     config_data.sysinfo = json_object_get_boolean_member(root_obj, "sysinfo");
 
     config_data.rec_len = json_object_get_int_member(root_obj, "rec_len");
+    config_data.rec_sessions = json_object_get_int_member_with_default(root_obj, "rec_sessions", 2);
     config_data.clients = json_object_get_int_member(root_obj, "clients");
     config_data.motion_rec = json_object_get_boolean_member(root_obj, "motion_rec");
+    config_data.park_idle = json_object_get_boolean_member_with_default(root_obj, "park_idle", FALSE);
+    if (json_object_has_member(root_obj, "preroll")) {
+        object = json_object_get_object_member(root_obj, "preroll");
+        config_data.preroll.seconds = json_object_get_int_member_with_default(object, "seconds", 0);
+        config_data.preroll.max_kb = json_object_get_int_member_with_default(object, "max_kb", 8192);
+    }
+
+    if (json_object_has_member(root_obj, "sched")) {
+        object = json_object_get_object_member(root_obj, "sched");
+        for (gint i = 0; i < SCHED_BRANCHES; i++) {
+            const gchar *name = thread_sched_branch_name(i);
+            JsonObject *branch_obj;
+            if (!json_object_has_member(object, name))
+                continue;
+            branch_obj = json_object_get_object_member(object, name);
+            config_data.sched[i].cpus = g_strdup(json_object_get_string_member_with_default(branch_obj, "cpus", ""));
+            config_data.sched[i].fifo = !g_strcmp0(json_object_get_string_member_with_default(branch_obj, "policy", "other"), "fifo");
+            config_data.sched[i].priority = json_object_get_int_member_with_default(branch_obj, "priority", 1);
+            config_data.sched[i].nice = json_object_get_int_member_with_default(branch_obj, "nice", 0);
+        }
+    }
 
     object = json_object_get_object_member(root_obj, "audio");
     config_data.audio.path = json_object_get_int_member(object, "path");
@@ -252,6 +286,50 @@ static void read_config_json(gchar *fullpath) {
     config_data.hls.files = json_object_get_int_member(object, "files");
     config_data.hls.showtext = json_object_get_boolean_member(object, "showtext");
 
+    config_data.analytics.width = 320;
+    config_data.analytics.height = 240;
+    config_data.analytics.format = g_strdup("RGB");
+    config_data.analytics.framerate = 5;
+    if (json_object_has_member(root_obj, "analytics")) {
+        object = json_object_get_object_member(root_obj, "analytics");
+        config_data.analytics.width = json_object_get_int_member_with_default(object, "width", 320);
+        config_data.analytics.height = json_object_get_int_member_with_default(object, "height", 240);
+        g_free(config_data.analytics.format);
+        config_data.analytics.format = g_strdup(json_object_get_string_member_with_default(object, "format", "RGB"));
+        config_data.analytics.framerate = json_object_get_int_member_with_default(object, "framerate", 5);
+    }
+
+    config_data.motion.sensitivity = 50;
+    config_data.motion.block = 16;
+    config_data.motion.min_blocks = 2;
+    config_data.motion.hold_ms = 3000;
+    config_data.motion.debounce_ms = 500;
+    config_data.motion.postroll_s = 5;
+    if (json_object_has_member(root_obj, "motion")) {
+        object = json_object_get_object_member(root_obj, "motion");
+        config_data.motion.sensitivity = json_object_get_int_member_with_default(object, "sensitivity", 50);
+        config_data.motion.block = json_object_get_int_member_with_default(object, "block", 16);
+        config_data.motion.min_blocks = json_object_get_int_member_with_default(object, "min_blocks", 2);
+        config_data.motion.hold_ms = json_object_get_int_member_with_default(object, "hold_ms", 3000);
+        config_data.motion.debounce_ms = json_object_get_int_member_with_default(object, "debounce_ms", 500);
+        config_data.motion.postroll_s = json_object_get_int_member_with_default(object, "postroll_s", 5);
+        if (json_object_has_member(object, "zones")) {
+            // [x, y, width, height] in percents of the frame.
+            JsonArray *zones = json_object_get_array_member(object, "zones");
+            guint n = MIN(json_array_get_length(zones), MOTION_MAX_ZONES);
+            for (guint i = 0; i < n; i++) {
+                JsonArray *zone = json_array_get_array_element(zones, i);
+                if (!zone || json_array_get_length(zone) != 4)
+                    continue;
+                config_data.motion.zones[config_data.motion.n_zones].x = json_array_get_int_element(zone, 0);
+                config_data.motion.zones[config_data.motion.n_zones].y = json_array_get_int_element(zone, 1);
+                config_data.motion.zones[config_data.motion.n_zones].width = json_array_get_int_element(zone, 2);
+                config_data.motion.zones[config_data.motion.n_zones].height = json_array_get_int_element(zone, 3);
+                config_data.motion.n_zones++;
+            }
+        }
+    }
+
     object = json_object_get_object_member(root_obj, "webrtc");
     if (object) {
         // "stun://stun.l.google.com:19302"
@@ -267,6 +345,54 @@ static void read_config_json(gchar *fullpath) {
         config_data.webrtc.udpsink.port = json_object_get_int_member(turn_obj, "port");
         config_data.webrtc.udpsink.addr = g_strdup(json_object_get_string_member(turn_obj, "addr"));
         config_data.webrtc.udpsink.multicast = json_object_get_boolean_member(turn_obj, "multicast");
+        config_data.webrtc.udpsink.enable = json_object_get_boolean_member_with_default(turn_obj, "enable", FALSE);
+
+        if (json_object_has_member(object, "abr")) {
+            JsonObject *abr_obj = json_object_get_object_member(object, "abr");
+            config_data.webrtc.abr.enable = json_object_get_boolean_member_with_default(abr_obj, "enable", FALSE);
+            config_data.webrtc.abr.min_kbps = json_object_get_int_member_with_default(abr_obj, "min_kbps", 150);
+            config_data.webrtc.abr.max_kbps = json_object_get_int_member_with_default(abr_obj, "max_kbps", 0);
+            config_data.webrtc.abr.max_rtt = json_object_get_int_member_with_default(abr_obj, "max_rtt", 400);
+            config_data.webrtc.abr.interval = json_object_get_int_member_with_default(abr_obj, "interval", 1000);
+        }
+
+        if (json_object_has_member(object, "simulcast")) {
+            JsonObject *sim_obj = json_object_get_object_member(object, "simulcast");
+            config_data.webrtc.simulcast.enable = json_object_get_boolean_member_with_default(sim_obj, "enable", FALSE);
+            if (json_object_has_member(sim_obj, "layers")) {
+                JsonArray *layers = json_object_get_array_member(sim_obj, "layers");
+                int count = MIN(json_array_get_length(layers), MAX_VIDEO_LAYERS - 1);
+                for (int i = 0; i < count; i++) {
+                    int scale = json_array_get_int_element(layers, i);
+                    if (scale > 1)
+                        config_data.webrtc.simulcast.layers[config_data.webrtc.simulcast.count++] = scale;
+                }
+            }
+        }
+
+        config_data.webrtc.temporal_layers = json_object_get_int_member_with_default(object, "temporal_layers", 0);
+
+        config_data.webrtc.single_pipeline = json_object_get_boolean_member_with_default(object, "single_pipeline", FALSE);
+        config_data.webrtc.thread_budget = json_object_get_int_member_with_default(object, "thread_budget", 0);
+        if (json_object_has_member(object, "client_queue")) {
+            JsonObject *queue_obj = json_object_get_object_member(object, "client_queue");
+            config_data.webrtc.client_queue.max_ms = json_object_get_int_member_with_default(queue_obj, "max_ms", 500);
+        }
+        if (json_object_has_member(object, "dtls")) {
+            JsonObject *dtls_obj = json_object_get_object_member(object, "dtls");
+            config_data.webrtc.dtls.shared = json_object_get_boolean_member_with_default(dtls_obj, "shared", FALSE);
+            config_data.webrtc.dtls.rotate_days = json_object_get_int_member_with_default(dtls_obj, "rotate_days", 30);
+        }
+        if (json_object_has_member(object, "pool")) {
+            JsonObject *pool_obj = json_object_get_object_member(object, "pool");
+            config_data.webrtc.pool.size = json_object_get_int_member_with_default(pool_obj, "size", 0);
+            config_data.webrtc.pool.refill_delay = json_object_get_int_member_with_default(pool_obj, "refill_delay", 0);
+        }
+        if (json_object_has_member(object, "gop_cache")) {
+            JsonObject *gop_obj = json_object_get_object_member(object, "gop_cache");
+            config_data.webrtc.gop_cache.enable = json_object_get_boolean_member_with_default(gop_obj, "enable", FALSE);
+            config_data.webrtc.gop_cache.max_kb = json_object_get_int_member_with_default(gop_obj, "max_kb", 4096);
+        }
     }
     g_object_unref(parser);
 }
@@ -460,6 +586,7 @@ int main(int argc, char *argv[]) {
     gst_segtrap_set_enabled(TRUE);
     loop = g_main_loop_new(NULL, FALSE);
 
+    thread_sched_init();
     pipeline = create_instance();
     /* this enables messages of individual elements inside the pipeline */
     // g_object_set(pipeline, "message-forward", TRUE, NULL);
@@ -478,14 +605,18 @@ int main(int argc, char *argv[]) {
     g_free(version_utf8);
 
     // webrtcbin priority use appsink.
-    if (config_data.app_sink) {
+    if (config_data.webrtc.single_pipeline) {
+        start_http(&start_webrtcbin, config_data.http.port, config_data.clients);
+    } else if (config_data.webrtc.thread_budget > 0) {
+        start_http(&start_budget_webrtcbin, config_data.http.port, config_data.clients);
+    } else if (config_data.app_sink) {
         start_http(&start_appsrc_webrtcbin, config_data.http.port, config_data.clients);
     } else {
         start_http(&start_udpsrc_webrtcbin, config_data.http.port, config_data.clients);
     }
 
-    // start_http(&start_webrtcbin, config_data.http.port);
-
+    // the HTTP server and the threads started from here on, the streaming ones are set again as they enter.
+    thread_sched_apply(SCHED_HTTP, NULL);
     g_main_loop_run(loop);
     gst_element_set_state(pipeline, GST_STATE_NULL);
 
@@ -0,0 +1,240 @@
+/* gst-webrtc-camera
+ * Copyright (C) 2023 chunyang liu <yjdwbj@gmail.com>
+ *
+ *
+ * motion.c:  block differencing motion detector
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+#include "motion.h"
+#include <gst/video/video.h>
+#include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+extern GstConfigData config_data;
+
+/**
+ * @brief motioncells converts every frame to an OpenCV matrix and reports through a datafile.
+ * Here only the Y plane is read, the sum of absolute differences of each block against the previous
+ * frame is compared to a threshold, and the result is posted on the bus.
+ */
+typedef struct {
+    GstElement *element;
+    GstVideoInfo info;
+    gboolean has_info;
+    guint8 *prev; // the Y plane of the previous frame, width bytes per row.
+    gint block;
+    gint cols;
+    gint rows;
+    guint32 *sads;     // one per block.
+    gboolean *mask;    // the blocks inside a zone.
+    guint32 threshold; // block SAD above which the block moves.
+    gboolean active;
+    gint64 last_motion;
+} Motion;
+
+// the sum of absolute differences of n bytes, n a multiple of 8.
+static inline guint32 sad_row(const guint8 *a, const guint8 *b, gint n) {
+    guint32 sad = 0;
+    gint i = 0;
+#if defined(__SSE2__)
+    __m128i acc = _mm_setzero_si128();
+    for (; i + 16 <= n; i += 16)
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(a + i)),
+                                              _mm_loadu_si128((const __m128i *)(b + i))));
+    for (; i + 8 <= n; i += 8)
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadl_epi64((const __m128i *)(a + i)),
+                                              _mm_loadl_epi64((const __m128i *)(b + i))));
+    sad = _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+#elif defined(__ARM_NEON)
+    uint16x8_t acc = vdupq_n_u16(0);
+    // 16 bit lanes, at most 255 * 2 per lane each step, n up to 2048 before they could wrap.
+    for (; i + 16 <= n; i += 16)
+        acc = vpadalq_u8(acc, vabdq_u8(vld1q_u8(a + i), vld1q_u8(b + i)));
+    for (; i + 8 <= n; i += 8)
+        acc = vaddw_u8(acc, vabd_u8(vld1_u8(a + i), vld1_u8(b + i)));
+    uint32x4_t sum4 = vpaddlq_u16(acc);
+    uint64x2_t sum2 = vpaddlq_u32(sum4);
+    sad = (guint32)(vgetq_lane_u64(sum2, 0) + vgetq_lane_u64(sum2, 1));
+#endif
+    for (; i < n; i++)
+        sad += ABS((gint)a[i] - (gint)b[i]);
+    return sad;
+}
+
+static void reset_motion(Motion *motion, GstCaps *caps) {
+    gint width, height;
+    struct _motion_data *cfg = &config_data.motion;
+
+    g_free(motion->prev);
+    g_free(motion->sads);
+    g_free(motion->mask);
+    motion->prev = NULL;
+    motion->sads = NULL;
+    motion->mask = NULL;
+    motion->has_info = gst_video_info_from_caps(&motion->info, caps);
+    if (!motion->has_info)
+        return;
+    switch (GST_VIDEO_INFO_FORMAT(&motion->info)) {
+    case GST_VIDEO_FORMAT_GRAY8:
+    case GST_VIDEO_FORMAT_I420:
+    case GST_VIDEO_FORMAT_YV12:
+    case GST_VIDEO_FORMAT_NV12:
+        break;
+    default:
+        g_printerr("motion detector needs an 8 bit Y plane, not %s.\n",
+                   gst_video_format_to_string(GST_VIDEO_INFO_FORMAT(&motion->info)));
+        motion->has_info = FALSE;
+        return;
+    }
+
+    width = GST_VIDEO_INFO_WIDTH(&motion->info);
+    height = GST_VIDEO_INFO_HEIGHT(&motion->info);
+    motion->block = MAX(cfg->block / 8 * 8, 8);
+    motion->cols = width / motion->block;
+    motion->rows = height / motion->block;
+    if (!motion->cols || !motion->rows) {
+        motion->has_info = FALSE;
+        return;
+    }
+    motion->sads = g_new0(guint32, motion->cols * motion->rows);
+    motion->mask = g_new0(gboolean, motion->cols * motion->rows);
+    // the mean difference per pixel, from 40 levels at sensitivity 1 down to 2 at 100.
+    motion->threshold = (2 + (100 - CLAMP(cfg->sensitivity, 1, 100)) * 38 / 99) * motion->block * motion->block;
+
+    for (gint r = 0; r < motion->rows; r++) {
+        for (gint c = 0; c < motion->cols; c++) {
+            // a block belongs to the zone its center is in.
+            gint cx = (c * motion->block + motion->block / 2) * 100 / width;
+            gint cy = (r * motion->block + motion->block / 2) * 100 / height;
+            gboolean in = cfg->n_zones == 0;
+            for (guint z = 0; z < cfg->n_zones && !in; z++) {
+                const struct _motion_zone *zone = &cfg->zones[z];
+                in = cx >= zone->x && cx < zone->x + zone->width && cy >= zone->y && cy < zone->y + zone->height;
+            }
+            motion->mask[r * motion->cols + c] = in;
+        }
+    }
+}
+
+static void post_motion(Motion *motion, const gchar *event, gint left, gint top, gint right, gint bottom, guint blocks) {
+    GstStructure *s;
+
+    s = gst_structure_new(MOTION_MESSAGE,
+                          "event", G_TYPE_STRING, event,
+                          "x", G_TYPE_INT, left * motion->block,
+                          "y", G_TYPE_INT, top * motion->block,
+                          "width", G_TYPE_INT, (right - left + 1) * motion->block,
+                          "height", G_TYPE_INT, (bottom - top + 1) * motion->block,
+                          "blocks", G_TYPE_UINT, blocks, NULL);
+    gst_element_post_message(motion->element, gst_message_new_element(GST_OBJECT(motion->element), s));
+}
+
+static void detect_motion(Motion *motion, GstVideoFrame *frame) {
+    const guint8 *y_plane = GST_VIDEO_FRAME_COMP_DATA(frame, 0);
+    gint stride = GST_VIDEO_FRAME_COMP_STRIDE(frame, 0);
+    gint width = GST_VIDEO_FRAME_COMP_WIDTH(frame, 0);
+    gint height = GST_VIDEO_FRAME_COMP_HEIGHT(frame, 0);
+    gint span = motion->cols * motion->block;
+    gint left = G_MAXINT, top = G_MAXINT, right = -1, bottom = -1;
+    guint blocks = 0;
+    gint64 now = g_get_monotonic_time();
+
+    if (!motion->prev) {
+        motion->prev = g_malloc(width * height);
+        for (gint y = 0; y < height; y++)
+            memcpy(motion->prev + y * width, y_plane + y * stride, width);
+        return;
+    }
+
+    memset(motion->sads, 0, motion->cols * motion->rows * sizeof(guint32));
+    for (gint y = 0; y < motion->rows * motion->block; y++) {
+        const guint8 *cur = y_plane + y * stride;
+        guint8 *prev = motion->prev + y * width;
+        guint32 *sads = motion->sads + (y / motion->block) * motion->cols;
+        for (gint c = 0; c < motion->cols; c++)
+            sads[c] += sad_row(cur + c * motion->block, prev + c * motion->block, motion->block);
+        memcpy(prev, cur, span);
+    }
+
+    for (gint r = 0; r < motion->rows; r++) {
+        for (gint c = 0; c < motion->cols; c++) {
+            gint i = r * motion->cols + c;
+            if (!motion->mask[i] || motion->sads[i] <= motion->threshold)
+                continue;
+            blocks++;
+            left = MIN(left, c);
+            right = MAX(right, c);
+            top = MIN(top, r);
+            bottom = MAX(bottom, r);
+        }
+    }
+
+    if (blocks >= (guint)MAX(config_data.motion.min_blocks, 1)) {
+        post_motion(motion, motion->active ? "update" : "start", left, top, right, bottom, blocks);
+        motion->active = TRUE;
+        motion->last_motion = now;
+    } else if (motion->active && now - motion->last_motion > (gint64)config_data.motion.hold_ms * 1000) {
+        motion->active = FALSE;
+        post_motion(motion, "stop", 0, 0, -1, -1, 0);
+    }
+}
+
+static GstPadProbeReturn motion_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    Motion *motion = (Motion *)user_data;
+    GstVideoFrame frame;
+
+    if (GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM) {
+        GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
+        if (GST_EVENT_TYPE(event) == GST_EVENT_CAPS) {
+            GstCaps *caps;
+            gst_event_parse_caps(event, &caps);
+            reset_motion(motion, caps);
+        }
+        return GST_PAD_PROBE_OK;
+    }
+
+    if (!motion->has_info)
+        return GST_PAD_PROBE_OK;
+    if (gst_video_frame_map(&frame, &motion->info, GST_PAD_PROBE_INFO_BUFFER(info), GST_MAP_READ)) {
+        detect_motion(motion, &frame);
+        gst_video_frame_unmap(&frame);
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+static void motion_free(gpointer user_data) {
+    Motion *motion = (Motion *)user_data;
+    g_free(motion->prev);
+    g_free(motion->sads);
+    g_free(motion->mask);
+    g_free(motion);
+}
+
+void motion_attach(GstElement *element) {
+    Motion *motion = g_new0(Motion, 1);
+    GstPad *pad;
+
+    motion->element = element;
+    pad = gst_element_get_static_pad(element, "src");
+    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+                      motion_probe, motion, motion_free);
+    gst_object_unref(pad);
+}
@@ -0,0 +1,39 @@
+/* gst-webrtc-camera
+ * Copyright (C) 2023 chunyang liu <yjdwbj@gmail.com>
+ *
+ *
+ * motion.h:  block differencing motion detector
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+#ifndef _MOTION_H
+#define _MOTION_H
+#include "data_struct.h"
+#include <gst/gst.h>
+
+// the element message of the detector, see motion_attach().
+#define MOTION_MESSAGE "motion-detect"
+
+/**
+ * @brief Detect motion in the frames leaving the src pad of the element, GRAY8, I420, YV12 or NV12,
+ * by differencing the Y plane of each frame with the one before in blocks of config_data.motion.block.
+ * The element posts a MOTION_MESSAGE element message with "event" "start", "update" while the motion
+ * lasts and "stop" after hold_ms without it, and the bounding box of the moving blocks in frame pixels
+ * as "x", "y", "width", "height" and "blocks".
+ */
+void motion_attach(GstElement *element);
+
+#endif // _MOTION_H
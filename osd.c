@@ -0,0 +1,429 @@
+/* gst-webrtc-camera
+ * Copyright (C) 2023 chunyang liu <yjdwbj@gmail.com>
+ *
+ *
+ * osd.c:  clock, sysinfo and detection overlay
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+#include "osd.h"
+#include <gst/video/video.h>
+#include <pango/pangocairo.h>
+#include <string.h>
+#include <time.h>
+
+#define OSD_FONT "Sans 10"
+#define OSD_PAD 25    // the default xpad/ypad of textoverlay.
+#define OSD_OUTLINE 2 // pixels of the black outline.
+#define OSD_BOX_LINE 3 // pixels of the detection outline.
+#define OSD_REPORT_FRAMES 300 // the cost per frame is printed once, after them.
+
+/**
+ * @brief textoverlay and clockoverlay render the text with pango and blend the whole frame on every buffer.
+ * Here the text is only rasterized when it changes, once a second for the clock and once for the sysinfo,
+ * into premultiplied ARGB rectangles that are blended over their own area of the frame.
+ *
+ * The source tee pushes the same frame to every branch, so the frame is blended in place only
+ * when this branch owns it. Otherwise it is copied once into a frame of the pool of the OSD,
+ * and blended there, no frame is allocated after the first ones.
+ */
+typedef struct {
+    gchar *sysinfo;
+    PangoContext *context;
+    PangoFontDescription *font;
+    GstVideoOverlayRectangle *sysinfo_rect;
+    GstVideoOverlayRectangle *clock_rect;
+    GstVideoOverlayComposition *comp;
+    GstVideoInfo info;
+    gboolean has_info;
+    time_t last_second;
+    GstBufferPool *pool;
+    guint frames;
+    guint copies;
+    gint64 cost; // microseconds of the frames so far.
+} Osd;
+
+static GstVideoOverlayRectangle *render_text(Osd *osd, const gchar *text, gboolean bottom) {
+    PangoLayout *layout;
+    PangoRectangle logical;
+    GstVideoOverlayRectangle *rect;
+    GstBuffer *buffer;
+    GstMapInfo map;
+    cairo_surface_t *surface;
+    cairo_t *cr;
+    gint width, height, x, y;
+
+    layout = pango_layout_new(osd->context);
+    pango_layout_set_font_description(layout, osd->font);
+    pango_layout_set_text(layout, text, -1);
+    pango_layout_get_pixel_extents(layout, NULL, &logical);
+
+    width = logical.width + 2 * OSD_OUTLINE;
+    height = logical.height + 2 * OSD_OUTLINE;
+    x = OSD_PAD;
+    y = bottom ? GST_VIDEO_INFO_HEIGHT(&osd->info) - height - OSD_PAD : OSD_PAD;
+    if (width <= 0 || height <= 0 || y < 0) {
+        g_object_unref(layout);
+        return NULL;
+    }
+
+    // cairo ARGB32 is the same memory layout as GST_VIDEO_OVERLAY_COMPOSITION_FORMAT_RGB.
+    buffer = gst_buffer_new_allocate(NULL, width * height * 4, NULL);
+    gst_buffer_add_video_meta(buffer, GST_VIDEO_FRAME_FLAG_NONE,
+                              GST_VIDEO_OVERLAY_COMPOSITION_FORMAT_RGB, width, height);
+    gst_buffer_map(buffer, &map, GST_MAP_WRITE);
+    memset(map.data, 0, map.size);
+    surface = cairo_image_surface_create_for_data(map.data, CAIRO_FORMAT_ARGB32, width, height, width * 4);
+    cr = cairo_create(surface);
+    cairo_translate(cr, OSD_OUTLINE - logical.x, OSD_OUTLINE - logical.y);
+    pango_cairo_update_layout(cr, layout);
+    pango_cairo_layout_path(cr, layout);
+    cairo_set_source_rgb(cr, 0, 0, 0);
+    cairo_set_line_width(cr, OSD_OUTLINE * 2);
+    cairo_stroke_preserve(cr);
+    cairo_set_source_rgb(cr, 1, 1, 1);
+    cairo_fill(cr);
+    cairo_destroy(cr);
+    cairo_surface_destroy(surface);
+    gst_buffer_unmap(buffer, &map);
+    g_object_unref(layout);
+
+    rect = gst_video_overlay_rectangle_new_raw(buffer, x, y, width, height,
+                                               GST_VIDEO_OVERLAY_FORMAT_FLAG_PREMULTIPLIED_ALPHA);
+    gst_buffer_unref(buffer);
+    return rect;
+}
+
+static void update_composition(Osd *osd) {
+    if (osd->comp)
+        gst_video_overlay_composition_unref(osd->comp);
+    osd->comp = NULL;
+
+    if (osd->clock_rect) {
+        osd->comp = gst_video_overlay_composition_new(osd->clock_rect);
+        if (osd->sysinfo_rect)
+            gst_video_overlay_composition_add_rectangle(osd->comp, osd->sysinfo_rect);
+    } else if (osd->sysinfo_rect) {
+        osd->comp = gst_video_overlay_composition_new(osd->sysinfo_rect);
+    }
+}
+
+static void update_clock(Osd *osd, time_t now) {
+    gchar text[64];
+    struct tm tm;
+
+    localtime_r(&now, &tm);
+    strftime(text, sizeof(text), "%D %H:%M:%S", &tm);
+    if (osd->clock_rect)
+        gst_video_overlay_rectangle_unref(osd->clock_rect);
+    osd->clock_rect = render_text(osd, text, FALSE);
+    osd->last_second = now;
+    update_composition(osd);
+}
+
+static void reset_pool(Osd *osd, GstCaps *caps) {
+    GstStructure *config;
+
+    if (osd->pool) {
+        gst_buffer_pool_set_active(osd->pool, FALSE);
+        gst_object_unref(osd->pool);
+        osd->pool = NULL;
+    }
+    if (!osd->has_info)
+        return;
+    osd->pool = gst_video_buffer_pool_new();
+    config = gst_buffer_pool_get_config(osd->pool);
+    gst_buffer_pool_config_set_params(config, caps, GST_VIDEO_INFO_SIZE(&osd->info), 2, 0);
+    if (!gst_buffer_pool_set_config(osd->pool, config) || !gst_buffer_pool_set_active(osd->pool, TRUE)) {
+        gst_object_unref(osd->pool);
+        osd->pool = NULL;
+    }
+}
+
+static void reset_info(Osd *osd, GstCaps *caps) {
+    osd->has_info = gst_video_info_from_caps(&osd->info, caps);
+    reset_pool(osd, caps);
+    if (osd->sysinfo_rect)
+        gst_video_overlay_rectangle_unref(osd->sysinfo_rect);
+    osd->sysinfo_rect = NULL;
+    if (osd->has_info && osd->sysinfo)
+        osd->sysinfo_rect = render_text(osd, osd->sysinfo, TRUE);
+    // the clock is rendered again at the next buffer.
+    osd->last_second = 0;
+}
+
+// the frame of another branch, into one of the pool. Returns NULL without the pool.
+static GstBuffer *copy_frame(Osd *osd, GstBuffer *buffer) {
+    GstBuffer *out = NULL;
+    GstVideoFrame src, dst;
+
+    if (!osd->pool || gst_buffer_pool_acquire_buffer(osd->pool, &out, NULL) != GST_FLOW_OK)
+        return NULL;
+    if (!gst_video_frame_map(&src, &osd->info, buffer, GST_MAP_READ)) {
+        gst_buffer_unref(out);
+        return NULL;
+    }
+    if (!gst_video_frame_map(&dst, &osd->info, out, GST_MAP_WRITE)) {
+        gst_video_frame_unmap(&src);
+        gst_buffer_unref(out);
+        return NULL;
+    }
+    gst_video_frame_copy(&dst, &src);
+    gst_video_frame_unmap(&dst);
+    gst_video_frame_unmap(&src);
+    gst_buffer_copy_into(out, buffer, GST_BUFFER_COPY_FLAGS | GST_BUFFER_COPY_TIMESTAMPS, 0, -1);
+    gst_buffer_unref(buffer);
+    osd->copies++;
+    return out;
+}
+
+static GstPadProbeReturn osd_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    Osd *osd = (Osd *)user_data;
+    GstVideoFrame frame;
+    GstBuffer *buffer;
+    gint64 start;
+    time_t now;
+
+    if (GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM) {
+        GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
+        if (GST_EVENT_TYPE(event) == GST_EVENT_CAPS) {
+            GstCaps *caps;
+            gst_event_parse_caps(event, &caps);
+            reset_info(osd, caps);
+        }
+        return GST_PAD_PROBE_OK;
+    }
+
+    if (!osd->has_info)
+        return GST_PAD_PROBE_OK;
+
+    now = time(NULL);
+    if (now != osd->last_second)
+        update_clock(osd, now);
+    if (!osd->comp)
+        return GST_PAD_PROBE_OK;
+
+    start = g_get_monotonic_time();
+    buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+    if (!gst_buffer_is_writable(buffer) || !gst_buffer_is_all_memory_writable(buffer))
+        buffer = copy_frame(osd, buffer);
+    if (buffer) {
+        GST_PAD_PROBE_INFO_DATA(info) = buffer;
+    } else {
+        // no pool, the memory is copied by the map.
+        buffer = gst_buffer_make_writable(GST_PAD_PROBE_INFO_BUFFER(info));
+        GST_PAD_PROBE_INFO_DATA(info) = buffer;
+    }
+    if (gst_video_frame_map(&frame, &osd->info, buffer, GST_MAP_READWRITE)) {
+        gst_video_overlay_composition_blend(osd->comp, &frame);
+        gst_video_frame_unmap(&frame);
+    }
+
+    osd->cost += g_get_monotonic_time() - start;
+    if (++osd->frames == OSD_REPORT_FRAMES)
+        g_print("osd: %dx%d %s, %.3f ms per frame, %u of %u frames copied.\n",
+                GST_VIDEO_INFO_WIDTH(&osd->info), GST_VIDEO_INFO_HEIGHT(&osd->info),
+                gst_video_format_to_string(GST_VIDEO_INFO_FORMAT(&osd->info)),
+                (gdouble)osd->cost / osd->frames / 1000, osd->copies, osd->frames);
+    return GST_PAD_PROBE_OK;
+}
+
+static void osd_free(gpointer user_data) {
+    Osd *osd = (Osd *)user_data;
+    osd->has_info = FALSE;
+    reset_pool(osd, NULL);
+    if (osd->comp)
+        gst_video_overlay_composition_unref(osd->comp);
+    if (osd->clock_rect)
+        gst_video_overlay_rectangle_unref(osd->clock_rect);
+    if (osd->sysinfo_rect)
+        gst_video_overlay_rectangle_unref(osd->sysinfo_rect);
+    pango_font_description_free(osd->font);
+    g_object_unref(osd->context);
+    g_free(osd->sysinfo);
+    g_free(osd);
+}
+
+void osd_attach(GstElement *element, const gchar *sysinfo) {
+    Osd *osd = g_new0(Osd, 1);
+    GstPad *pad;
+
+    osd->sysinfo = g_strdup(sysinfo);
+    osd->context = pango_font_map_create_context(pango_cairo_font_map_get_default());
+    // the same point size as the textoverlay "font-desc".
+    pango_cairo_context_set_resolution(osd->context, 72);
+    osd->font = pango_font_description_from_string(OSD_FONT);
+
+    pad = gst_element_get_static_pad(element, "src");
+    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+                      osd_probe, osd, osd_free);
+    gst_object_unref(pad);
+}
+
+/**
+ * @brief The detectors run on the small analytics frames, their results are drawn here
+ * on the full size video instead of the annotated analytics frames.
+ */
+struct _OsdBoxes {
+    GMutex lock;
+    gint src_width;
+    gint src_height;
+    GstVideoRectangle rects[OSD_BOXES_MAX];
+    guint count;
+    gint64 updated;
+    gboolean dirty;
+    GstVideoOverlayComposition *comp;
+    GstVideoInfo info;
+    gboolean has_info;
+};
+
+static GstVideoOverlayRectangle *render_box(OsdBoxes *boxes, const GstVideoRectangle *src) {
+    GstVideoOverlayRectangle *rect;
+    GstBuffer *buffer;
+    GstMapInfo map;
+    cairo_surface_t *surface;
+    cairo_t *cr;
+    gint frame_width = GST_VIDEO_INFO_WIDTH(&boxes->info);
+    gint frame_height = GST_VIDEO_INFO_HEIGHT(&boxes->info);
+    gint x, y, width, height;
+
+    x = CLAMP((gint64)src->x * frame_width / boxes->src_width, 0, frame_width);
+    y = CLAMP((gint64)src->y * frame_height / boxes->src_height, 0, frame_height);
+    width = MIN((gint64)src->w * frame_width / boxes->src_width, frame_width - x);
+    height = MIN((gint64)src->h * frame_height / boxes->src_height, frame_height - y);
+    if (width <= 2 * OSD_BOX_LINE || height <= 2 * OSD_BOX_LINE)
+        return NULL;
+
+    buffer = gst_buffer_new_allocate(NULL, width * height * 4, NULL);
+    gst_buffer_add_video_meta(buffer, GST_VIDEO_FRAME_FLAG_NONE,
+                              GST_VIDEO_OVERLAY_COMPOSITION_FORMAT_RGB, width, height);
+    gst_buffer_map(buffer, &map, GST_MAP_WRITE);
+    memset(map.data, 0, map.size);
+    surface = cairo_image_surface_create_for_data(map.data, CAIRO_FORMAT_ARGB32, width, height, width * 4);
+    cr = cairo_create(surface);
+    cairo_rectangle(cr, OSD_BOX_LINE / 2.0, OSD_BOX_LINE / 2.0, width - OSD_BOX_LINE, height - OSD_BOX_LINE);
+    cairo_set_source_rgb(cr, 0, 1, 0);
+    cairo_set_line_width(cr, OSD_BOX_LINE);
+    cairo_stroke(cr);
+    cairo_destroy(cr);
+    cairo_surface_destroy(surface);
+    gst_buffer_unmap(buffer, &map);
+
+    rect = gst_video_overlay_rectangle_new_raw(buffer, x, y, width, height,
+                                               GST_VIDEO_OVERLAY_FORMAT_FLAG_PREMULTIPLIED_ALPHA);
+    gst_buffer_unref(buffer);
+    return rect;
+}
+
+static void update_boxes(OsdBoxes *boxes) {
+    GstVideoOverlayRectangle *rect;
+
+    if (boxes->comp)
+        gst_video_overlay_composition_unref(boxes->comp);
+    boxes->comp = NULL;
+    for (guint i = 0; i < boxes->count; i++) {
+        rect = render_box(boxes, &boxes->rects[i]);
+        if (!rect)
+            continue;
+        if (boxes->comp)
+            gst_video_overlay_composition_add_rectangle(boxes->comp, rect);
+        else
+            boxes->comp = gst_video_overlay_composition_new(rect);
+        gst_video_overlay_rectangle_unref(rect);
+    }
+    boxes->dirty = FALSE;
+}
+
+static GstPadProbeReturn boxes_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    OsdBoxes *boxes = (OsdBoxes *)user_data;
+    GstVideoOverlayComposition *comp = NULL;
+    GstVideoFrame frame;
+    GstBuffer *buffer;
+
+    if (GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM) {
+        GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
+        if (GST_EVENT_TYPE(event) == GST_EVENT_CAPS) {
+            GstCaps *caps;
+            gst_event_parse_caps(event, &caps);
+            g_mutex_lock(&boxes->lock);
+            boxes->has_info = gst_video_info_from_caps(&boxes->info, caps);
+            boxes->dirty = TRUE;
+            g_mutex_unlock(&boxes->lock);
+        }
+        return GST_PAD_PROBE_OK;
+    }
+
+    g_mutex_lock(&boxes->lock);
+    if (boxes->count && g_get_monotonic_time() - boxes->updated > OSD_BOXES_TIMEOUT) {
+        boxes->count = 0;
+        boxes->dirty = TRUE;
+    }
+    if (boxes->has_info && boxes->dirty)
+        update_boxes(boxes);
+    if (boxes->comp)
+        comp = gst_video_overlay_composition_ref(boxes->comp);
+    g_mutex_unlock(&boxes->lock);
+    if (!comp)
+        return GST_PAD_PROBE_OK;
+
+    buffer = gst_buffer_make_writable(GST_PAD_PROBE_INFO_BUFFER(info));
+    GST_PAD_PROBE_INFO_DATA(info) = buffer;
+    if (gst_video_frame_map(&frame, &boxes->info, buffer, GST_MAP_READWRITE)) {
+        gst_video_overlay_composition_blend(comp, &frame);
+        gst_video_frame_unmap(&frame);
+    }
+    gst_video_overlay_composition_unref(comp);
+    return GST_PAD_PROBE_OK;
+}
+
+static void boxes_free(gpointer user_data) {
+    OsdBoxes *boxes = (OsdBoxes *)user_data;
+    if (boxes->comp)
+        gst_video_overlay_composition_unref(boxes->comp);
+    g_mutex_clear(&boxes->lock);
+    g_free(boxes);
+}
+
+OsdBoxes *osd_boxes_attach(GstElement *element, gint src_width, gint src_height) {
+    OsdBoxes *boxes;
+    GstPad *pad;
+
+    if (src_width <= 0 || src_height <= 0)
+        return NULL;
+    boxes = g_new0(OsdBoxes, 1);
+    g_mutex_init(&boxes->lock);
+    boxes->src_width = src_width;
+    boxes->src_height = src_height;
+
+    pad = gst_element_get_static_pad(element, "src");
+    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+                      boxes_probe, boxes, boxes_free);
+    gst_object_unref(pad);
+    return boxes;
+}
+
+void osd_boxes_set(OsdBoxes *boxes, const GstVideoRectangle *rects, guint count) {
+    if (!boxes)
+        return;
+    count = MIN(count, OSD_BOXES_MAX);
+    g_mutex_lock(&boxes->lock);
+    if (count)
+        memcpy(boxes->rects, rects, count * sizeof(GstVideoRectangle));
+    boxes->count = count;
+    boxes->updated = g_get_monotonic_time();
+    boxes->dirty = TRUE;
+    g_mutex_unlock(&boxes->lock);
+}
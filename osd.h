@@ -0,0 +1,55 @@
+/* gst-webrtc-camera
+ * Copyright (C) 2023 chunyang liu <yjdwbj@gmail.com>
+ *
+ *
+ * osd.h:  clock, sysinfo and detection overlay
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+#ifndef _OSD_H
+#define _OSD_H
+#include <glib.h>
+#include <gst/gst.h>
+#include <gst/video/video.h>
+
+// the raw formats the overlay blends into.
+#define OSD_VIDEO_CAPS "video/x-raw,format=(string){NV12,I420}"
+
+#define OSD_BOXES_MAX 16
+#define OSD_BOXES_TIMEOUT G_USEC_PER_SEC
+
+/**
+ * @brief Blend the clock (top left) and the sysinfo text (bottom left, may be NULL)
+ * into the frames leaving the src pad of the element.
+ */
+void osd_attach(GstElement *element, const gchar *sysinfo);
+
+typedef struct _OsdBoxes OsdBoxes;
+
+/**
+ * @brief Outline the detections in the frames leaving the src pad of the element.
+ * The boxes are given in a src_width x src_height frame (the analytics size) and scaled
+ * to the video they are drawn on. The returned handle lives as long as the pad.
+ */
+OsdBoxes *osd_boxes_attach(GstElement *element, gint src_width, gint src_height);
+
+/**
+ * @brief Replace the boxes, may be called from any thread. Boxes that are not
+ * refreshed are cleared after OSD_BOXES_TIMEOUT.
+ */
+void osd_boxes_set(OsdBoxes *boxes, const GstVideoRectangle *rects, guint count);
+
+#endif // _OSD_H
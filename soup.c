@@ -25,6 +25,7 @@
 #include "soup_const.h"
 #include "sql.h"
 #include "common_priv.h"
+#include "gst-app.h"
 #include <gst/gst.h>
 #include <gst/gstbin.h>
 
@@ -229,6 +230,116 @@ static void update_online_users() {
     g_list_free(keys);
 }
 
+// the recordings of a peer, stopped with it.
+static gchar *get_record_owner(WebrtcItem *webrtc_entry) {
+    return g_strdup_printf(RECORD_OWNER_PEER "-%" G_GUINT64_FORMAT, webrtc_entry->hash_id);
+}
+
+static void send_record_state(WebrtcItem *webrtc_entry, const gchar *name, const gchar *state) {
+    JsonObject *res_json, *data;
+    gchar *json_string;
+
+    data = json_object_new();
+    json_object_set_string_member(data, "name", name);
+    json_object_set_string_member(data, "state", state);
+    res_json = json_object_new();
+    json_object_set_string_member(res_json, "type", "record");
+    json_object_set_object_member(res_json, "data", data);
+    json_string = get_string_from_json_object(res_json);
+    json_object_unref(res_json);
+
+    soup_websocket_connection_send_text(webrtc_entry->connection, json_string);
+    g_free(json_string);
+}
+
+static void send_stats(SoupWebsocketConnection *connection) {
+    JsonObject *msg, *data, *fanout, *pool, *queue, *threads;
+    JsonArray *records;
+    GArray *sessions;
+    FanoutStats stats;
+    SendPoolStats pool_stats;
+    ClientQueueStats queue_stats;
+    ThreadStats thread_stats;
+    guint peers = g_hash_table_size(webrtc_connected_table);
+    gchar *text;
+
+    get_fanout_stats(&stats);
+    fanout = json_object_new();
+    json_object_set_int_member(fanout, "samples", stats.samples);
+    json_object_set_int_member(fanout, "shared", stats.shared);
+    json_object_set_int_member(fanout, "rebased", stats.rebased);
+    json_object_set_int_member(fanout, "payload_copies", stats.payload_copies);
+    json_object_set_int_member(fanout, "pushes", stats.pushes);
+    json_object_set_int_member(fanout, "subscribers", stats.subscribers);
+
+    get_send_pool_stats(&pool_stats);
+    pool = json_object_new();
+    json_object_set_int_member(pool, "size", pool_stats.size);
+    json_object_set_int_member(pool, "ready", pool_stats.ready);
+    json_object_set_int_member(pool, "hits", pool_stats.hits);
+    json_object_set_int_member(pool, "misses", pool_stats.misses);
+    json_object_set_int_member(pool, "built", pool_stats.built);
+
+    get_client_queue_stats(&queue_stats);
+    queue = json_object_new();
+    json_object_set_int_member(queue, "max_ms", queue_stats.max_ms);
+    json_object_set_int_member(queue, "congestions", queue_stats.congestions);
+    json_object_set_int_member(queue, "drops", queue_stats.drops);
+    json_object_set_int_member(queue, "keyframe_requests", queue_stats.keyframe_requests);
+
+    get_thread_stats(&thread_stats);
+    threads = json_object_new();
+    json_object_set_int_member(threads, "process", thread_stats.process);
+    json_object_set_int_member(threads, "main", thread_stats.main);
+    json_object_set_int_member(threads, "send", thread_stats.send);
+    json_object_set_int_member(threads, "recv", thread_stats.recv);
+    json_object_set_int_member(threads, "record", thread_stats.record);
+    json_object_set_int_member(threads, "budget", thread_stats.budget);
+    json_object_set_int_member(threads, "reserved", thread_stats.reserved);
+    json_object_set_int_member(threads, "peers", peers);
+    // the streaming threads of a peer pipeline, the ICE and DTLS ones only show in the process count.
+    // without a budget every peer that is not in the main pipeline has one.
+    if (!thread_stats.budget)
+        thread_stats.pipeline_peers = peers > thread_stats.single_peers ? peers - thread_stats.single_peers : 0;
+    json_object_set_double_member(threads, "send_per_peer",
+                                  thread_stats.pipeline_peers ? (gdouble)thread_stats.send / thread_stats.pipeline_peers : 0);
+    // a peer of the main pipeline still has its nicesrc, DTLS and SRTP tasks, and its queues.
+    json_object_set_int_member(threads, "single", thread_stats.single);
+    json_object_set_double_member(threads, "single_per_peer",
+                                  thread_stats.single_peers ? (gdouble)thread_stats.single / thread_stats.single_peers : 0);
+
+    sessions = get_record_sessions();
+    records = json_array_new();
+    for (guint i = 0; i < sessions->len; i++) {
+        RecordSessionStats *session = &g_array_index(sessions, RecordSessionStats, i);
+        JsonObject *record = json_object_new();
+        json_object_set_string_member(record, "name", session->name);
+        json_object_set_string_member(record, "owner", session->owner);
+        json_object_set_string_member(record, "path", session->path);
+        json_object_set_int_member(record, "start_time", session->start_time);
+        json_object_set_int_member(record, "bytes", session->bytes);
+        json_object_set_int_member(record, "dropped", session->dropped);
+        json_array_add_object_element(records, record);
+    }
+    g_array_unref(sessions);
+
+    data = json_object_new();
+    json_object_set_object_member(data, "fanout", fanout);
+    json_object_set_object_member(data, "pool", pool);
+    json_object_set_object_member(data, "client_queue", queue);
+    json_object_set_object_member(data, "threads", threads);
+    json_object_set_array_member(data, "records", records);
+
+    msg = json_object_new();
+    json_object_set_string_member(msg, "type", "stats");
+    json_object_set_object_member(msg, "data", data);
+    text = get_string_from_json_object(msg);
+
+    json_object_unref(msg);
+    soup_websocket_connection_send_text(connection, text);
+    g_free(text);
+}
+
 static void soup_websocket_message_cb(G_GNUC_UNUSED SoupWebsocketConnection *connection,
                                       SoupWebsocketDataType data_type, GBytes *message, gpointer user_data) {
     gsize size;
@@ -293,27 +404,20 @@ static void soup_websocket_message_cb(G_GNUC_UNUSED SoupWebsocketConnection *con
         const gchar *cmd_data;
         cmd_type_string = json_object_get_string_member(root_json_object, type_string);
         if (!g_strcmp0(cmd_type_string, "record")) {
+            const gchar *name = json_object_get_string_member_with_default(root_json_object, "name", NULL);
+            gchar *owner = get_record_owner(webrtc_entry);
             cmd_data = json_object_get_string_member(root_json_object, "arg");
             if (!g_strcmp0(cmd_data, "start")) {
-                if (webrtc_entry->record.get_rec_state()) {
-                    // have someone recording in process.
-                    JsonObject *res_json;
-                    gchar *json_string;
-                    res_json = json_object_new();
-                    json_object_set_string_member(res_json, "type", "record");
-                    json_object_set_string_member(res_json, "data", "started");
-                    json_string = get_string_from_json_object(res_json);
-                    json_object_unref(res_json);
-
-                    soup_websocket_connection_send_text(webrtc_entry->connection, json_string);
-                    g_free(json_string);
-                    g_print("Has recording in process!!!\n");
-                    goto cleanup;
-                }
-                webrtc_entry->record.start((gpointer)&webrtc_entry->record);
+                // each peer records its own session, on the same encoded stream.
+                const gchar *started = record_session_start(name, owner);
+                send_record_state(webrtc_entry, started ? started : name, started ? "started" : "failed");
+            } else if (name) {
+                send_record_state(webrtc_entry, name, record_session_stop(name, owner) ? "stopped" : "failed");
             } else {
-                webrtc_entry->record.stop((gpointer)&webrtc_entry->record);
+                record_session_stop_owner(owner);
+                send_record_state(webrtc_entry, NULL, "stopped");
             }
+            g_free(owner);
             goto cleanup;
         } else if (!g_strcmp0(cmd_type_string, "talk")) {
             cmd_data = json_object_get_string_member(root_json_object, "arg");
@@ -326,6 +430,9 @@ static void soup_websocket_message_cb(G_GNUC_UNUSED SoupWebsocketConnection *con
                 }
             }
             goto cleanup;
+        } else if (!g_strcmp0(cmd_type_string, "stats")) {
+            send_stats(webrtc_entry->connection);
+            goto cleanup;
         }
     } else if (!json_object_has_member(root_json_object, "data")) {
         g_print("Received message without data field\n");
@@ -511,6 +618,7 @@ static void soup_websocket_handler(G_GNUC_UNUSED SoupServer *server,
     webrtc_entry->send_channel = NULL;
     webrtc_entry->receive_channel = NULL;
     webrtc_entry->hash_id = (u_long)(webrtc_entry->connection);
+    webrtc_entry->setup_start = g_get_monotonic_time();
 
     g_object_ref(G_OBJECT(connection));
 
@@ -533,6 +641,7 @@ static void soup_websocket_handler(G_GNUC_UNUSED SoupServer *server,
 
 static void destroy_webrtc_table(gpointer entry_ptr) {
     WebrtcItem *webrtc_entry = (WebrtcItem *)entry_ptr;
+    gchar *owner;
     g_assert(webrtc_entry != NULL);
     g_print("destroy client: %" G_GUINT64_FORMAT " \n", webrtc_entry->hash_id);
     // const gchar *host = soup_client_context_get_host(webrtc_entry->client);
@@ -546,9 +655,9 @@ static void destroy_webrtc_table(gpointer entry_ptr) {
         webrtc_entry->stop_webrtc(webrtc_entry);
     }
 
-    if (webrtc_entry->record.pipeline != NULL) {
-        webrtc_entry->record.stop((gpointer)&webrtc_entry->record);
-    }
+    owner = get_record_owner(webrtc_entry);
+    record_session_stop_owner(owner);
+    g_free(owner);
 
     if (webrtc_entry->recv.recvpipe != NULL) {
         webrtc_entry->recv.stop_recv(&webrtc_entry->recv);
@@ -39,18 +39,33 @@
 
 typedef void (*user_cb)(gpointer user_data);
 typedef void (*appsink_signal_opt)(gpointer user_data);
-typedef int (*get_state)(void);
+struct _ClientQueue {
+    gint max_ms;                 // video backlog of the peer before the keyframe-aware drop, 0 for none.
+    gboolean congested;          // dropping until a keyframe fits.
+    gboolean keyframe_requested; // once per congestion.
+    gboolean started;
+    gint pushed_ms;              // running time of the last packet into the queue.
+    gint sent_ms;                // and out of it, set by its streaming thread.
+};
+
 struct _AppsrcAvPair{
     GstElement *video_src;
     GstElement *audio_src;
-};
-
-struct _RecordItem {
-    GstElement *pipeline;
-    user_cb start;
-    user_cb stop;
-    get_state get_rec_state;
-    struct _AppsrcAvPair rec_avpair;
+    gint layer;         // simulcast layer in use.
+    gint pending_layer; // switch to it at the next keyframe.
+    gboolean auto_layer; // follow the bitrate estimate.
+    gboolean base_layer_only;    // forward the temporal base layer only.
+    gboolean pending_base_layer; // apply it at the next TL0 frame.
+    gboolean gop_replay;         // push the cached GOP before the live packets.
+    gboolean wait_keyframe;      // drop the delta packets until the requested keyframe.
+    GstCaps *video_caps;         // caps of the shared payloaders, set on the appsrcs once.
+    GstCaps *audio_caps;
+    gboolean rtp_started;        // the RTP rewrite below follows the first video packet.
+    guint32 rtp_ssrc;            // SSRC the peer sees.
+    guint32 rtp_ssrc_in;         // SSRC of the layer in use.
+    guint16 rtp_seq_delta;       // added to the sequence of the layer in use.
+    guint16 rtp_last_seq;
+    struct _ClientQueue client_queue;
 };
 
 struct _RecvItem {
@@ -67,6 +82,11 @@ struct _DcFile {
     gint64 pos;
 };
 
+struct _AbrItem {
+    guint timer_id; // get-stats polling source.
+    guint bitrate;  // kbps estimate of this peer.
+};
+
 /* Structure to contain all our information, so we can pass it to callbacks */
 struct _WebrtcItem {
     SoupWebsocketConnection *connection;
@@ -78,19 +98,20 @@ struct _WebrtcItem {
     appsink_signal_opt signal_add;
     appsink_signal_opt signal_remove;
     guint64 hash_id; // hash value for connection;
-    struct _RecordItem record;
     struct _RecvItem recv;
     struct _DcFile dcfile;
+    struct _AbrItem abr;
     GObject *send_channel;
     GObject *receive_channel;
+    gpointer send_branch;        // its branch of the single pipeline.
+    gint64 setup_start; // monotonic time of the websocket connection, until the peer is connected.
+    gint reserved_threads; // of webrtc.thread_budget, while it has a send pipeline.
 };
 typedef struct _WebrtcItem WebrtcItem;
 typedef struct _RecvItem RecvItem;
 
 typedef void (*webrtc_callback)(WebrtcItem *item);
 
-typedef struct _RecordItem RecordItem;
-
 void start_http(webrtc_callback fn, int port, int clients);
 
 #endif // _SOUP_H
\ No newline at end of file
@@ -0,0 +1,120 @@
+/* gst-webrtc-camera
+ * Copyright (C) 2023 chunyang liu <yjdwbj@gmail.com>
+ *
+ *
+ * thread_sched.c:  CPU affinity and scheduling class of the streaming threads
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include "thread_sched.h"
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+extern GstConfigData config_data;
+
+static const gchar *branch_names[SCHED_BRANCHES] = {"capture", "encode", "analytics", "hls", "record", "webrtc", "http"};
+static cpu_set_t process_cpus;
+// the scheduling the process was started with, i.e. by nice, chrt or systemd.
+static int process_policy;
+static struct sched_param process_param;
+static int process_nice;
+static cpu_set_t branch_cpus[SCHED_BRANCHES];
+static gboolean enabled = FALSE;
+static gint fifo_warned = 0;
+
+const gchar *thread_sched_branch_name(gint branch) {
+    return branch >= 0 && branch < SCHED_BRANCHES ? branch_names[branch] : NULL;
+}
+
+// "0-3,6" as the kernel cpulist format.
+static gboolean parse_cpus(const gchar *cpus, cpu_set_t *set) {
+    gchar **ranges = g_strsplit(cpus, ",", -1);
+    gboolean ok = TRUE;
+
+    CPU_ZERO(set);
+    for (gchar **range = ranges; *range && ok; range++) {
+        gchar *end = NULL;
+        guint64 first = g_ascii_strtoull(*range, &end, 10), last = first;
+        if (end == *range) {
+            ok = FALSE;
+            break;
+        }
+        if (*end == '-')
+            last = g_ascii_strtoull(end + 1, NULL, 10);
+        for (guint64 cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+            CPU_SET(cpu, set);
+    }
+    g_strfreev(ranges);
+    return ok && CPU_COUNT(set) > 0;
+}
+
+void thread_sched_init() {
+    sched_getaffinity(0, sizeof(process_cpus), &process_cpus);
+    pthread_getschedparam(pthread_self(), &process_policy, &process_param);
+    process_nice = getpriority(PRIO_PROCESS, 0);
+    for (gint i = 0; i < SCHED_BRANCHES; i++) {
+        struct _sched_branch *branch = &config_data.sched[i];
+        branch_cpus[i] = process_cpus;
+        if (branch->cpus && *branch->cpus) {
+            if (parse_cpus(branch->cpus, &branch_cpus[i]))
+                enabled = TRUE;
+            else {
+                g_printerr("invalid CPU set \"%s\" of the %s threads.\n", branch->cpus, branch_names[i]);
+                branch_cpus[i] = process_cpus;
+            }
+        }
+        if (branch->fifo || branch->nice)
+            enabled = TRUE;
+    }
+}
+
+void thread_sched_apply(gint branch, const gchar *name) {
+    struct _sched_branch *sched;
+    struct sched_param param = {0};
+    pthread_t self = pthread_self();
+
+    if (!enabled || branch < 0 || branch >= SCHED_BRANCHES)
+        return;
+    sched = &config_data.sched[branch];
+    if (name) {
+        // 15 characters at most.
+        gchar *thread_name = g_strndup(name, 15);
+        pthread_setname_np(self, thread_name);
+        g_free(thread_name);
+    }
+    pthread_setaffinity_np(self, sizeof(cpu_set_t), &branch_cpus[branch]);
+    if (sched->fifo) {
+        param.sched_priority = CLAMP(sched->priority, sched_get_priority_min(SCHED_FIFO), sched_get_priority_max(SCHED_FIFO));
+        if (pthread_setschedparam(self, SCHED_FIFO, &param) && g_atomic_int_compare_and_exchange(&fifo_warned, 0, 1))
+            g_printerr("unable to set SCHED_FIFO for the %s threads, it needs CAP_SYS_NICE.\n", branch_names[branch]);
+        return;
+    }
+    // the nice value is per thread on Linux.
+    if (sched->nice) {
+        pthread_setschedparam(self, SCHED_OTHER, &param);
+        setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), CLAMP(sched->nice, -20, 19));
+        return;
+    }
+    // not set for this branch, back to the ones of the process.
+    pthread_setschedparam(self, process_policy, &process_param);
+    setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), process_nice);
+}
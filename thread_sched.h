@@ -0,0 +1,42 @@
+/* gst-webrtc-camera
+ * Copyright (C) 2023 chunyang liu <yjdwbj@gmail.com>
+ *
+ *
+ * thread_sched.h:  CPU affinity and scheduling class of the streaming threads
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+#ifndef _THREAD_SCHED_H
+#define _THREAD_SCHED_H
+#include "data_struct.h"
+
+/**
+ * @brief Keep the affinity of the process, that the branches without a CPU set go back to.
+ * Called once from the main thread, before any pipeline is created.
+ */
+void thread_sched_init();
+
+/**
+ * @brief Name the calling thread after its branch when name is set, pin it to the CPU set of the branch
+ * and set its scheduling class. The streaming threads are reused across the branches, so every attribute
+ * is set again, back to the process defaults for the branch that does not change it.
+ */
+void thread_sched_apply(gint branch, const gchar *name);
+
+// the config key of a branch, NULL past the last one.
+const gchar *thread_sched_branch_name(gint branch);
+
+#endif // _THREAD_SCHED_H
@@ -12,6 +12,7 @@ var sendVoice;
 
 let reconnectTimerId;
 let isRecord = false;
+let recordArg;
 let isTalk = false;
 let isVoiceRecord = false;
 
@@ -591,7 +592,8 @@ window.onload = function () {
     isRecord = !isRecord;
     startRecord.innerHTML = isRecord ? "Stop Record" : "Start Record";
     if (websocketConnection != undefined) {
-      websocketConnection.send(JSON.stringify({ "type": "cmd", "cmd": "record", "arg": isRecord ? "start" : "stop" }));
+      recordArg = isRecord ? "start" : "stop";
+      websocketConnection.send(JSON.stringify({ "type": "cmd", "cmd": "record", "arg": recordArg }));
     }
   });
 
@@ -830,8 +832,11 @@ async function onIncomingICE(ice) {
 }
 
 function recordCallBack(data) {
-  alert("Recording thread is already running!!!");
-  isRecord = false;
+  if (data.state != "failed")
+    return;
+  // the failed command leaves the record as it was before the click.
+  isRecord = recordArg == "stop";
+  alert("Recording " + (data.name ? data.name + " " : "") + "could not be " + (isRecord ? "stopped" : "started") + "!!!");
   startRecord.innerHTML = isRecord ? "Stop Record" : "Start Record";
 }
 